@@ -0,0 +1,202 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+
+/* Precedes every allocation, block is NULL for allocations carved from a chunk */
+typedef struct arena_tag_s {
+    struct arena_block_s *block;
+    size_t reserved;
+} arena_tag_t;
+
+/* tag is the last member, so it sits right before the block data */
+typedef struct arena_block_s {
+    struct arena_block_s *next;
+    size_t capacity;
+    /* size of the huge page mapping, 0 if the block came from malloc */
+    size_t map_size;
+    /* used: requested or freed since the last arena_reset() */
+    int in_use, used;
+    arena_tag_t tag;
+} arena_block_t;
+
+typedef struct arena_chunk_s {
+    struct arena_chunk_s *next;
+    size_t fill;
+} arena_chunk_t;
+
+struct arena_s {
+    int flags;
+    arena_block_t *blocks;
+    arena_chunk_t *chunks, *current;
+    uint64_t requests, mallocs;
+};
+
+arena_t *arena_create(int flags) {
+    arena_t *arena = calloc(1, sizeof(arena_t));
+    if (arena) {
+        arena->flags = flags;
+    }
+    return arena;
+}
+
+static void block_release(arena_block_t *block) {
+#if defined(__linux__)
+    if (block->map_size > 0) {
+        munmap(block, block->map_size);
+        return;
+    }
+#endif
+    free(block);
+}
+
+void arena_destroy(arena_t *arena) {
+    if (!arena) {
+        return;
+    }
+    while (arena->blocks) {
+        arena_block_t *next = arena->blocks->next;
+        block_release(arena->blocks);
+        arena->blocks = next;
+    }
+    while (arena->chunks) {
+        arena_chunk_t *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+    free(arena);
+}
+
+static void *alloc_small(arena_t *arena, size_t size) {
+    arena_tag_t *tag;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (!arena->current || arena->current->fill + sizeof(arena_tag_t) + size > ARENA_CHUNK_SIZE) {
+        arena_chunk_t *chunk = arena->current ? arena->current->next : arena->chunks;
+        if (!chunk) {
+            chunk = malloc(ARENA_CHUNK_SIZE);
+            if (!chunk) {
+                return NULL;
+            }
+            ++arena->mallocs;
+            chunk->next = NULL;
+            if (arena->current) {
+                arena->current->next = chunk;
+            } else {
+                arena->chunks = chunk;
+            }
+        }
+        chunk->fill = sizeof(arena_chunk_t);
+        arena->current = chunk;
+    }
+    tag = (arena_tag_t*)((uint8_t*)arena->current + arena->current->fill);
+    tag->block = NULL;
+    arena->current->fill += sizeof(arena_tag_t) + size;
+    return tag + 1;
+}
+
+static void *alloc_block(arena_t *arena, size_t size) {
+    arena_block_t *block, *best = NULL;
+    size_t total;
+    /* best fit among free blocks at most twice the request, larger ones are left for larger tables */
+    for (block = arena->blocks; block; block = block->next) {
+        if (!block->in_use && block->capacity >= size && block->capacity / 2 <= size
+            && (!best || block->capacity < best->capacity)) {
+            best = block;
+        }
+    }
+    if (!best) {
+        total = sizeof(arena_block_t) + size;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if ((arena->flags & ARENA_HUGE_PAGES) && size >= ARENA_HUGE_MIN) {
+            size_t map_size = (total + ARENA_HUGE_MIN - 1) & ~(size_t)(ARENA_HUGE_MIN - 1);
+            void *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, map_size, MADV_HUGEPAGE);
+                best = p;
+                best->map_size = map_size;
+            }
+        }
+#endif
+        if (!best) {
+            best = malloc(total);
+            if (!best) {
+                return NULL;
+            }
+            best->map_size = 0;
+        }
+        ++arena->mallocs;
+        best->capacity = size;
+        best->tag.block = best;
+        best->next = arena->blocks;
+        arena->blocks = best;
+    }
+    best->in_use = 1;
+    best->used = 1;
+    return best + 1;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    ++arena->requests;
+    if (size <= ARENA_SMALL_MAX && !(arena->flags & ARENA_PERSISTENT)) {
+        return alloc_small(arena, size);
+    }
+    return alloc_block(arena, size);
+}
+
+void arena_free(arena_t *arena, void *ptr) {
+    arena_tag_t *tag;
+    (void)arena;
+    if (!ptr) {
+        return;
+    }
+    tag = (arena_tag_t*)ptr - 1;
+    if (tag->block) {
+        tag->block->in_use = 0;
+        tag->block->used = 1;
+    }
+}
+
+void arena_reset(arena_t *arena) {
+    arena_block_t **link = &arena->blocks;
+    if (!(arena->flags & ARENA_PERSISTENT)) {
+        arena_block_t *block;
+        arena_chunk_t *chunk;
+        for (block = arena->blocks; block; block = block->next) {
+            block->in_use = 0;
+        }
+        /* chunks this entry did not reach are returned, the others are refilled from the start */
+        chunk = arena->current ? arena->current->next : arena->chunks;
+        if (arena->current) {
+            arena->current->next = NULL;
+        } else {
+            arena->chunks = NULL;
+        }
+        while (chunk) {
+            arena_chunk_t *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        arena->current = NULL;
+    }
+    while (*link) {
+        arena_block_t *block = *link;
+        if (!block->in_use && !block->used) {
+            *link = block->next;
+            block_release(block);
+            continue;
+        }
+        block->used = 0;
+        link = &block->next;
+    }
+}
+
+void arena_stats(const arena_t *arena, uint64_t *requests, uint64_t *mallocs) {
+    *requests = arena ? arena->requests : 0;
+    *mallocs = arena ? arena->mallocs : 0;
+}
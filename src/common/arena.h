@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Allocator for the xdelta3 streams and LZMA coders of one thread, reused from entry to entry.
+ * Requests up to ARENA_SMALL_MAX are carved from shared chunks and only come back at arena_reset(),
+ * larger ones are blocks that arena_free() puts on a free list for later requests of similar size.
+ * Not thread safe, each thread (or lock holder) uses its own arena */
+
+#define ARENA_SMALL_MAX (64 * 1024)
+/* Blocks from this size on go on transparent huge pages with ARENA_HUGE_PAGES (Linux only) */
+#define ARENA_HUGE_MIN (2 * 1024 * 1024)
+
+/* Every allocation is a block on the free lists, for owners that outlive an entry (pooled LZMA coders) */
+#define ARENA_PERSISTENT (1 << 0)
+#define ARENA_HUGE_PAGES (1 << 1)
+
+typedef struct arena_s arena_t;
+
+extern arena_t *arena_create(int flags);
+extern void arena_destroy(arena_t *arena);
+/* Memory is 16-byte aligned and not cleared, returns NULL if out of memory */
+extern void *arena_alloc(arena_t *arena, size_t size);
+extern void arena_free(arena_t *arena, void *ptr);
+/* Ends an entry: releases every allocation unless the arena is persistent,
+ * and returns the free blocks no request used since the last reset to the system */
+extern void arena_reset(arena_t *arena);
+/* Requests served, and how many of them needed a system allocation */
+extern void arena_stats(const arena_t *arena, uint64_t *requests, uint64_t *mallocs);
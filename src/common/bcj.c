@@ -0,0 +1,168 @@
+#include "bcj.h"
+
+#include <string.h>
+
+static inline uint16_t read16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void write32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+/* E8/E9 (call/jmp rel32) converter of the LZMA SDK (Bra86.c, public domain) */
+#define TEST_86_MS_BYTE(b) ((((b) + 1) & 0xFE) == 0)
+
+static void convert_x86(uint8_t *data, size_t size, uint32_t ip, int encoding) {
+    size_t pos = 0;
+    uint32_t mask = 0;
+    if (size < 5) {
+        return;
+    }
+    size -= 4;
+    ip += 5;
+    for (;;) {
+        uint8_t *p = data + pos;
+        const uint8_t *limit = data + size;
+        size_t d;
+        for (; p < limit; p++) {
+            if ((*p & 0xFE) == 0xE8) {
+                break;
+            }
+        }
+        d = (size_t)(p - data) - pos;
+        pos = (size_t)(p - data);
+        if (p >= limit) {
+            return;
+        }
+        if (d > 2) {
+            mask = 0;
+        } else {
+            mask >>= (unsigned)d;
+            if (mask != 0 && (mask > 4 || mask == 3 || TEST_86_MS_BYTE(p[(mask >> 1) + 1]))) {
+                mask = (mask >> 1) | 4;
+                pos++;
+                continue;
+            }
+        }
+        if (TEST_86_MS_BYTE(p[4])) {
+            uint32_t v = read32(p + 1);
+            uint32_t cur = ip + (uint32_t)pos;
+            pos += 5;
+            if (encoding) {
+                v += cur;
+            } else {
+                v -= cur;
+            }
+            if (mask != 0) {
+                unsigned sh = (mask & 6) << 2;
+                if (TEST_86_MS_BYTE((uint8_t)(v >> sh))) {
+                    v ^= ((uint32_t)0x100 << sh) - 1;
+                    if (encoding) {
+                        v += cur;
+                    } else {
+                        v -= cur;
+                    }
+                }
+                mask = 0;
+            }
+            p[1] = (uint8_t)v;
+            p[2] = (uint8_t)(v >> 8);
+            p[3] = (uint8_t)(v >> 16);
+            p[4] = (uint8_t)(0 - ((v >> 24) & 1));
+        } else {
+            mask = (mask >> 1) | 4;
+            pos++;
+        }
+    }
+}
+
+/* BL and ADRP, the two AArch64 instructions whose immediates are PC-relative addresses */
+static void convert_arm64(uint8_t *data, size_t size, uint32_t ip, int encoding) {
+    size_t i;
+    size &= ~(size_t)3;
+    for (i = 0; i < size; i += 4) {
+        uint32_t insn = read32(data + i);
+        uint32_t pc = ip + (uint32_t)i;
+        if ((insn >> 26) == 0x25) {
+            uint32_t v = pc >> 2;
+            if (!encoding) {
+                v = 0 - v;
+            }
+            write32(data + i, 0x94000000 | ((insn + v) & 0x03FFFFFF));
+        } else if ((insn & 0x9F000000) == 0x90000000) {
+            /* only pages within +-512 MiB, the 18 bits kept are sign extended again on the way back */
+            uint32_t src = ((insn >> 29) & 3) | ((insn >> 3) & 0x001FFFFC);
+            uint32_t dest, v;
+            if ((src + 0x00020000) & 0x001C0000) {
+                continue;
+            }
+            v = pc >> 12;
+            if (!encoding) {
+                v = 0 - v;
+            }
+            dest = src + v;
+            insn &= 0x9000001F;
+            insn |= (dest & 3) << 29;
+            insn |= (dest & 0x0003FFFC) << 3;
+            insn |= (0 - (dest & 0x00020000)) & 0x00E00000;
+            write32(data + i, insn);
+        }
+    }
+}
+
+void bcj_convert(int filter, uint8_t *data, size_t size, uint64_t offset, int encoding) {
+    size_t pos;
+    for (pos = 0; pos < size; pos += BCJ_BLOCK_SIZE) {
+        size_t n = size - pos < BCJ_BLOCK_SIZE ? size - pos : BCJ_BLOCK_SIZE;
+        uint32_t ip = (uint32_t)(offset + pos);
+        switch (filter) {
+        case BCJ_X86:
+            convert_x86(data + pos, n, ip, encoding);
+            break;
+        case BCJ_ARM64:
+            convert_arm64(data + pos, n, ip, encoding);
+            break;
+        default:
+            return;
+        }
+    }
+}
+
+int bcj_detect(const uint8_t *data, size_t size) {
+    if (size >= 20 && !memcmp(data, "\x7F" "ELF", 4) && data[5] == 1) {
+        switch (read16(data + 18)) {
+        case 3:   /* EM_386 */
+        case 62:  /* EM_X86_64 */
+            return BCJ_X86;
+        case 183: /* EM_AARCH64 */
+            return BCJ_ARM64;
+        }
+    } else if (size >= 0x40 && data[0] == 'M' && data[1] == 'Z') {
+        uint32_t pe = read32(data + 0x3C);
+        if (pe <= size - 6 && !memcmp(data + pe, "PE\0\0", 4)) {
+            switch (read16(data + pe + 4)) {
+            case 0x014C:
+            case 0x8664:
+                return BCJ_X86;
+            case 0xAA64:
+                return BCJ_ARM64;
+            }
+        }
+    } else if (size >= 8 && read32(data) == 0xFEEDFACF) {
+        switch (read32(data + 4)) {
+        case 0x01000007:
+            return BCJ_X86;
+        case 0x0100000C:
+            return BCJ_ARM64;
+        }
+    }
+    return BCJ_NONE;
+}
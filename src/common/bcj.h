@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Branch converters (BCJ): relative call/branch targets in machine code are turned into
+ * absolute ones, so code that only moved between two builds becomes identical again.
+ * Files are converted in independent BCJ_BLOCK_SIZE blocks, so any block can be converted
+ * on its own knowing only its file offset */
+
+#define BCJ_BLOCK_SIZE (256 * 1024)
+
+enum {
+    BCJ_NONE = 0,
+    BCJ_X86 = 1,
+    BCJ_ARM64 = 2,
+};
+
+/* Converts `size` bytes starting at file offset `offset` (a multiple of BCJ_BLOCK_SIZE),
+ * `encoding` selects the forward conversion, 0 undoes it */
+extern void bcj_convert(int filter, uint8_t *data, size_t size, uint64_t offset, int encoding);
+/* Guesses the filter from an ELF, PE or Mach-O header, BCJ_NONE for anything else */
+extern int bcj_detect(const uint8_t *data, size_t size);
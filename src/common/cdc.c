@@ -0,0 +1,124 @@
+#include "cdc.h"
+
+#include <string.h>
+
+#define CDC_COPY_CHUNK (64 * 1024)
+
+static uint64_t gear[256];
+static int gear_ready = 0;
+
+/* The table only has to be fixed and well mixed, splitmix64 from a constant seed gives both */
+static void gear_init() {
+    uint64_t seed = 0x5350415443484344ULL;
+    int i;
+    for (i = 0; i < 256; ++i) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gear_ready = 1;
+}
+
+void cdc_init(cdc_params_t *params, uint32_t avg_size) {
+    int bits = 8;
+    if (!gear_ready) {
+        gear_init();
+    }
+    while (bits < 24 && (1U << (bits + 1)) <= avg_size) {
+        ++bits;
+    }
+    params->avg_size = 1U << bits;
+    params->min_size = params->avg_size / 4;
+    params->max_size = params->avg_size * 8;
+    /* the gear hash shifts left, so its top bits depend on the most recent bytes */
+    params->mask_s = ~0ULL << (64 - (bits + 2));
+    params->mask_l = ~0ULL << (64 - (bits - 2));
+}
+
+size_t cdc_cut(const cdc_params_t *params, const uint8_t *data, size_t size) {
+    size_t i, normal = params->avg_size, max = params->max_size;
+    uint64_t fp = 0;
+    if (size <= params->min_size) {
+        return size;
+    }
+    if (max > size) max = size;
+    if (normal > max) normal = max;
+    for (i = params->min_size; i < normal; ++i) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & params->mask_s)) {
+            return i + 1;
+        }
+    }
+    for (; i < max; ++i) {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & params->mask_l)) {
+            return i + 1;
+        }
+    }
+    return max;
+}
+
+void cdc_apply_init(cdc_apply_t *state, cdc_read_t read, cdc_write_t write, void *opaque) {
+    memset(state, 0, sizeof(cdc_apply_t));
+    state->read = read;
+    state->write = write;
+    state->opaque = opaque;
+}
+
+static int apply_copy(cdc_apply_t *state) {
+    uint8_t buf[CDC_COPY_CHUNK];
+    while (state->copy_left > 0) {
+        uint32_t n = state->copy_left < CDC_COPY_CHUNK ? state->copy_left : CDC_COPY_CHUNK;
+        if (state->read(state->opaque, state->source, state->offset, buf, n) != 0
+            || state->write(state->opaque, buf, n) != 0) {
+            return -1;
+        }
+        state->offset += n;
+        state->copy_left -= n;
+        state->total += n;
+    }
+    return 0;
+}
+
+int cdc_apply(cdc_apply_t *state, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        size_t n;
+        if (state->literal_left > 0) {
+            n = state->literal_left < size ? state->literal_left : size;
+            if (state->write(state->opaque, data, n) != 0) {
+                return -1;
+            }
+            state->literal_left -= n;
+            state->total += n;
+        } else {
+            uint32_t header[4];
+            n = CDC_RECORD_SIZE - state->header_fill;
+            if (n > size) n = size;
+            memcpy(state->header + state->header_fill, data, n);
+            state->header_fill += n;
+            if (state->header_fill < CDC_RECORD_SIZE) {
+                break;
+            }
+            state->header_fill = 0;
+            memcpy(header, state->header, CDC_RECORD_SIZE);
+            if (header[1] > 0xFFFFFFFFU - header[3]) {
+                return -1;
+            }
+            state->literal_left = header[0];
+            state->copy_left = header[1];
+            state->source = header[2];
+            state->offset = header[3];
+        }
+        data += n;
+        size -= n;
+        if (state->literal_left == 0 && state->copy_left > 0 && apply_copy(state) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int cdc_apply_finish(const cdc_apply_t *state) {
+    return state->header_fill == 0 && state->literal_left == 0 && state->copy_left == 0 ? 0 : -1;
+}
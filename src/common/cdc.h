@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Content-defined chunking (FastCDC): cut points come from a gear rolling hash of the data itself,
+ * so a run of bytes moved to another offset or another file is cut into the same chunks there.
+ * Normalized chunking uses a harder mask before the average size and an easier one after it */
+
+typedef struct cdc_params_s {
+    uint32_t min_size, avg_size, max_size;
+    uint64_t mask_s, mask_l;
+} cdc_params_t;
+
+/* avg_size is rounded down to a power of two, chunks are avg_size / 4 to avg_size * 8 bytes */
+extern void cdc_init(cdc_params_t *params, uint32_t avg_size);
+/* Length of the chunk starting at data, size if the rest is shorter than a chunk */
+extern size_t cdc_cut(const cdc_params_t *params, const uint8_t *data, size_t size);
+
+/* A file rebuilt from chunks of other files is a sequence of records: uint32_t literal length,
+ * uint32_t copy length, uint32_t source index, uint32_t source offset, then `literal` bytes.
+ * The literal bytes are written first, then `copy` bytes read from the source at the offset */
+#define CDC_RECORD_SIZE 16
+
+typedef int (*cdc_write_t)(void *opaque, const uint8_t *data, size_t size);
+/* Reads size bytes of source `source` at `offset` into buf, returns 0 or -1 */
+typedef int (*cdc_read_t)(void *opaque, uint32_t source, uint32_t offset, uint8_t *buf, uint32_t size);
+
+typedef struct cdc_apply_s {
+    cdc_read_t read;
+    cdc_write_t write;
+    void *opaque;
+    uint8_t header[CDC_RECORD_SIZE];
+    size_t header_fill;
+    uint32_t literal_left, copy_left, source, offset;
+    uint64_t total;
+} cdc_apply_t;
+
+extern void cdc_apply_init(cdc_apply_t *state, cdc_read_t read, cdc_write_t write, void *opaque);
+/* Feeds the next `size` record bytes, returns 0, or -1 on a failed read or write */
+extern int cdc_apply(cdc_apply_t *state, const uint8_t *data, size_t size);
+/* Returns 0 if the records ended on a record boundary */
+extern int cdc_apply_finish(const cdc_apply_t *state);
@@ -0,0 +1,161 @@
+#include "lz77.h"
+
+#include <string.h>
+
+/* Sequence: token (literal count << 4 | match length - 4), extra literal count bytes,
+ * literals, then unless the block ends here: 16-bit offset and extra match length bytes.
+ * A nibble of 15 is continued by bytes added up until one is below 255 */
+
+#define MIN_MATCH 4
+#define HASH_BITS 14
+#define MAX_OFFSET 65535
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+size_t lz77_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+static uint8_t *write_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+size_t lz77_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity) {
+    uint32_t table[1 << HASH_BITS];
+    const uint8_t *ip = src, *anchor = src;
+    const uint8_t *iend = src + size;
+    /* Matches are not started in the last bytes so the hash read stays inside the input */
+    const uint8_t *mflimit = size > 12 ? iend - 12 : src;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + capacity;
+    size_t lit;
+
+    if (capacity < lz77_bound(size)) {
+        return 0;
+    }
+    memset(table, 0, sizeof(table));
+    if (size > 12) {
+        ++ip;
+    }
+    while (ip < mflimit) {
+        uint32_t h = hash4(read32(ip));
+        const uint8_t *ref = src + table[h];
+        size_t match_len, token_match;
+        table[h] = (uint32_t)(ip - src);
+        if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+            /* Step faster through data that does not match */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            --ip;
+            --ref;
+        }
+        match_len = MIN_MATCH;
+        while (ip + match_len < iend && ip[match_len] == ref[match_len]) {
+            ++match_len;
+        }
+        lit = ip - anchor;
+        token_match = match_len - MIN_MATCH;
+        *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4 | (token_match >= 15 ? 15 : token_match));
+        if (lit >= 15) {
+            op = write_length(op, lit - 15);
+        }
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (uint8_t)(ip - ref);
+        *op++ = (uint8_t)((ip - ref) >> 8);
+        if (token_match >= 15) {
+            op = write_length(op, token_match - 15);
+        }
+        ip += match_len;
+        anchor = ip;
+        if (ip < mflimit) {
+            table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+    lit = iend - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > oend) {
+        return 0;
+    }
+    *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) {
+        op = write_length(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+int64_t lz77_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity) {
+    const uint8_t *ip = src, *iend = src + size;
+    uint8_t *op = dst, *oend = dst + capacity;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, match_len;
+        size_t offset;
+        const uint8_t *ref;
+        if (lit == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return -1;
+            memcpy(op, ip, lit);
+        }
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break;
+        }
+        if (iend - ip < 2) return -1;
+        offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        match_len = (token & 15) + MIN_MATCH;
+        if ((token & 15) == 15) {
+            unsigned b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < match_len) return -1;
+        ref = op - offset;
+        if (offset >= 8 && (size_t)(oend - op) >= match_len + 8) {
+            /* Copies may run up to 7 bytes past the match, those are rewritten later */
+            uint8_t *end = op + match_len;
+            do {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            } while (op < end);
+            op = end;
+        } else {
+            while (match_len--) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op - dst;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Byte-oriented LZ77 codec for the fast compression tier.
+ * Blocks are independent and decode into a flat buffer, matches reach back at most 64 KiB */
+
+#define LZ77_BLOCK_SIZE (256 * 1024)
+
+/* Worst case compressed size of `size` input bytes */
+extern size_t lz77_bound(size_t size);
+/* Returns the compressed size, or 0 if the result would not fit in `capacity` */
+extern size_t lz77_compress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
+/* Returns the decompressed size, or -1 if the block is malformed or does not fit in `capacity` */
+extern int64_t lz77_decompress(const uint8_t *src, size_t size, uint8_t *dst, size_t capacity);
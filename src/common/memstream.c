@@ -59,6 +59,8 @@ size_t memstream_read(memstream_t *stm, void *data, size_t size) {
             entry = entry->next;
             stm->read_pos = 0;
             stm->head = entry;
+            free(last->data);
+            free(last);
             if (entry == NULL) {
                 stm->tail = NULL;
                 break;
@@ -70,6 +72,27 @@ size_t memstream_read(memstream_t *stm, void *data, size_t size) {
     return size;
 }
 
+size_t memstream_peek(memstream_t *stm, size_t offset, void *data, size_t size) {
+    uint8_t *output = data;
+    size_t left = size;
+    size_t pos = stm->read_pos + offset;
+    struct memstream_entry_s *entry = stm->head;
+    while (entry && pos >= entry->size) {
+        pos -= entry->size;
+        entry = entry->next;
+    }
+    while (entry && left) {
+        size_t to_read = entry->size - pos;
+        if (to_read > left) { to_read = left; }
+        memcpy(output, entry->data + pos, to_read);
+        output += to_read;
+        left -= to_read;
+        pos = 0;
+        entry = entry->next;
+    }
+    return size - left;
+}
+
 size_t memstream_size(memstream_t *stm) {
     return stm->total;
 }
@@ -79,6 +102,7 @@ void memstream_destroy(memstream_t *stm) {
     while (entry) {
         struct memstream_entry_s *last = entry;
         entry = entry->next;
+        free(last->data);
         free(last);
     }
     free(stm);
@@ -1,7 +1,9 @@
 #pragma once
 
-#define SPATCH_FORMAT_VERSION 0
+#define SPATCH_FORMAT_VERSION 1
 
 typedef struct patch_config_s {
     uint32_t format_version;
+    /* if non-zero, data payloads start at file offsets aligned to this value */
+    uint32_t payload_align;
 } patch_config_t;
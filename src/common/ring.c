@@ -0,0 +1,117 @@
+#include "ring.h"
+
+#include "thread.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+struct ring_s {
+    thread_mutex_t *mutex;
+    thread_cond_t *not_full, *not_empty;
+    uint8_t *data;
+    size_t *lens;
+    size_t slot_count, slot_size;
+    /* Monotonic slot counters, head - tail is the number of filled slots */
+    uint64_t head, tail;
+    int closed, aborted;
+    uint64_t producer_wait, consumer_wait;
+};
+
+ring_t *ring_create(size_t slot_count, size_t slot_size) {
+    ring_t *ring = calloc(1, sizeof(ring_t));
+    if (!ring) return NULL;
+    ring->slot_count = slot_count;
+    ring->slot_size = slot_size;
+    ring->mutex = thread_mutex_create();
+    ring->not_full = thread_cond_create();
+    ring->not_empty = thread_cond_create();
+    ring->data = malloc(slot_count * slot_size);
+    ring->lens = malloc(slot_count * sizeof(size_t));
+    if (!ring->mutex || !ring->not_full || !ring->not_empty || !ring->data || !ring->lens) {
+        ring_destroy(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+uint8_t *ring_write_acquire(ring_t *ring) {
+    uint8_t *slot = NULL;
+    thread_mutex_lock(ring->mutex);
+    if (ring->head - ring->tail == ring->slot_count && !ring->aborted) {
+        uint64_t start = util_time_usec();
+        while (ring->head - ring->tail == ring->slot_count && !ring->aborted) {
+            thread_cond_wait(ring->not_full, ring->mutex);
+        }
+        ring->producer_wait += util_time_usec() - start;
+    }
+    if (!ring->aborted) {
+        slot = ring->data + (ring->head % ring->slot_count) * ring->slot_size;
+    }
+    thread_mutex_unlock(ring->mutex);
+    return slot;
+}
+
+void ring_write_commit(ring_t *ring, size_t len) {
+    thread_mutex_lock(ring->mutex);
+    ring->lens[ring->head % ring->slot_count] = len;
+    ++ring->head;
+    thread_cond_signal(ring->not_empty);
+    thread_mutex_unlock(ring->mutex);
+}
+
+void ring_close(ring_t *ring) {
+    thread_mutex_lock(ring->mutex);
+    ring->closed = 1;
+    thread_cond_signal(ring->not_empty);
+    thread_mutex_unlock(ring->mutex);
+}
+
+const uint8_t *ring_read_acquire(ring_t *ring, size_t *len) {
+    const uint8_t *slot = NULL;
+    thread_mutex_lock(ring->mutex);
+    if (ring->head == ring->tail && !ring->closed && !ring->aborted) {
+        uint64_t start = util_time_usec();
+        while (ring->head == ring->tail && !ring->closed && !ring->aborted) {
+            thread_cond_wait(ring->not_empty, ring->mutex);
+        }
+        ring->consumer_wait += util_time_usec() - start;
+    }
+    if (ring->head != ring->tail && !ring->aborted) {
+        slot = ring->data + (ring->tail % ring->slot_count) * ring->slot_size;
+        *len = ring->lens[ring->tail % ring->slot_count];
+    }
+    thread_mutex_unlock(ring->mutex);
+    return slot;
+}
+
+void ring_read_release(ring_t *ring) {
+    thread_mutex_lock(ring->mutex);
+    ++ring->tail;
+    thread_cond_signal(ring->not_full);
+    thread_mutex_unlock(ring->mutex);
+}
+
+void ring_abort(ring_t *ring) {
+    thread_mutex_lock(ring->mutex);
+    ring->aborted = 1;
+    thread_cond_signal(ring->not_full);
+    thread_cond_signal(ring->not_empty);
+    thread_mutex_unlock(ring->mutex);
+}
+
+void ring_stall_stats(ring_t *ring, uint64_t *producer_usec, uint64_t *consumer_usec) {
+    thread_mutex_lock(ring->mutex);
+    *producer_usec = ring->producer_wait;
+    *consumer_usec = ring->consumer_wait;
+    thread_mutex_unlock(ring->mutex);
+}
+
+void ring_destroy(ring_t *ring) {
+    if (!ring) return;
+    thread_cond_destroy(ring->not_empty);
+    thread_cond_destroy(ring->not_full);
+    thread_mutex_destroy(ring->mutex);
+    free(ring->lens);
+    free(ring->data);
+    free(ring);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Bounded single-producer/single-consumer queue of fixed-size slots */
+typedef struct ring_s ring_t;
+
+extern ring_t *ring_create(size_t slot_count, size_t slot_size);
+/* Blocks until a slot is free, returns NULL if the consumer aborted */
+extern uint8_t *ring_write_acquire(ring_t *ring);
+extern void ring_write_commit(ring_t *ring, size_t len);
+/* Producer is done, the consumer drains the remaining slots and then gets NULL */
+extern void ring_close(ring_t *ring);
+/* Blocks until a slot is filled, returns NULL once the ring is closed and empty or aborted */
+extern const uint8_t *ring_read_acquire(ring_t *ring, size_t *len);
+extern void ring_read_release(ring_t *ring);
+/* Unblocks both sides, further acquires return NULL */
+extern void ring_abort(ring_t *ring);
+/* Microseconds the producer waited for free slots and the consumer waited for data */
+extern void ring_stall_stats(ring_t *ring, uint64_t *producer_usec, uint64_t *consumer_usec);
+extern void ring_destroy(ring_t *ring);
@@ -0,0 +1,244 @@
+#include "sadiff.h"
+
+#include "sais.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SADIFF_CHUNK (64 * 1024)
+/* A new match is taken once it beats the current alignment by this many bytes */
+#define SADIFF_MIN_GAIN 8
+/* Record lengths are uint32_t, longer runs are split over several records */
+#define SADIFF_MAX_RUN 0xFFFFFFFFLL
+
+static int64_t match_len(const uint8_t *a, int64_t a_size, const uint8_t *b, int64_t b_size) {
+    int64_t i, n = a_size < b_size ? a_size : b_size;
+    for (i = 0; i < n && a[i] == b[i]; ++i) {}
+    return i;
+}
+
+/* Longest prefix of inp found in src, by binary search over the suffix array */
+static int64_t search(const int32_t *sa, const uint8_t *src, int64_t src_size,
+                      const uint8_t *inp, int64_t inp_size, int64_t *pos) {
+    int64_t st = 0, en = src_size - 1, x, y;
+    while (en - st >= 2) {
+        int64_t mid = st + (en - st) / 2;
+        int64_t len = src_size - sa[mid];
+        if (memcmp(src + sa[mid], inp, len < inp_size ? len : inp_size) < 0) {
+            st = mid;
+        } else {
+            en = mid;
+        }
+    }
+    x = match_len(src + sa[st], src_size - sa[st], inp, inp_size);
+    y = match_len(src + sa[en], src_size - sa[en], inp, inp_size);
+    if (x > y) {
+        *pos = sa[st];
+        return x;
+    }
+    *pos = sa[en];
+    return y;
+}
+
+/* Runs longer than SADIFF_MAX_RUN go into records with no seek, the last one carries the rest and the seek.
+ * Returns 0 or -1 if out of memory */
+static int write_record(memstream_t *stm, const uint8_t *src, int64_t src_pos, const uint8_t *inp, int64_t inp_pos,
+                        int64_t add, int64_t copy, int64_t seek) {
+    uint8_t buf[SADIFF_CHUNK];
+    int64_t i, j;
+    for (;;) {
+        int64_t part_add = add < SADIFF_MAX_RUN ? add : SADIFF_MAX_RUN;
+        int64_t part_copy = part_add < add ? 0 : copy < SADIFF_MAX_RUN ? copy : SADIFF_MAX_RUN;
+        int last = part_add == add && part_copy == copy;
+        uint32_t header[3] = { (uint32_t)part_add, (uint32_t)part_copy, last ? (uint32_t)(int32_t)seek : 0 };
+        if (memstream_write(stm, header, SADIFF_RECORD_SIZE) != SADIFF_RECORD_SIZE) {
+            return -1;
+        }
+        for (i = 0; i < part_add; i += SADIFF_CHUNK) {
+            int64_t n = part_add - i < SADIFF_CHUNK ? part_add - i : SADIFF_CHUNK;
+            for (j = 0; j < n; ++j) {
+                buf[j] = inp[inp_pos + i + j] - src[src_pos + i + j];
+            }
+            if (memstream_write(stm, buf, n) != (size_t)n) {
+                return -1;
+            }
+        }
+        if (part_copy > 0 && memstream_write(stm, inp + inp_pos + part_add, part_copy) != (size_t)part_copy) {
+            return -1;
+        }
+        if (last) {
+            return 0;
+        }
+        src_pos += part_add;
+        inp_pos += part_add + part_copy;
+        add -= part_add;
+        copy -= part_copy;
+    }
+}
+
+/* The scan of bsdiff 4: a suffix array match is taken when it beats the bytes that still agree under
+ * the previous alignment, which is then stretched forward and the new match backward over approximate
+ * matches (more than half the bytes equal). Stretched ranges become add bytes, mostly zeros after
+ * small code shifts, and the gap between them copy bytes */
+int sadiff_encode(const uint8_t *src, size_t src_size, const uint8_t *inp, size_t inp_size, memstream_t *stm) {
+    int32_t *sa = NULL;
+    int64_t old_size = src_size, new_size = inp_size;
+    int64_t scan = 0, len = 0, pos = 0, last_scan = 0, last_pos = 0, last_offset = 0;
+
+    if (old_size > SADIFF_MAX_SOURCE) {
+        return -1;
+    }
+    if (old_size > 0) {
+        sa = malloc(old_size * sizeof(int32_t));
+        if (!sa || sais_build(src, sa, (int32_t)old_size) != 0) {
+            free(sa);
+            return -1;
+        }
+    }
+    while (scan < new_size) {
+        int64_t old_score = 0, scsc;
+        for (scsc = scan += len; scan < new_size; ++scan) {
+            len = sa ? search(sa, src, old_size, inp + scan, new_size - scan, &pos) : 0;
+            for (; scsc < scan + len; ++scsc) {
+                if (scsc + last_offset < old_size && src[scsc + last_offset] == inp[scsc]) {
+                    ++old_score;
+                }
+            }
+            if ((len == old_score && len != 0) || len > old_score + SADIFF_MIN_GAIN) {
+                break;
+            }
+            if (scan + last_offset < old_size && src[scan + last_offset] == inp[scan]) {
+                --old_score;
+            }
+        }
+        if (len != old_score || scan == new_size) {
+            int64_t s = 0, best = 0, lenf = 0, lenb = 0, i;
+            for (i = 0; last_scan + i < scan && last_pos + i < old_size;) {
+                if (src[last_pos + i] == inp[last_scan + i]) {
+                    ++s;
+                }
+                ++i;
+                if (s * 2 - i > best * 2 - lenf) {
+                    best = s;
+                    lenf = i;
+                }
+            }
+            if (scan < new_size) {
+                s = 0;
+                best = 0;
+                for (i = 1; scan >= last_scan + i && pos >= i; ++i) {
+                    if (src[pos - i] == inp[scan - i]) {
+                        ++s;
+                    }
+                    if (s * 2 - i > best * 2 - lenb) {
+                        best = s;
+                        lenb = i;
+                    }
+                }
+            }
+            if (last_scan + lenf > scan - lenb) {
+                /* the forward and backward extension overlap, split where the most bytes match */
+                int64_t overlap = (last_scan + lenf) - (scan - lenb), lens = 0;
+                s = 0;
+                best = 0;
+                for (i = 0; i < overlap; ++i) {
+                    if (inp[last_scan + lenf - overlap + i] == src[last_pos + lenf - overlap + i]) {
+                        ++s;
+                    }
+                    if (inp[scan - lenb + i] == src[pos - lenb + i]) {
+                        --s;
+                    }
+                    if (s > best) {
+                        best = s;
+                        lens = i + 1;
+                    }
+                }
+                lenf += lens - overlap;
+                lenb -= lens;
+            }
+            if (write_record(stm, src, last_pos, inp, last_scan, lenf, (scan - lenb) - (last_scan + lenf),
+                             (pos - lenb) - (last_pos + lenf)) != 0) {
+                free(sa);
+                return -1;
+            }
+            last_scan = scan - lenb;
+            last_pos = pos - lenb;
+            last_offset = pos - scan;
+        }
+    }
+    free(sa);
+    return 0;
+}
+
+void sadiff_apply_init(sadiff_apply_t *state, const uint8_t *src, size_t src_size,
+                       sadiff_write_t write, void *opaque) {
+    memset(state, 0, sizeof(sadiff_apply_t));
+    state->src = src;
+    state->src_size = src_size;
+    state->write = write;
+    state->opaque = opaque;
+}
+
+int sadiff_apply(sadiff_apply_t *state, const uint8_t *data, size_t size) {
+    uint8_t buf[SADIFF_CHUNK];
+    while (size > 0) {
+        size_t n, i;
+        if (state->add_left > 0) {
+            const uint8_t *src = state->src + state->src_pos;
+            n = state->add_left < size ? state->add_left : size;
+            if (n > SADIFF_CHUNK) n = SADIFF_CHUNK;
+            for (i = 0; i < n; ++i) {
+                buf[i] = data[i] + src[i];
+            }
+            if (state->write(state->opaque, buf, n) != 0) {
+                return -1;
+            }
+            state->src_pos += n;
+            state->add_left -= n;
+            if (state->add_left == 0) {
+                state->src_pos += state->seek;
+            }
+        } else if (state->copy_left > 0) {
+            n = state->copy_left < size ? state->copy_left : size;
+            if (state->write(state->opaque, data, n) != 0) {
+                return -1;
+            }
+            state->copy_left -= n;
+        } else {
+            uint32_t header[3];
+            int64_t end;
+            n = SADIFF_RECORD_SIZE - state->header_fill;
+            if (n > size) n = size;
+            memcpy(state->header + state->header_fill, data, n);
+            state->header_fill += n;
+            data += n;
+            size -= n;
+            if (state->header_fill < SADIFF_RECORD_SIZE) {
+                break;
+            }
+            state->header_fill = 0;
+            memcpy(header, state->header, SADIFF_RECORD_SIZE);
+            /* both the added range and the old position after the record must stay inside the old file */
+            end = (int64_t)state->src_pos + header[0];
+            if (end > (int64_t)state->src_size || end + (int32_t)header[2] < 0
+                || end + (int32_t)header[2] > (int64_t)state->src_size) {
+                return -1;
+            }
+            state->add_left = header[0];
+            state->copy_left = header[1];
+            state->seek = (int32_t)header[2];
+            if (state->add_left == 0) {
+                state->src_pos += state->seek;
+            }
+            continue;
+        }
+        state->total += n;
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int sadiff_apply_finish(const sadiff_apply_t *state) {
+    return state->header_fill == 0 && state->add_left == 0 && state->copy_left == 0 ? 0 : -1;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "memstream.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* bsdiff style delta over a suffix array of the old file, for recompiled executables where code
+ * moves by small offsets and xdelta's hash matching finds few exact matches.
+ * The patch is a sequence of records: uint32_t add length, uint32_t copy length, int32_t seek,
+ * then `add` bytes that are added to the old file at the current old position,
+ * then `copy` bytes written as they are. The old position then advances by add + seek */
+
+#define SADIFF_RECORD_SIZE 12
+/* Suffix array offsets are int32_t, larger old files are left to xdelta */
+#define SADIFF_MAX_SOURCE 0x7FFFFFFF
+
+/* Appends the records turning src into inp to stm, returns 0 or -1 if out of memory */
+extern int sadiff_encode(const uint8_t *src, size_t src_size, const uint8_t *inp, size_t inp_size, memstream_t *stm);
+
+typedef int (*sadiff_write_t)(void *opaque, const uint8_t *data, size_t size);
+
+/* Applies records as they are decoded, the old file is held in memory */
+typedef struct sadiff_apply_s {
+    const uint8_t *src;
+    size_t src_size, src_pos;
+    sadiff_write_t write;
+    void *opaque;
+    uint8_t header[SADIFF_RECORD_SIZE];
+    size_t header_fill;
+    uint32_t add_left, copy_left;
+    int32_t seek;
+    uint64_t total;
+} sadiff_apply_t;
+
+extern void sadiff_apply_init(sadiff_apply_t *state, const uint8_t *src, size_t src_size,
+                              sadiff_write_t write, void *opaque);
+/* Feeds the next `size` record bytes, returns 0, or -1 on a malformed record or a failed write */
+extern int sadiff_apply(sadiff_apply_t *state, const uint8_t *data, size_t size);
+/* Returns 0 if the records ended on a record boundary */
+extern int sadiff_apply_finish(const sadiff_apply_t *state);
@@ -0,0 +1,159 @@
+#include "sais.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SAIS_EMPTY -1
+
+/* Level 0 sorts the bytes of the text, deeper levels the int32_t names of its LMS substrings.
+ * types[i] is 1 for S-type suffixes (smaller than the suffix after them), 0 for L-type */
+#define CHR(i) (t8 ? (int32_t)t8[i] : t32[i])
+#define IS_LMS(i) ((i) > 0 && types[i] && !types[(i) - 1])
+
+static void get_buckets(const int32_t *counts, int32_t *bkt, int32_t k, int end) {
+    int32_t i, sum = 0;
+    for (i = 0; i < k; ++i) {
+        sum += counts[i];
+        bkt[i] = end ? sum : sum - counts[i];
+    }
+}
+
+/* Induces the L-type suffixes from the sorted LMS suffixes in sa, then the S-type ones */
+static void induce(const uint8_t *t8, const int32_t *t32, int32_t *sa, int32_t n,
+                   const uint8_t *types, const int32_t *counts, int32_t *bkt, int32_t k) {
+    int32_t i, j;
+    get_buckets(counts, bkt, k, 0);
+    /* the sentinel suffix sorts first and the last suffix, always L-type, is induced from it */
+    sa[bkt[CHR(n - 1)]++] = n - 1;
+    for (i = 0; i < n; ++i) {
+        j = sa[i] - 1;
+        if (sa[i] > 0 && !types[j]) {
+            sa[bkt[CHR(j)]++] = j;
+        }
+    }
+    get_buckets(counts, bkt, k, 1);
+    for (i = n - 1; i >= 0; --i) {
+        j = sa[i] - 1;
+        if (sa[i] > 0 && types[j]) {
+            sa[--bkt[CHR(j)]] = j;
+        }
+    }
+}
+
+static int sais_main(const uint8_t *t8, const int32_t *t32, int32_t *sa, int32_t n, int32_t k) {
+    int ret = -1;
+    uint8_t *types = NULL;
+    int32_t *counts = NULL, *bkt = NULL, *s1;
+    int32_t i, j, n1, name, prev;
+
+    if (n == 1) {
+        sa[0] = 0;
+        return 0;
+    }
+    types = malloc(n);
+    counts = calloc(k, sizeof(int32_t));
+    bkt = malloc(k * sizeof(int32_t));
+    if (!types || !counts || !bkt) {
+        goto end;
+    }
+    types[n - 1] = 0;
+    for (i = n - 2; i >= 0; --i) {
+        types[i] = CHR(i) < CHR(i + 1) || (CHR(i) == CHR(i + 1) && types[i + 1]);
+    }
+    for (i = 0; i < n; ++i) {
+        ++counts[CHR(i)];
+    }
+
+    /* Sort the LMS substrings: LMS positions at their bucket ends, then one induce pass */
+    get_buckets(counts, bkt, k, 1);
+    for (i = 0; i < n; ++i) {
+        sa[i] = SAIS_EMPTY;
+    }
+    for (i = 1; i < n; ++i) {
+        if (IS_LMS(i)) {
+            sa[--bkt[CHR(i)]] = i;
+        }
+    }
+    induce(t8, t32, sa, n, types, counts, bkt, k);
+
+    /* Compact them to the front and name them, equal substrings share a name.
+     * LMS positions are at least 2 apart, so the names fit in sa[n1 + pos / 2] */
+    for (i = 0, n1 = 0; i < n; ++i) {
+        if (IS_LMS(sa[i])) {
+            sa[n1++] = sa[i];
+        }
+    }
+    for (i = n1; i < n; ++i) {
+        sa[i] = SAIS_EMPTY;
+    }
+    for (i = 0, name = 0, prev = -1; i < n1; ++i) {
+        int32_t pos = sa[i], d;
+        int diff = 0;
+        for (d = 0;; ++d) {
+            if (prev < 0 || pos + d == n || prev + d == n
+                || CHR(pos + d) != CHR(prev + d) || types[pos + d] != types[prev + d]) {
+                diff = 1;
+                break;
+            }
+            if (d > 0 && (IS_LMS(pos + d) || IS_LMS(prev + d))) {
+                break;
+            }
+        }
+        if (diff) {
+            ++name;
+            prev = pos;
+        }
+        sa[n1 + pos / 2] = name - 1;
+    }
+    for (i = n - 1, j = n - 1; i >= n1; --i) {
+        if (sa[i] >= 0) {
+            sa[j--] = sa[i];
+        }
+    }
+
+    /* Sort the LMS suffixes: recurse on the names unless they are all unique already */
+    s1 = sa + n - n1;
+    if (name < n1) {
+        if (sais_main(NULL, s1, sa, n1, name) != 0) {
+            goto end;
+        }
+    } else {
+        for (i = 0; i < n1; ++i) {
+            sa[s1[i]] = i;
+        }
+    }
+
+    /* Induce the whole array from the sorted LMS suffixes */
+    for (i = 1, j = 0; i < n; ++i) {
+        if (IS_LMS(i)) {
+            s1[j++] = i;
+        }
+    }
+    for (i = 0; i < n1; ++i) {
+        sa[i] = s1[sa[i]];
+    }
+    for (i = n1; i < n; ++i) {
+        sa[i] = SAIS_EMPTY;
+    }
+    get_buckets(counts, bkt, k, 1);
+    for (i = n1 - 1; i >= 0; --i) {
+        j = sa[i];
+        sa[i] = SAIS_EMPTY;
+        sa[--bkt[CHR(j)]] = j;
+    }
+    induce(t8, t32, sa, n, types, counts, bkt, k);
+    ret = 0;
+
+end:
+    free(types);
+    free(counts);
+    free(bkt);
+    return ret;
+}
+
+int sais_build(const uint8_t *text, int32_t *sa, int32_t n) {
+    if (n <= 0) {
+        return 0;
+    }
+    return sais_main(text, NULL, sa, n, 256);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Suffix array construction by induced sorting (SA-IS, Nong/Zhang/Chan), linear time.
+ * The end of the text acts as a sentinel smaller than any byte */
+
+/* Fills sa[0..n) with the start offsets of the suffixes of text in lexicographic order.
+ * Besides sa, needs about n bytes plus a few bucket tables; returns 0, or -1 if out of memory */
+extern int sais_build(const uint8_t *text, int32_t *sa, int32_t n);
@@ -0,0 +1,26 @@
+#pragma once
+
+typedef struct thread_mutex_s thread_mutex_t;
+
+extern thread_mutex_t *thread_mutex_create();
+extern void thread_mutex_lock(thread_mutex_t *mutex);
+extern void thread_mutex_unlock(thread_mutex_t *mutex);
+extern void thread_mutex_destroy(thread_mutex_t *mutex);
+
+typedef struct thread_cond_s thread_cond_t;
+
+extern thread_cond_t *thread_cond_create();
+/* Atomically releases `mutex` and waits, the mutex is held again on return */
+extern void thread_cond_wait(thread_cond_t *cond, thread_mutex_t *mutex);
+extern void thread_cond_signal(thread_cond_t *cond);
+extern void thread_cond_destroy(thread_cond_t *cond);
+
+typedef struct thread_s thread_t;
+typedef void (*thread_func_t)(void *arg);
+
+extern thread_t *thread_create(thread_func_t func, void *arg);
+/* Waits for the thread to finish and frees it */
+extern void thread_join(thread_t *thread);
+
+/* Processors currently online, at least 1 */
+extern int thread_cpu_count();
@@ -0,0 +1,100 @@
+#ifdef VFS_UNIX
+
+#include "thread.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct thread_mutex_s {
+    pthread_mutex_t mutex;
+};
+
+thread_mutex_t *thread_mutex_create() {
+    thread_mutex_t *mutex = malloc(sizeof(thread_mutex_t));
+    if (!mutex) return NULL;
+    if (pthread_mutex_init(&mutex->mutex, NULL) != 0) {
+        free(mutex);
+        return NULL;
+    }
+    return mutex;
+}
+
+void thread_mutex_lock(thread_mutex_t *mutex) {
+    pthread_mutex_lock(&mutex->mutex);
+}
+
+void thread_mutex_unlock(thread_mutex_t *mutex) {
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+void thread_mutex_destroy(thread_mutex_t *mutex) {
+    if (!mutex) return;
+    pthread_mutex_destroy(&mutex->mutex);
+    free(mutex);
+}
+
+struct thread_cond_s {
+    pthread_cond_t cond;
+};
+
+thread_cond_t *thread_cond_create() {
+    thread_cond_t *cond = malloc(sizeof(thread_cond_t));
+    if (!cond) return NULL;
+    if (pthread_cond_init(&cond->cond, NULL) != 0) {
+        free(cond);
+        return NULL;
+    }
+    return cond;
+}
+
+void thread_cond_wait(thread_cond_t *cond, thread_mutex_t *mutex) {
+    pthread_cond_wait(&cond->cond, &mutex->mutex);
+}
+
+void thread_cond_signal(thread_cond_t *cond) {
+    pthread_cond_signal(&cond->cond);
+}
+
+void thread_cond_destroy(thread_cond_t *cond) {
+    if (!cond) return;
+    pthread_cond_destroy(&cond->cond);
+    free(cond);
+}
+
+struct thread_s {
+    pthread_t thread;
+    thread_func_t func;
+    void *arg;
+};
+
+static void *thread_entry(void *arg) {
+    thread_t *thread = arg;
+    thread->func(thread->arg);
+    return NULL;
+}
+
+thread_t *thread_create(thread_func_t func, void *arg) {
+    thread_t *thread = malloc(sizeof(thread_t));
+    if (!thread) return NULL;
+    thread->func = func;
+    thread->arg = arg;
+    if (pthread_create(&thread->thread, NULL, thread_entry, thread) != 0) {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void thread_join(thread_t *thread) {
+    if (!thread) return;
+    pthread_join(thread->thread, NULL);
+    free(thread);
+}
+
+int thread_cpu_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 1 ? (int)count : 1;
+}
+
+#endif
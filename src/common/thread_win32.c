@@ -0,0 +1,94 @@
+#ifdef VFS_WIN32
+
+#include "thread.h"
+
+#include <windows.h>
+#include <stdlib.h>
+
+struct thread_mutex_s {
+    CRITICAL_SECTION cs;
+};
+
+thread_mutex_t *thread_mutex_create() {
+    thread_mutex_t *mutex = malloc(sizeof(thread_mutex_t));
+    if (!mutex) return NULL;
+    InitializeCriticalSection(&mutex->cs);
+    return mutex;
+}
+
+void thread_mutex_lock(thread_mutex_t *mutex) {
+    EnterCriticalSection(&mutex->cs);
+}
+
+void thread_mutex_unlock(thread_mutex_t *mutex) {
+    LeaveCriticalSection(&mutex->cs);
+}
+
+void thread_mutex_destroy(thread_mutex_t *mutex) {
+    if (!mutex) return;
+    DeleteCriticalSection(&mutex->cs);
+    free(mutex);
+}
+
+struct thread_cond_s {
+    CONDITION_VARIABLE cv;
+};
+
+thread_cond_t *thread_cond_create() {
+    thread_cond_t *cond = malloc(sizeof(thread_cond_t));
+    if (!cond) return NULL;
+    InitializeConditionVariable(&cond->cv);
+    return cond;
+}
+
+void thread_cond_wait(thread_cond_t *cond, thread_mutex_t *mutex) {
+    SleepConditionVariableCS(&cond->cv, &mutex->cs, INFINITE);
+}
+
+void thread_cond_signal(thread_cond_t *cond) {
+    WakeConditionVariable(&cond->cv);
+}
+
+void thread_cond_destroy(thread_cond_t *cond) {
+    free(cond);
+}
+
+struct thread_s {
+    HANDLE handle;
+    thread_func_t func;
+    void *arg;
+};
+
+static DWORD WINAPI thread_entry(LPVOID arg) {
+    thread_t *thread = arg;
+    thread->func(thread->arg);
+    return 0;
+}
+
+thread_t *thread_create(thread_func_t func, void *arg) {
+    thread_t *thread = malloc(sizeof(thread_t));
+    if (!thread) return NULL;
+    thread->func = func;
+    thread->arg = arg;
+    thread->handle = CreateThread(NULL, 0, thread_entry, thread, 0, NULL);
+    if (!thread->handle) {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void thread_join(thread_t *thread) {
+    if (!thread) return;
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    free(thread);
+}
+
+int thread_cpu_count() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 1 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+#endif
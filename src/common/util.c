@@ -2,12 +2,18 @@
 
 #include "vfs.h"
 
+#include <string.h>
+
 #if defined(VFS_WIN32)
 #include <windows.h>
 #include <shlwapi.h>
 #else
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #if defined(_WIN32)
 #include <direct.h>
 #define mkdir(p, o) _mkdir(p)
@@ -54,7 +60,7 @@ int util_mkdir(const char *path, int recursive) {
             parent[rslash - path] = 0;
             struct stat s = {};
             if (stat(parent, &s) == -1) {
-                int ret = do_mkdir(parent, 1);
+                int ret = util_mkdir(parent, 1);
                 if (ret != 0) return ret;
             } else if (!S_ISDIR(s.st_mode)) {
                 return -1;
@@ -105,3 +111,131 @@ extern int util_copy_file(const char *source, const char *target) {
     vfs.close(src_file);
     return ret;
 }
+
+uint64_t util_hash64(uint64_t seed, const void *data, size_t size) {
+    const uint8_t *buf = data;
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ seed ^ size, v;
+    size_t i;
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&v, buf + i, 8);
+        h = (h ^ v) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    for (; i < size; ++i) {
+        h = (h ^ buf[i]) * 0x100000001B3ULL;
+    }
+    h ^= h >> 29;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 32);
+}
+
+int util_glob_match(const char *pattern, const char *path) {
+    const char *star = NULL, *resume = NULL;
+    if (!strchr(pattern, '/')) {
+        const char *slash = strrchr(path, '/');
+        if (slash) {
+            path = slash + 1;
+        }
+    }
+    while (*path) {
+        if (*pattern == '*') {
+            star = ++pattern;
+            resume = path;
+        } else if (*pattern == '?' || *pattern == *path) {
+            ++pattern;
+            ++path;
+        } else if (star) {
+            pattern = star;
+            path = ++resume;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') {
+        ++pattern;
+    }
+    return *pattern == 0;
+}
+
+int util_file_fingerprint(const char *path, uint64_t *size, uint64_t *hash) {
+    struct vfs_file_handle *file = vfs.open(path, VFS_FILE_ACCESS_READ, 0);
+    uint64_t h = 0;
+    uint64_t total = 0;
+    if (!file) { return -1; }
+    while (1) {
+        uint8_t buf[256 * 1024];
+        int64_t bytes = vfs.read(file, buf, 256 * 1024);
+        if (bytes <= 0) {
+            break;
+        }
+        h = util_hash64(h, buf, bytes);
+        total += bytes;
+        if (bytes < 256 * 1024) {
+            break;
+        }
+    }
+    vfs.close(file);
+    if (size) *size = total;
+    if (hash) *hash = h;
+    return 0;
+}
+
+void *util_map_file(const char *path, int64_t *size) {
+#if defined(VFS_WIN32)
+    wchar_t wpath[MAX_PATH];
+    HANDLE file, mapping;
+    LARGE_INTEGER file_size;
+    void *addr = NULL;
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH);
+    file = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) { return NULL; }
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            addr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    if (addr && size) *size = file_size.QuadPart;
+    return addr;
+#endif
+#if defined(VFS_UNIX)
+    struct stat s;
+    void *addr;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { return NULL; }
+    if (fstat(fd, &s) != 0 || s.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    addr = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) { return NULL; }
+    if (size) *size = s.st_size;
+    return addr;
+#endif
+}
+
+void util_unmap_file(void *addr, int64_t size) {
+    if (!addr) { return; }
+#if defined(VFS_WIN32)
+    UnmapViewOfFile(addr);
+#endif
+#if defined(VFS_UNIX)
+    munmap(addr, size);
+#endif
+}
+
+uint64_t util_time_usec() {
+#if defined(VFS_WIN32)
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000ULL + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
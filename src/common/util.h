@@ -12,4 +12,15 @@ extern int util_mkdir_unicode(const wchar_t *wpath, int recursive);
 
 extern int util_mkdir(const char *path, int recursive);
 extern int util_file_exists(const char *path);
-extern int util_copy_file(const char *source, const char *target);
\ No newline at end of file
+extern int util_copy_file(const char *source, const char *target);
+/* 64-bit hash of `data`, a previous result passed as `seed` chains blocks of a larger input */
+extern uint64_t util_hash64(uint64_t seed, const void *data, size_t size);
+/* Reads the whole file, returns 0 and fills size/hash on success, -1 if not readable */
+extern int util_file_fingerprint(const char *path, uint64_t *size, uint64_t *hash);
+/* Maps the whole file read-only, returns NULL on failure */
+extern void *util_map_file(const char *path, int64_t *size);
+extern void util_unmap_file(void *addr, int64_t size);
+/* Matches '*' and '?' wildcards, a pattern without '/' is matched against the last path component only */
+extern int util_glob_match(const char *pattern, const char *path);
+/* Monotonic clock in microseconds */
+extern uint64_t util_time_usec();
@@ -1,5 +1,7 @@
 #ifdef VFS_UNIX
 
+#define _LARGEFILE64_SOURCE
+
 #include "vfs.h"
 #include "util.h"
 
@@ -51,7 +53,7 @@ struct vfs_file_handle *unix_vfs_open(const char *path, unsigned mode, unsigned
             flag |= O_RDWR;
         }
     }
-    ret->file_handle = open(path, flag);
+    ret->file_handle = open(path, flag, 0666);
     if (ret->file_handle < 0) {
         free(ret);
         return NULL;
@@ -131,11 +133,11 @@ int unix_vfs_stat(const char *path, int32_t *size) {
         return 0;
     }
     if (size) *size = s.st_size;
-    return VFS_STAT_IS_VALID | (S_ISCHR(s.st_mode) ? VFS_STAT_IS_DIRECTORY : 0) | (S_ISDIR(s.st_mode) ? VFS_STAT_IS_CHARACTER_SPECIAL : 0);
+    return VFS_STAT_IS_VALID | (S_ISDIR(s.st_mode) ? VFS_STAT_IS_DIRECTORY : 0) | (S_ISCHR(s.st_mode) ? VFS_STAT_IS_CHARACTER_SPECIAL : 0);
 }
 
 int unix_vfs_mkdir(const char *dir) {
-    return do_mkdir(dir, 1);
+    return util_mkdir(dir, 1);
 }
 
 struct vfs_dir_handle *unix_vfs_opendir(const char *dir, bool include_hidden) {
@@ -181,7 +183,7 @@ int unix_vfs_closedir(struct vfs_dir_handle *dirstream) {
     return res;
 }
 
-struct vfs_interface vfs_interface = {
+struct vfs_interface vfs = {
     /* VFS API v1 */
     unix_vfs_get_path,
     unix_vfs_open,
@@ -28,7 +28,21 @@
   { UPDATE_0(p); i = (i + i); A0; } else \
   { UPDATE_1(p); i = (i + i) + 1; A1; }
 
+#ifdef _LZMA_DEC_BRANCHLESS
+/* Tree bits are poorly predictable: decode them with masks instead of a branch.
+   mask is 0 for bit 0 and ~0 for bit 1, the result is identical to GET_BIT2 */
+#define BIT_MASKED(p, i, mask) \
+  ttt = *(p); NORMALIZE; bound = (range >> kNumBitModelTotalBits) * (UInt32)ttt; \
+  mask = (UInt32)0 - (UInt32)(code >= bound); \
+  range = (bound & ~mask) | ((range - bound) & mask); \
+  code -= bound & mask; \
+  *(p) = (CLzmaProb)(((ttt + ((kBitModelTotal - ttt) >> kNumMoveBits)) & ~mask) | ((ttt - (ttt >> kNumMoveBits)) & mask)); \
+  i = (i + i) - (unsigned)mask;
+
+#define TREE_GET_BIT(probs, i) { UInt32 mask; BIT_MASKED(probs + i, i, mask) }
+#else
 #define TREE_GET_BIT(probs, i) { GET_BIT2(probs + i, i, ;, ;); }
+#endif
 
 #define REV_BIT(p, i, A0, A1) IF_BIT_0(p + i) \
   { UPDATE_0(p + i); A0; } else \
@@ -57,12 +71,21 @@
 #endif
 
 #define NORMAL_LITER_DEC TREE_GET_BIT(prob, symbol)
+#ifdef _LZMA_DEC_BRANCHLESS
+#define MATCHED_LITER_DEC \
+  matchByte += matchByte; \
+  bit = offs; \
+  offs &= matchByte; \
+  probLit = prob + (offs + bit + symbol); \
+  { UInt32 mask; BIT_MASKED(probLit, symbol, mask) offs ^= bit & ~(unsigned)mask; }
+#else
 #define MATCHED_LITER_DEC \
   matchByte += matchByte; \
   bit = offs; \
   offs &= matchByte; \
   probLit = prob + (offs + bit + symbol); \
   GET_BIT2(probLit, symbol, offs ^= bit; , ;)
+#endif
 
 #endif // _LZMA_DEC_OPT
 
@@ -573,9 +596,17 @@ int MY_FAST_CALL LZMA_DECODE_REAL(CLzmaDec *p, SizeT limit, const Byte *bufLimit
           ptrdiff_t src = (ptrdiff_t)pos - (ptrdiff_t)dicPos;
           const Byte *lim = dest + curLen;
           dicPos += (SizeT)curLen;
-          do
+#ifndef _LZMA_DEC_BYTE_COPY
+          /* Matches at distance >= 8 do not overlap within a word: copy 8 bytes at a time.
+             _LZMA_DEC_BYTE_COPY keeps the reference byte loop, the decoder fuzz test compares both */
+          if (src <= -8)
+          {
+            for (; lim - dest >= 8; dest += 8)
+              memcpy(dest, dest + src, 8);
+          }
+#endif
+          for (; dest != lim; dest++)
             *(dest) = (Byte)*(dest + src);
-          while (++dest != lim);
         }
         else
         {
@@ -925,6 +956,14 @@ void LzmaDec_Init(CLzmaDec *p)
   LzmaDec_InitDicAndState(p, True, True);
 }
 
+void LzmaDec_InitPrimed(CLzmaDec *p, SizeT primeSize)
+{
+  p->dicPos = primeSize;
+  p->processedPos = (UInt32)primeSize;
+  if (primeSize >= p->prop.dicSize)
+    p->checkDicSize = p->prop.dicSize;
+}
+
 
 /*
 LZMA supports optional end_marker.
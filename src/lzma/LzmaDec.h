@@ -77,6 +77,10 @@ typedef struct
 
 void LzmaDec_Init(CLzmaDec *p);
 
+/* Call after LzmaDec_Init() once dic[0 .. primeSize) holds the preset dictionary
+   the stream was encoded with (LzmaEnc_EncodePrimed). primeSize <= dicBufSize. */
+void LzmaDec_InitPrimed(CLzmaDec *p, SizeT primeSize);
+
 /* There are two types of LZMA streams:
      - Stream with end mark. That end mark adds about 6 bytes to compressed size.
      - Stream without end mark. You must know exact uncompressed size to decompress such stream. */
@@ -3054,6 +3054,26 @@ SRes LzmaEnc_Encode(CLzmaEncHandle pp, ISeqOutStream *outStream, ISeqInStream *i
 }
 
 
+SRes LzmaEnc_EncodePrimed(CLzmaEncHandle pp, ISeqOutStream *outStream, ISeqInStream *inStream, UInt32 primeSize,
+    ICompressProgress *progress, ISzAllocPtr alloc, ISzAllocPtr allocBig)
+{
+  CLzmaEnc *p = (CLzmaEnc *)pp;
+  RINOK(LzmaEnc_Prepare(pp, outStream, inStream, alloc, allocBig));
+  if (primeSize != 0)
+  {
+    #ifndef _7ZIP_ST
+    if (p->mtMode)
+      return SZ_ERROR_PARAM;
+    #endif
+    p->matchFinder.Init(p->matchFinderObj);
+    p->needInit = 0;
+    p->matchFinder.Skip(p->matchFinderObj, primeSize);
+    p->nowPos64 = primeSize;
+  }
+  return LzmaEnc_Encode2(p, progress);
+}
+
+
 SRes LzmaEnc_WriteProperties(CLzmaEncHandle pp, Byte *props, SizeT *size)
 {
   if (*size < LZMA_PROPS_SIZE)
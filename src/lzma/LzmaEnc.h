@@ -63,6 +63,10 @@ unsigned LzmaEnc_IsWriteEndMark(CLzmaEncHandle p);
 
 SRes LzmaEnc_Encode(CLzmaEncHandle p, ISeqOutStream *outStream, ISeqInStream *inStream,
     ICompressProgress *progress, ISzAllocPtr alloc, ISzAllocPtr allocBig);
+/* The first (primeSize) bytes of inStream only fill the match finder window (preset dictionary),
+   coding starts after them. The decoder must be primed with the same bytes (LzmaDec_InitPrimed). */
+SRes LzmaEnc_EncodePrimed(CLzmaEncHandle p, ISeqOutStream *outStream, ISeqInStream *inStream, UInt32 primeSize,
+    ICompressProgress *progress, ISzAllocPtr alloc, ISzAllocPtr allocBig);
 SRes LzmaEnc_MemEncode(CLzmaEncHandle p, Byte *dest, SizeT *destLen, const Byte *src, SizeT srcLen,
     int writeEndMark, ICompressProgress *progress, ISzAllocPtr alloc, ISzAllocPtr allocBig);
 
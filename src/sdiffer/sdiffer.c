@@ -4,19 +4,35 @@
 #include "xdelta3.h"
 
 #include "LzmaEnc.h"
+#include "LzFind.h"
 
 #include "patch_config.h"
 #include "vfs.h"
 #include "util.h"
 #include "memstream.h"
 #include "ini.h"
+#include "lz77.h"
+#include "bcj.h"
+#include "thread.h"
+#include "sadiff.h"
+#include "arena.h"
+#include "cdc.h"
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <locale.h>
 
-static void *SzAlloc(ISzAllocPtr p, size_t size) { (void*)p; return malloc(size); }
-static void SzFree(ISzAllocPtr p, void *address) { (void*)p; free(address); }
+static uint64_t lzma_alloc_count = 0, lzma_alloc_bytes = 0;
+/* Tables of the pooled encoder and of tuning trials, freed ones are handed to the next encoder of similar props */
+static arena_t *lzma_arena = NULL;
+
+static void *SzAlloc(ISzAllocPtr p, size_t size) { (void*)p; ++lzma_alloc_count; lzma_alloc_bytes += size; return arena_alloc(lzma_arena, size); }
+static void SzFree(ISzAllocPtr p, void *address) { (void*)p; arena_free(lzma_arena, address); }
+
+static ISzAlloc my_alloc = { SzAlloc, SzFree };
+/* Encoder reused for every payload, match finder and probability tables
+ * are only reallocated when the props of the next payload need other sizes */
+static CLzmaEncHandle pooled_enc = NULL;
 
 enum {
     DIFF_TYPE_CHANGE = 0,
@@ -24,8 +40,34 @@ enum {
     DIFF_TYPE_ADD_OR_REPLACE = 2,
     DIFF_TYPE_ADD_OR_REPLACE_LZMA = 3,
     DIFF_TYPE_DELETE = 4,
+    DIFF_TYPE_BASE = 5,
+    DIFF_TYPE_BLOB = 6,
+    DIFF_TYPE_ADD_REF = 7,
+    DIFF_TYPE_SOLID_LZMA = 8,
+    DIFF_TYPE_DIR_TABLE = 9,
+    DIFF_TYPE_CHANGE_FAST = 10,
+    DIFF_TYPE_ADD_OR_REPLACE_FAST = 11,
+    DIFF_TYPE_CHANGE_PRIMED_LZMA = 12,
+    DIFF_TYPE_FILTERED = 13,
+    DIFF_TYPE_CHANGE_SA_LZMA = 14,
+    DIFF_TYPE_ADD_CHUNKS = 15,
+    DIFF_TYPE_ADD_CHUNKS_LZMA = 16,
+};
+
+enum {
+    CODEC_LZMA = 0,
+    CODEC_FAST = 1,
+};
+
+enum {
+    ENGINE_XDELTA = 0,
+    ENGINE_SA = 1,
 };
 
+#define SPATCH_MAX_BASES 16
+#define SPATCH_MAX_PROBES 32
+#define PROBE_ABSENT 0xFFFFFFFFFFFFFFFFULL
+
 typedef struct seq_in_file_s {
     ISeqInStream stream;
     struct vfs_file_handle *fin;
@@ -36,11 +78,154 @@ typedef struct seq_in_stream_s {
     memstream_t *stm;
 } seq_in_stream_t;
 
+/* Yields the preset dictionary bytes first, then reads from `next` */
+typedef struct seq_in_primed_s {
+    ISeqInStream stream;
+    const uint8_t *prime;
+    size_t prime_left;
+    ISeqInStream *next;
+} seq_in_primed_t;
+
+typedef struct seq_in_buf_s {
+    ISeqInStream stream;
+    const uint8_t *data;
+    size_t left;
+} seq_in_buf_t;
+
 typedef struct seq_out_file_s {
     ISeqOutStream stream;
     struct vfs_file_handle *fout;
 } seq_out_file_t;
 
+typedef struct solid_file_s {
+    char *relpath;
+    char *input_path;
+    uint32_t size;
+} solid_file_t;
+
+/* Small adds queued for solid blocks, written by solid_flush() */
+static struct {
+    int enabled;
+    int sort_by_ext;
+    uint32_t max_file_size;
+    uint32_t block_size;
+    solid_file_t *files;
+    size_t count, capacity;
+} solid = { 0, 1, 64 * 1024, 16 * 1024 * 1024 };
+
+/* Directory table: sorted relative directory paths, path i has directory id i + 1, id 0 is the root */
+static struct {
+    int enabled;
+    char **dirs;
+    size_t count;
+} name_table = {0};
+
+/* Alignment of data payloads in the output file, 0 for the packed layout */
+static uint32_t payload_align = 0;
+
+/* Payloads whose sampled blocks shrink by less than min_gain percent are stored uncompressed */
+static struct {
+    int min_gain;
+    uint64_t stored, stored_bytes, sample_usec;
+    uint64_t lzma_bytes, lzma_usec;
+} sampling = { 2 };
+
+/* Threads xdelta3 uses to checksum large sources before matching, 1 keeps indexing serial */
+static uint32_t index_threads = 1;
+
+#define SPATCH_MAX_ENCODE_THREADS 64
+
+/* Threads encoding separate window ranges of one changed file, 1 encodes serially */
+static uint32_t encode_threads = 1;
+
+/* xdelta windows carry an adler32 of their output that spatcher verifies, so a patch applied to the wrong file fails */
+static int window_checksum = 1;
+
+/* Complete xdelta source indexes of old files are saved in `dir` as <content hash>.xdi,
+ * later runs against the same base map them instead of checksumming the files again.
+ * Smaller files index faster than they hash */
+#define INDEX_CACHE_MIN_SIZE (1024 * 1024)
+static struct {
+    char dir[512];
+    uint32_t loaded, saved;
+} index_cache = { "" };
+
+/* xdelta3 streams allocate from `main`, parallel encode jobs from `jobs[i]`, all are reset after each file.
+ * With huge_pages the hash tables of large sources go on transparent huge pages */
+static struct {
+    int huge_pages;
+    arena_t *main, *jobs[SPATCH_MAX_ENCODE_THREADS];
+} xd3_arenas = { 0 };
+
+static void *xd3_arena_alloc(void *opaque, size_t items, usize_t size) {
+    return arena_alloc((arena_t*)opaque, items * size);
+}
+
+static void xd3_arena_free(void *opaque, void *address) {
+    arena_free((arena_t*)opaque, address);
+}
+
+static arena_t *xd3_arena(arena_t **arena) {
+    if (!*arena) {
+        *arena = arena_create(xd3_arenas.huge_pages ? ARENA_HUGE_PAGES : 0);
+    }
+    return *arena;
+}
+
+#define SPATCH_MAX_TUNED 256
+
+/* lc/lp/pb picked by trial compression per file class (extension), kept in an ini style cache between runs */
+static struct {
+    int enabled;
+    char cache_path[512];
+    uint32_t budget_ms;
+    struct {
+        char key[48];
+        int lc, lp, pb;
+    } classes[SPATCH_MAX_TUNED];
+    int count;
+    int dirty;
+    uint64_t usec;
+} autotune = { 0, "sdiffer.tune", 2000 };
+
+#define SPATCH_MAX_PROFILES 16
+#define SPATCH_MAX_RULES 64
+
+/* LZMA encoder settings, negative values (and 0 for dict_size/mc) leave the choice to the level */
+typedef struct compress_profile_s {
+    char name[32];
+    int codec;
+    int level;
+    uint32_t dict_size;
+    int fb, mc, bt_mode, hash_bytes;
+    int lc, lp, pb;
+    /* changed files are coded as LZMA primed with the old file instead of an xdelta patch */
+    int primed;
+    /* BCJ_* branch converter run over old and new file before xdelta, -1 picks it from the executable header */
+    int filter;
+    /* lc/lp/pb were given in the ini, autotune leaves them alone */
+    int literals_set;
+    /* ENGINE_SA diffs changed files over a suffix array of the old file instead of with xdelta */
+    int engine;
+    /* XD3_SEC_* compressor and XD3_SEC_NO* bits for the sections of xdelta patches, which then skip the outer codec */
+    int secondary;
+} compress_profile_t;
+
+/* Picks a profile when the path matches glob (empty matches all) and min_size <= size <= max_size */
+typedef struct compress_rule_s {
+    char glob[128];
+    uint64_t min_size, max_size;
+    int profile;
+} compress_rule_t;
+
+/* Profile 0 is "default", used when no rule matches */
+static struct {
+    compress_profile_t profiles[SPATCH_MAX_PROFILES];
+    int count;
+    compress_rule_t rules[SPATCH_MAX_RULES];
+    int rule_count;
+} profiles = { { { "default", CODEC_LZMA, 9, 0, 256, 0, -1, -1, 4, 2, 2 } }, 1 };
+
 typedef struct compress_progress_s {
     ICompressProgress progress;
     uint64_t total;
@@ -60,6 +245,27 @@ static SRes stream_read(const ISeqInStream *p, void *buf, size_t *size) {
     return SZ_OK;
 }
 
+static SRes buf_read(const ISeqInStream *p, void *buf, size_t *size) {
+    seq_in_buf_t *stm = (seq_in_buf_t*)p;
+    if (*size > stm->left) *size = stm->left;
+    memcpy(buf, stm->data, *size);
+    stm->data += *size;
+    stm->left -= *size;
+    return SZ_OK;
+}
+
+static SRes primed_read(const ISeqInStream *p, void *buf, size_t *size) {
+    seq_in_primed_t *stm = (seq_in_primed_t*)p;
+    if (stm->prime_left > 0) {
+        if (*size > stm->prime_left) *size = stm->prime_left;
+        memcpy(buf, stm->prime, *size);
+        stm->prime += *size;
+        stm->prime_left -= *size;
+        return SZ_OK;
+    }
+    return ISeqInStream_Read(stm->next, buf, size);
+}
+
 static size_t stream_write(const ISeqOutStream *p, const void *buf, size_t size) {
     const seq_out_file_t *stm = (const seq_out_file_t*)p;
     return vfs.write(stm->fout, buf, size);
@@ -71,9 +277,336 @@ static SRes compress_progress_callback(const ICompressProgress *p, UInt64 inSize
     return SZ_OK;
 }
 
-static int do_stream_compress(ISeqInStream *stm_in, size_t input_size, seq_out_file_t *stm_out) {
+static void write_payload_padding(struct vfs_file_handle *output_file) {
+    static const uint8_t zeros[4096] = {0};
+    int64_t pad;
+    if (payload_align == 0) {
+        return;
+    }
+    pad = (payload_align - vfs.tell(output_file) % payload_align) % payload_align;
+    while (pad > 0) {
+        int64_t n = pad < 4096 ? pad : 4096;
+        vfs.write(output_file, zeros, n);
+        pad -= n;
+    }
+}
+
+#define SAMPLE_COUNT 8
+#define SAMPLE_BLOCK_SIZE (64 * 1024)
+
+/* Reads up to `size` bytes at `offset` of the sampled payload */
+typedef size_t (*sample_read_t)(void *opaque, uint64_t offset, uint8_t *buf, size_t size);
+
+static size_t sample_read_file(void *opaque, uint64_t offset, uint8_t *buf, size_t size) {
+    int64_t rd;
+    vfs.seek((struct vfs_file_handle*)opaque, offset, VFS_SEEK_POSITION_START);
+    rd = vfs.read((struct vfs_file_handle*)opaque, buf, size);
+    return rd > 0 ? rd : 0;
+}
+
+static size_t sample_read_buf(void *opaque, uint64_t offset, uint8_t *buf, size_t size) {
+    memcpy(buf, (const uint8_t*)opaque + offset, size);
+    return size;
+}
+
+static size_t sample_read_memstream(void *opaque, uint64_t offset, uint8_t *buf, size_t size) {
+    return memstream_peek((memstream_t*)opaque, offset, buf, size);
+}
+
+/* log2(x) in 16.16 fixed point, x > 0 */
+static uint32_t log2_q16(uint32_t x) {
+    uint32_t r;
+    uint64_t y;
+    int msb = 31, i;
+    while (!(x >> msb)) --msb;
+    r = (uint32_t)msb << 16;
+    y = ((uint64_t)x << 31) >> msb;
+    for (i = 15; i >= 0; --i) {
+        y = (y * y) >> 31;
+        if (y >= (2ULL << 31)) {
+            y >>= 1;
+            r |= 1U << i;
+        }
+    }
+    return r;
+}
+
+/* Estimated compressed size of a block: the smaller of its order-0 entropy and its LZ77 size */
+static size_t sample_estimate(const uint8_t *block, size_t size, uint8_t *scratch) {
+    uint32_t counts[256] = {0};
+    uint64_t bits = 0;
+    size_t i, packed;
+    for (i = 0; i < size; ++i) {
+        ++counts[block[i]];
+    }
+    for (i = 0; i < 256; ++i) {
+        if (counts[i]) {
+            bits += (uint64_t)counts[i] * (log2_q16(size) - log2_q16(counts[i]));
+        }
+    }
+    bits >>= 16;
+    packed = lz77_compress(block, size, scratch, size);
+    if (packed == 0) {
+        packed = size;
+    }
+    return bits / 8 < packed ? bits / 8 : packed;
+}
+
+/* Samples a few evenly spaced blocks of the payload, returns 0 if compressing it is not worth it */
+static int sample_compressible(sample_read_t read, void *opaque, uint64_t size) {
+    uint8_t *block, *scratch;
+    uint64_t start = util_time_usec(), sampled = 0, estimated = 0;
+    int i, count, ret = 1;
+    if (sampling.min_gain <= 0 || size == 0) {
+        return 1;
+    }
+    block = malloc(SAMPLE_BLOCK_SIZE);
+    scratch = malloc(SAMPLE_BLOCK_SIZE);
+    if (!block || !scratch) {
+        free(block);
+        free(scratch);
+        return 1;
+    }
+    count = size <= (uint64_t)SAMPLE_COUNT * SAMPLE_BLOCK_SIZE ? (int)((size + SAMPLE_BLOCK_SIZE - 1) / SAMPLE_BLOCK_SIZE) : SAMPLE_COUNT;
+    for (i = 0; i < count; ++i) {
+        uint64_t offset = count < SAMPLE_COUNT ? (uint64_t)i * SAMPLE_BLOCK_SIZE : (size - SAMPLE_BLOCK_SIZE) / (count - 1) * i;
+        size_t n = size - offset < SAMPLE_BLOCK_SIZE ? size - offset : SAMPLE_BLOCK_SIZE;
+        n = read(opaque, offset, block, n);
+        sampled += n;
+        estimated += sample_estimate(block, n, scratch);
+    }
+    free(block);
+    free(scratch);
+    if (sampled > 0 && estimated * 100 >= sampled * (100 - sampling.min_gain)) {
+        ret = 0;
+        ++sampling.stored;
+        sampling.stored_bytes += size;
+        fprintf(stdout, "    Incompressible:   %'llu of %'llu sampled bytes left, stored uncompressed\n",
+                (unsigned long long)estimated, (unsigned long long)sampled);
+    }
+    sampling.sample_usec += util_time_usec() - start;
+    return ret;
+}
+
+static int find_profile(const char *name, int create) {
+    compress_profile_t *profile;
+    int i;
+    for (i = 0; i < profiles.count; ++i) {
+        if (!strcmp(profiles.profiles[i].name, name)) {
+            return i;
+        }
+    }
+    if (!create || profiles.count >= SPATCH_MAX_PROFILES) {
+        return -1;
+    }
+    profile = &profiles.profiles[profiles.count];
+    snprintf(profile->name, sizeof(profile->name), "%s", name);
+    profile->codec = CODEC_LZMA;
+    profile->level = -1;
+    profile->dict_size = 0;
+    profile->fb = profile->mc = profile->bt_mode = profile->hash_bytes = -1;
+    profile->lc = profile->lp = profile->pb = -1;
+    profile->primed = 0;
+    profile->filter = BCJ_NONE;
+    profile->literals_set = 0;
+    profile->engine = ENGINE_XDELTA;
+    profile->secondary = 0;
+    return profiles.count++;
+}
+
+/* relpath may be NULL (solid blocks), then only rules without a glob can match */
+static const compress_profile_t *select_profile(const char *relpath, uint64_t size) {
+    int i;
+    for (i = 0; i < profiles.rule_count; ++i) {
+        const compress_rule_t *rule = &profiles.rules[i];
+        if (size < rule->min_size || size > rule->max_size) {
+            continue;
+        }
+        if (rule->glob[0] && (!relpath || !util_glob_match(rule->glob, relpath))) {
+            continue;
+        }
+        return &profiles.profiles[rule->profile];
+    }
+    return &profiles.profiles[0];
+}
+
+static const char *path_extension(const char *path) {
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    if (!dot || (slash && dot < slash)) { return ""; }
+    return dot + 1;
+}
+
+static void profile_props(const compress_profile_t *profile, uint64_t input_size, CLzmaEncProps *props) {
+    LzmaEncProps_Init(props);
+    props->level = profile->level;
+    props->dictSize = profile->dict_size;
+    props->fb = profile->fb;
+    props->mc = profile->mc > 0 ? profile->mc : 0;
+    props->btMode = profile->bt_mode;
+    props->numHashBytes = profile->hash_bytes;
+    props->lc = profile->lc;
+    props->lp = profile->lp;
+    props->pb = profile->pb;
+    /* Let the encoder shrink the dictionary to what the input can use */
+    props->reduceSize = input_size;
+}
+
+#define TUNE_SLICES 4
+#define TUNE_SLICE_SIZE (64 * 1024)
+#define TUNE_MIN_SIZE (16 * 1024)
+
+/* lc/lp/pb combinations tried, the first is the default of profile "default" */
+static const int tune_grid[][3] = {
+    { 4, 2, 2 }, { 3, 0, 2 }, { 0, 2, 2 }, { 0, 1, 1 },
+    { 0, 3, 3 }, { 0, 4, 4 }, { 1, 0, 0 }, { 8, 0, 0 },
+};
+
+static int tune_find(const char *key) {
+    int i;
+    for (i = 0; i < autotune.count; ++i) {
+        if (!strcmp(autotune.classes[i].key, key)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int tune_add(const char *key, int lc, int lp, int pb) {
+    int i = tune_find(key);
+    if (i < 0) {
+        if (autotune.count >= SPATCH_MAX_TUNED) {
+            return -1;
+        }
+        i = autotune.count++;
+        snprintf(autotune.classes[i].key, sizeof(autotune.classes[i].key), "%s", key);
+    }
+    autotune.classes[i].lc = lc;
+    autotune.classes[i].lp = lp;
+    autotune.classes[i].pb = pb;
+    return i;
+}
+
+static int tune_cache_handler(void *user, const char *section, const char *name, const char *value) {
+    int lc, lp, pb;
+    (void)user;
+    if (!strcmp(section, "autotune") && sscanf(value, "%d %d %d", &lc, &lp, &pb) == 3) {
+        tune_add(name, lc, lp, pb);
+    }
+    return 1;
+}
+
+static void tune_cache_save() {
+    FILE *f;
+    int i;
+    if (!autotune.dirty) {
+        return;
+    }
+    f = fopen(autotune.cache_path, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to write autotune cache %s!\n", autotune.cache_path);
+        return;
+    }
+    fprintf(f, "; <file class> = lc lp pb, written by sdiffer\n[autotune]\n");
+    for (i = 0; i < autotune.count; ++i) {
+        fprintf(f, "%s = %d %d %d\n", autotune.classes[i].key,
+                autotune.classes[i].lc, autotune.classes[i].lp, autotune.classes[i].pb);
+    }
+    fclose(f);
+}
+
+/* Trial-compresses a few slices of the payload with each tune_grid entry until budget_ms runs out,
+ * returns the grid index with the smallest output */
+static int tune_trials(const compress_profile_t *profile, sample_read_t read, void *opaque, uint64_t size) {
+    uint8_t *sample, *packed;
+    size_t sample_size = 0, best_size = (size_t)-1;
+    uint64_t start = util_time_usec();
+    int i, best = 0;
+    CLzmaEncHandle enc;
+
+    sample = malloc(TUNE_SLICES * TUNE_SLICE_SIZE);
+    packed = malloc(TUNE_SLICES * TUNE_SLICE_SIZE * 2);
+    enc = LzmaEnc_Create(&my_alloc);
+    if (!sample || !packed || !enc) {
+        goto end;
+    }
+    if (size <= (uint64_t)TUNE_SLICES * TUNE_SLICE_SIZE) {
+        sample_size = read(opaque, 0, sample, size);
+    } else {
+        for (i = 0; i < TUNE_SLICES; ++i) {
+            sample_size += read(opaque, (size - TUNE_SLICE_SIZE) / (TUNE_SLICES - 1) * i,
+                                sample + sample_size, TUNE_SLICE_SIZE);
+        }
+    }
+    for (i = 0; i < (int)(sizeof(tune_grid) / sizeof(tune_grid[0])); ++i) {
+        CLzmaEncProps props;
+        SizeT packed_size = TUNE_SLICES * TUNE_SLICE_SIZE * 2;
+        if (i > 0 && util_time_usec() - start >= (uint64_t)autotune.budget_ms * 1000) {
+            break;
+        }
+        profile_props(profile, sample_size, &props);
+        props.lc = tune_grid[i][0];
+        props.lp = tune_grid[i][1];
+        props.pb = tune_grid[i][2];
+        if (LzmaEnc_SetProps(enc, &props) != SZ_OK
+            || LzmaEnc_MemEncode(enc, packed, &packed_size, sample, sample_size, 0, NULL, &my_alloc, &my_alloc) != SZ_OK) {
+            continue;
+        }
+        if (packed_size < best_size) {
+            best_size = packed_size;
+            best = i;
+        }
+    }
+    fprintf(stdout, "    Tuned:            lc=%d lp=%d pb=%d, %d trial(s) on %'lu bytes, best %'lu bytes\n",
+            tune_grid[best][0], tune_grid[best][1], tune_grid[best][2], i, sample_size, best_size);
+
+end:
+    if (enc) LzmaEnc_Destroy(enc, &my_alloc, &my_alloc);
+    free(sample);
+    free(packed);
+    autotune.usec += util_time_usec() - start;
+    return best;
+}
+
+/* Returns `profile` with lc/lp/pb of the payload's file class (extension + `suffix`) in `tuned`,
+ * running the trials the first time a class is seen */
+static const compress_profile_t *tune_profile(const compress_profile_t *profile, const char *relpath, const char *suffix,
+                                              sample_read_t read, void *opaque, uint64_t size, compress_profile_t *tuned) {
+    char key[48];
+    const char *ext = path_extension(relpath);
+    int i;
+    if (!autotune.enabled || profile->codec != CODEC_LZMA || profile->literals_set) {
+        return profile;
+    }
+    snprintf(key, sizeof(key), "%s%s", ext[0] ? ext : "(none)", suffix);
+    i = tune_find(key);
+    if (i < 0) {
+        int best;
+        if (size < TUNE_MIN_SIZE) {
+            return profile;
+        }
+        best = tune_trials(profile, read, opaque, size);
+        i = tune_add(key, tune_grid[best][0], tune_grid[best][1], tune_grid[best][2]);
+        if (i < 0) {
+            return profile;
+        }
+        autotune.dirty = 1;
+    }
+    *tuned = *profile;
+    tuned->lc = autotune.classes[i].lc;
+    tuned->lp = autotune.classes[i].lp;
+    tuned->pb = autotune.classes[i].pb;
+    return tuned;
+}
+
+/* With `prime` set the tail of it (up to the dictionary size) is used as preset dictionary */
+static int do_stream_compress(ISeqInStream *stm_in, size_t input_size, seq_out_file_t *stm_out,
+                              const compress_profile_t *profile, const uint8_t *prime, size_t prime_size) {
     size_t comp_size;
-    uint64_t file_offset, file_offset2;
+    uint32_t prime_len = 0;
+    uint64_t start;
+    seq_in_primed_t stm_primed;
+    uint64_t file_offset, payload_offset, file_offset2;
     int i;
     SRes res;
     uint8_t header[LZMA_PROPS_SIZE + 8] = {0};
@@ -82,15 +615,15 @@ static int do_stream_compress(ISeqInStream *stm_in, size_t input_size, seq_out_f
 
     CLzmaEncHandle enc;
     CLzmaEncProps props;
-    ISzAlloc my_alloc = { SzAlloc, SzFree };
 
-    enc = LzmaEnc_Create(&my_alloc);
-    LzmaEncProps_Init(&props);
-    props.level = 9;
-    props.fb = 256;
-    props.lc = 4;
-    props.lp = 2;
-    props.pb = 2;
+    if (!pooled_enc) {
+        pooled_enc = LzmaEnc_Create(&my_alloc);
+        if (!pooled_enc) {
+            return -SZ_ERROR_MEM;
+        }
+    }
+    enc = pooled_enc;
+    profile_props(profile, input_size + prime_size, &props);
     props.writeEndMark = 1;
     LzmaEnc_SetProps(enc, &props);
 
@@ -98,24 +631,409 @@ static int do_stream_compress(ISeqInStream *stm_in, size_t input_size, seq_out_f
     if (res != SZ_OK) {
         return -res;
     }
+    if (prime) {
+        /* spatcher primes as many bytes as the dictionary in the props holds */
+        uint32_t dict_size;
+        memcpy(&dict_size, header + sizeof(uint32_t) * 2 + 1, sizeof(uint32_t));
+        prime_len = prime_size < dict_size ? prime_size : dict_size;
+        stm_primed.stream.Read = primed_read;
+        stm_primed.prime = prime + prime_size - prime_len;
+        stm_primed.prime_left = prime_len;
+        stm_primed.next = stm_in;
+        stm_in = &stm_primed.stream;
+    }
 
     *(uint32_t*)&header[sizeof(uint32_t)] = input_size;
     file_offset = vfs.tell(stm_out->fout);
-    vfs.write(stm_out->fout, header, header_size + sizeof(uint32_t) * 2);
-    progress.total = input_size;
+    vfs.write(stm_out->fout, header, sizeof(uint32_t));
+    write_payload_padding(stm_out->fout);
+    payload_offset = vfs.tell(stm_out->fout);
+    vfs.write(stm_out->fout, header + sizeof(uint32_t), header_size + sizeof(uint32_t));
+    progress.total = input_size + prime_len;
     progress.progress.Progress = compress_progress_callback;
-    res = LzmaEnc_Encode(enc, &stm_out->stream, stm_in,
-                         &progress.progress, &my_alloc, &my_alloc);
+    start = util_time_usec();
+    res = LzmaEnc_EncodePrimed(enc, &stm_out->stream, stm_in, prime_len,
+                               &progress.progress, &my_alloc, &my_alloc);
+    sampling.lzma_usec += util_time_usec() - start;
+    sampling.lzma_bytes += input_size;
     file_offset2 = vfs.tell(stm_out->fout);
     vfs.seek(stm_out->fout, file_offset, VFS_SEEK_POSITION_START);
-    comp_size = file_offset2 - file_offset - sizeof(uint32_t);
+    comp_size = file_offset2 - payload_offset;
     vfs.write(stm_out->fout, &comp_size, sizeof(uint32_t));
     vfs.seek(stm_out->fout, file_offset2, VFS_SEEK_POSITION_START);
-    LzmaEnc_Destroy(enc, &my_alloc, &my_alloc);
-    fprintf(stdout, "\r    Compressing: %'llu/%'llu(100%%)   to: %'lu\n", progress.total, progress.total, comp_size);
+    fprintf(stdout, "\r    Compressing: %'llu/%'llu(100%%)   to: %'lu [%s]\n", (unsigned long long)progress.total,
+            (unsigned long long)progress.total, comp_size, profile->name);
+    arena_reset(lzma_arena);
     return -res;
 }
 
+/* Payload: uint32_t original size, then per LZ77_BLOCK_SIZE block a uint32_t length
+ * (top bit set if the block is stored) followed by the block data */
+static int do_fast_compress(ISeqInStream *stm_in, size_t input_size, seq_out_file_t *stm_out,
+                            const compress_profile_t *profile) {
+    uint8_t *raw = malloc(LZ77_BLOCK_SIZE), *packed = malloc(lz77_bound(LZ77_BLOCK_SIZE));
+    uint64_t file_offset, payload_offset, file_offset2;
+    uint32_t comp_size, orig_size = input_size;
+    size_t left = input_size;
+    int ret = 0;
+
+    if (!raw || !packed) {
+        free(raw);
+        free(packed);
+        fprintf(stderr, "Out of memory!\n");
+        return -1;
+    }
+    file_offset = vfs.tell(stm_out->fout);
+    vfs.write(stm_out->fout, &orig_size, sizeof(uint32_t));
+    write_payload_padding(stm_out->fout);
+    payload_offset = vfs.tell(stm_out->fout);
+    vfs.write(stm_out->fout, &orig_size, sizeof(uint32_t));
+    while (left > 0) {
+        size_t block = left < LZ77_BLOCK_SIZE ? left : LZ77_BLOCK_SIZE;
+        size_t got = 0, packed_size;
+        uint32_t header;
+        while (got < block) {
+            size_t n = block - got;
+            stm_in->Read(stm_in, raw + got, &n);
+            if (n == 0) {
+                break;
+            }
+            got += n;
+        }
+        if (got < block) {
+            ret = -1;
+            break;
+        }
+        packed_size = lz77_compress(raw, block, packed, lz77_bound(LZ77_BLOCK_SIZE));
+        if (packed_size == 0 || packed_size >= block) {
+            header = (uint32_t)block | 0x80000000U;
+            vfs.write(stm_out->fout, &header, sizeof(uint32_t));
+            vfs.write(stm_out->fout, raw, block);
+        } else {
+            header = (uint32_t)packed_size;
+            vfs.write(stm_out->fout, &header, sizeof(uint32_t));
+            vfs.write(stm_out->fout, packed, packed_size);
+        }
+        left -= block;
+    }
+    free(raw);
+    free(packed);
+    file_offset2 = vfs.tell(stm_out->fout);
+    comp_size = file_offset2 - payload_offset;
+    vfs.seek(stm_out->fout, file_offset, VFS_SEEK_POSITION_START);
+    vfs.write(stm_out->fout, &comp_size, sizeof(uint32_t));
+    vfs.seek(stm_out->fout, file_offset2, VFS_SEEK_POSITION_START);
+    fprintf(stdout, "    Compressing: %'lu/%'lu(100%%)   to: %'u [%s]\n", input_size, input_size, comp_size, profile->name);
+    return ret;
+}
+
+static int dir_path_compare(const void *a, const void *b) {
+    return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+static uint32_t name_table_lookup(const char *dir) {
+    char **found;
+    if (dir[0] == 0) {
+        return 0;
+    }
+    found = bsearch(&dir, name_table.dirs, name_table.count, sizeof(char*), dir_path_compare);
+    return found ? (uint32_t)(found - name_table.dirs) + 1 : 0xFFFFFFFFU;
+}
+
+/* Once the directory table is written, paths are stored as uint32_t directory id followed by the base name */
+static uint16_t encode_entry_name(const char *relpath, uint8_t *out) {
+    const char *slash;
+    char dir[1024];
+    uint32_t id;
+    uint16_t len;
+    if (!name_table.enabled) {
+        len = strlen(relpath);
+        memcpy(out, relpath, len);
+        return len;
+    }
+    slash = strrchr(relpath, '/');
+    if (slash) {
+        memcpy(dir, relpath, slash - relpath);
+        dir[slash - relpath] = 0;
+        relpath = slash + 1;
+    } else {
+        dir[0] = 0;
+    }
+    id = name_table_lookup(dir);
+    if (id == 0xFFFFFFFFU) {
+        fprintf(stderr, "Directory missing from name table: %s\n", dir);
+    }
+    memcpy(out, &id, sizeof(uint32_t));
+    len = strlen(relpath);
+    memcpy(out + sizeof(uint32_t), relpath, len);
+    return len + sizeof(uint32_t);
+}
+
+static void write_raw_name(struct vfs_file_handle *output_file, const char *name) {
+    uint16_t namelen = strlen(name);
+    vfs.write(output_file, &namelen, 2);
+    vfs.write(output_file, name, namelen);
+}
+
+static void write_entry_name(struct vfs_file_handle *output_file, const char *relpath) {
+    uint8_t name[1024 + sizeof(uint32_t)];
+    uint16_t namelen = encode_entry_name(relpath, name);
+    vfs.write(output_file, &namelen, 2);
+    vfs.write(output_file, name, namelen);
+}
+
+/* Batches of source checksums indexed by index_parallel, for the summary */
+static uint32_t index_batches = 0;
+
+typedef struct index_task_s {
+    xd3_parallel_task *task;
+    void *arg;
+    usize_t index;
+} index_task_t;
+
+static void index_thread(void *arg) {
+    index_task_t *t = (index_task_t*)arg;
+    t->task(t->arg, t->index);
+}
+
+/* xd3_parallel_func: task 0 runs on the calling thread */
+static void index_parallel(void *opaque, xd3_parallel_task *task, void *arg, usize_t count) {
+    index_task_t tasks[64];
+    thread_t *threads[64];
+    usize_t i;
+    (void)opaque;
+    if (count > 64) count = 64;
+    ++index_batches;
+    for (i = 1; i < count; ++i) {
+        tasks[i].task = task;
+        tasks[i].arg = arg;
+        tasks[i].index = i;
+        threads[i] = thread_create(index_thread, &tasks[i]);
+        if (!threads[i]) {
+            index_thread(&tasks[i]);
+        }
+    }
+    task(arg, 0);
+    for (i = 1; i < count; ++i) {
+        if (threads[i]) {
+            thread_join(threads[i]);
+        }
+    }
+}
+
+/* Feeds the input to the stream one window at a time and appends the VCDIFF output to stm */
+static int encode_range(xd3_stream *stream, const uint8_t *inp, size_t size, memstream_t *stm) {
+    size_t ipos = 0;
+    usize_t n = xd3_min(stream->winsize, size);
+    int ret;
+    stream->flags |= XD3_FLUSH;
+    xd3_avail_input(stream, inp, n);
+    ipos += n;
+    while (1) {
+        ret = xd3_encode_input(stream);
+        switch (ret) {
+        case XD3_INPUT:
+            n = xd3_min(stream->winsize, size - ipos);
+            if (n == 0) { return 0; }
+            xd3_avail_input(stream, inp + ipos, n);
+            ipos += n;
+            break;
+        case XD3_OUTPUT:
+            memstream_write(stm, stream->next_out, stream->avail_out);
+            xd3_consume_output(stream);
+            break;
+        case XD3_GOTHEADER:
+        case XD3_WINSTART:
+        case XD3_WINFINISH:
+            /* no action necessary */
+            break;
+        default:
+            fprintf(stderr, "Error encode stream: %d\n", ret);
+            return ret;
+        }
+    }
+}
+
+typedef struct encode_job_s {
+    xd3_stream stream;
+    xd3_source source;
+    const uint8_t *inp;
+    size_t size;
+    memstream_t *stm;
+    int ret;
+} encode_job_t;
+
+static void encode_thread(void *arg) {
+    encode_job_t *job = (encode_job_t*)arg;
+    job->ret = encode_range(&job->stream, job->inp, job->size, job->stm);
+}
+
+/* Files encode_parallel split into window ranges, for the summary */
+static uint32_t encode_parallel_files = 0;
+
+/* Splits the input into encode_threads ranges of whole windows. `first` has its source indexed already and encodes
+ * the first range, the others get their own streams sharing that index and leave out the VCDIFF header, their outputs
+ * are appended in order so spatcher decodes the result as one delta */
+static int encode_parallel(xd3_stream *first, const xd3_config *config, const uint8_t *src, size_t src_size,
+                           const uint8_t *inp, size_t inp_size, memstream_t *stm) {
+    thread_t *threads[SPATCH_MAX_ENCODE_THREADS];
+    encode_job_t *jobs = NULL;
+    xd3_config shared_config = *config;
+    size_t winsize = first->winsize;
+    size_t windows = (inp_size + winsize - 1) / winsize;
+    size_t count = xd3_min(encode_threads, windows);
+    size_t range = (windows + count - 1) / count * winsize;
+    size_t i;
+    int ret;
+
+    count = (inp_size + range - 1) / range;
+    jobs = calloc(count, sizeof(encode_job_t));
+    if (!jobs) {
+        fprintf(stderr, "Out of memory!\n");
+        return -1;
+    }
+    ++encode_parallel_files;
+    shared_config.flags |= XD3_NOHEADER;
+    for (i = 1; i < count; ++i) {
+        encode_job_t *job = &jobs[i];
+        job->inp = inp + i * range;
+        job->size = xd3_min(range, inp_size - i * range);
+        job->stm = memstream_create();
+        job->source.blksize = src_size;
+        job->source.onblk = src_size;
+        job->source.curblk = src;
+        job->source.curblkno = 0;
+        job->source.max_winsize = src_size;
+        shared_config.opaque = xd3_arena(&xd3_arenas.jobs[i]);
+        job->ret = shared_config.opaque ? xd3_config_stream(&job->stream, &shared_config) : ENOMEM;
+        if (job->ret == 0) job->ret = xd3_set_source_and_size(&job->stream, &job->source, src_size);
+        if (job->ret == 0) job->ret = xd3_encode_share_source(&job->stream, first);
+        threads[i] = NULL;
+        if (job->ret == 0) {
+            threads[i] = thread_create(encode_thread, job);
+            if (!threads[i]) {
+                encode_thread(job);
+            }
+        } else {
+            fprintf(stderr, "Error create stream: %s\n", job->stream.msg ? job->stream.msg : "");
+        }
+    }
+    ret = encode_range(first, inp, xd3_min(range, inp_size), stm);
+    for (i = 1; i < count; ++i) {
+        encode_job_t *job = &jobs[i];
+        if (threads[i]) {
+            thread_join(threads[i]);
+        }
+        if (ret == 0) {
+            ret = job->ret;
+        }
+        while (ret == 0) {
+            uint8_t buf[256 * 1024];
+            size_t rd = memstream_read(job->stm, buf, sizeof(buf));
+            memstream_write(stm, buf, rd);
+            if (rd < sizeof(buf)) {
+                break;
+            }
+        }
+        memstream_destroy(job->stm);
+        xd3_close_stream(&job->stream);
+        xd3_free_stream(&job->stream);
+        if (xd3_arenas.jobs[i]) arena_reset(xd3_arenas.jobs[i]);
+    }
+    free(jobs);
+    return ret;
+}
+
+#define INDEX_FILE_MAGIC 0x49445853U /* "SXDI" */
+/* The table follows at INDEX_FILE_TABLE_OFFSET, so it is aligned in the mapping */
+#define INDEX_FILE_TABLE_OFFSET 64
+
+typedef struct index_file_header_s {
+    uint32_t magic;
+    uint32_t usize_bytes;
+    uint64_t source_size;
+    uint64_t source_hash;
+    uint32_t slots, look, step;
+} index_file_header_t;
+
+/* Indexes the source of `stream` before encoding, from index_cache when it holds the file and into it otherwise.
+ * A loaded table stays mapped at *map until the stream is freed */
+static int index_source(xd3_stream *stream, const uint8_t *src, size_t src_size, void **map, int64_t *map_size) {
+    char path[1024], tmp_path[1040];
+    index_file_header_t header;
+    const usize_t *table;
+    usize_t slots, look, step;
+    uint64_t hash;
+    struct vfs_file_handle *f;
+    int ret;
+
+    if (!index_cache.dir[0] || src_size < INDEX_CACHE_MIN_SIZE) {
+        ret = xd3_encode_index_source(stream);
+        if (ret != 0) {
+            fprintf(stderr, "Error index source: %s\n", stream->msg ? stream->msg : "");
+        }
+        return ret;
+    }
+    hash = util_hash64(0, src, src_size);
+    snprintf(path, sizeof(path), "%s/%016llx.xdi", index_cache.dir, (unsigned long long)hash);
+    *map = util_map_file(path, map_size);
+    if (*map) {
+        if (*map_size >= INDEX_FILE_TABLE_OFFSET) {
+            memcpy(&header, *map, sizeof(header));
+            if (header.magic == INDEX_FILE_MAGIC && header.usize_bytes == sizeof(usize_t)
+                && header.source_size == src_size && header.source_hash == hash
+                && *map_size == INDEX_FILE_TABLE_OFFSET + (int64_t)(header.slots * sizeof(usize_t))
+                && xd3_encode_load_source_index(stream, (const usize_t*)((const uint8_t*)*map + INDEX_FILE_TABLE_OFFSET),
+                                                header.slots, header.look, header.step) == 0) {
+                fprintf(stdout, "  Source index:     %s\n", path);
+                ++index_cache.loaded;
+                return 0;
+            }
+        }
+        /* another configuration or a damaged file, rebuilt below */
+        util_unmap_file(*map, *map_size);
+        *map = NULL;
+    }
+
+    ret = xd3_encode_index_source(stream);
+    if (ret != 0) {
+        fprintf(stderr, "Error index source: %s\n", stream->msg ? stream->msg : "");
+        return ret;
+    }
+    if (xd3_encode_source_index(stream, &table, &slots, &look, &step) != 0) {
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_FILE_MAGIC;
+    header.usize_bytes = sizeof(usize_t);
+    header.source_size = src_size;
+    header.source_hash = hash;
+    header.slots = slots;
+    header.look = look;
+    header.step = step;
+    /* written under a temporary name, so concurrent runs never map a partial file */
+    util_mkdir(index_cache.dir, 1);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    f = vfs.open(tmp_path, VFS_FILE_ACCESS_WRITE, 0);
+    if (f) {
+        uint8_t pad[INDEX_FILE_TABLE_OFFSET] = {0};
+        int64_t table_size = (int64_t)slots * sizeof(usize_t);
+        int ok = vfs.write(f, &header, sizeof(header)) == sizeof(header)
+                 && vfs.write(f, pad, INDEX_FILE_TABLE_OFFSET - sizeof(header)) == INDEX_FILE_TABLE_OFFSET - sizeof(header)
+                 && vfs.write(f, table, table_size) == table_size;
+        vfs.close(f);
+        /* replaces a file of another configuration, rename does not overwrite on Windows */
+        if (ok) vfs.remove(path);
+        if (ok && vfs.rename(tmp_path, path) == 0) {
+            fprintf(stdout, "  Source index:     saved to %s\n", path);
+            ++index_cache.saved;
+        } else {
+            vfs.remove(tmp_path);
+        }
+    }
+    return 0;
+}
+
 static int make_diff(const char *relpath,
                      struct vfs_file_handle *source_file,
                      struct vfs_file_handle *input_file,
@@ -124,10 +1042,16 @@ static int make_diff(const char *relpath,
     int ret = 0;
     uint8_t *src = NULL, *inp = NULL;
     size_t src_size = 0, inp_size = 0;
-    usize_t n = 0, ipos = 0;
+    memstream_t *stm = NULL;
     xd3_source source = {0};
     xd3_stream stream = {0};
     xd3_config config = {0};
+    const compress_profile_t *profile;
+    int filter = BCJ_NONE;
+    int sa_engine = 0;
+    int parallel;
+    void *index_map = NULL;
+    int64_t index_map_size = 0;
 
     src_size = vfs.size(source_file);
     src = malloc(src_size);
@@ -149,8 +1073,70 @@ static int make_diff(const char *relpath,
     vfs.seek(input_file, 0, VFS_SEEK_POSITION_START);
     vfs.read(input_file, inp, inp_size);
 
+    fprintf(stdout, "  Source file path: %s\n", vfs.get_path(source_file));
+    fprintf(stdout, "  Input file path:  %s\n", vfs.get_path(input_file));
+    fprintf(stdout, "  Source file size: %'lu\n", src_size);
+    fprintf(stdout, "  Input file size:  %'lu\n", inp_size);
+
+    profile = select_profile(relpath, inp_size);
+    if (compress && profile->primed && profile->codec == CODEC_LZMA && inp_size > 0) {
+        seq_in_file_t stm_in;
+        seq_out_file_t stm_out;
+        uint8_t type = DIFF_TYPE_CHANGE_PRIMED_LZMA;
+
+        write_entry_name(output_file, relpath);
+        vfs.write(output_file, &type, 1);
+        vfs.seek(input_file, 0, VFS_SEEK_POSITION_START);
+        stm_in.stream.Read = file_read;
+        stm_in.fin = input_file;
+        stm_out.stream.Write = stream_write;
+        stm_out.fout = output_file;
+        ret = do_stream_compress(&stm_in.stream, inp_size, &stm_out, profile, src, src_size);
+        free(src);
+        free(inp);
+        return ret;
+    }
+
+    filter = profile->filter < 0 ? bcj_detect(inp, inp_size) : profile->filter;
+    if (filter != BCJ_NONE) {
+        fprintf(stdout, "  Branch filter:    %s\n", filter == BCJ_X86 ? "x86" : "arm64");
+        bcj_convert(filter, src, src_size, 0, 1);
+        bcj_convert(filter, inp, inp_size, 0, 1);
+    }
+
+    /* the suffix array patch is only written LZMA compressed */
+    if (compress && profile->engine == ENGINE_SA && profile->codec == CODEC_LZMA && src_size <= SADIFF_MAX_SOURCE) {
+        uint64_t start = util_time_usec();
+        sa_engine = 1;
+        stm = memstream_create();
+        ret = sadiff_encode(src, src_size, inp, inp_size, stm);
+        if (ret != 0) {
+            fprintf(stderr, "Out of memory!\n");
+            goto end;
+        }
+        fprintf(stdout, "  Suffix array:     %'llu ms\n", (unsigned long long)(util_time_usec() - start) / 1000);
+        goto end;
+    }
+
     xd3_init_config(&config, 0);
-    config.winsize = inp_size;
+    /* Bounded windows let spatcher start writing output before the whole entry is decoded */
+    config.winsize = xd3_min(inp_size, XD3_DEFAULT_WINSIZE);
+    config.parallel = index_parallel;
+    config.index_threads = index_threads;
+    if (window_checksum) config.flags |= XD3_ADLER32;
+    config.alloc = xd3_arena_alloc;
+    config.freef = xd3_arena_free;
+    config.opaque = xd3_arena(&xd3_arenas.main);
+    if (compress && (profile->secondary & XD3_SEC_TYPE)) {
+        int level = profile->level < 0 ? 9 : profile->level;
+        config.flags |= profile->secondary;
+        config.sec_data.level = config.sec_inst.level = config.sec_addr.level = xd3_max(level, 1);
+    }
+    if (!config.opaque) {
+        fprintf(stderr, "Out of memory!\n");
+        ret = -1;
+        goto end;
+    }
     ret = xd3_config_stream(&stream, &config);
     if (ret != 0) {
         fprintf(stderr, "Error create stream!\n");
@@ -167,125 +1153,696 @@ static int make_diff(const char *relpath,
         goto end;
     }
 
-    fprintf(stdout, "  Source file path: %s\n", vfs.get_path(source_file));
-    fprintf(stdout, "  Input file path:  %s\n", vfs.get_path(input_file));
-    fprintf(stdout, "  Source file size: %'lu\n", src_size);
-    fprintf(stdout, "  Input file size:  %'lu\n", inp_size);
-    n = xd3_min(stream.winsize, inp_size);
-    stream.flags |= XD3_FLUSH;
-    xd3_avail_input(&stream, inp + ipos, n);
-    ipos += n;
+    stm = memstream_create();
+    parallel = encode_threads > 1 && inp_size >= 2 * (size_t)stream.winsize;
+    /* otherwise xdelta indexes the source while encoding the first window */
+    if (parallel || (index_cache.dir[0] && src_size >= INDEX_CACHE_MIN_SIZE)) {
+        ret = index_source(&stream, src, src_size, &index_map, &index_map_size);
+    }
+    if (ret == 0 && parallel) {
+        ret = encode_parallel(&stream, &config, src, src_size, inp, inp_size, stm);
+    } else if (ret == 0) {
+        ret = encode_range(&stream, inp, inp_size, stm);
+    }
+
+end:
+    xd3_close_stream(&stream);
+    xd3_free_stream(&stream);
+    if (xd3_arenas.main) arena_reset(xd3_arenas.main);
+    if (index_map) util_unmap_file(index_map, index_map_size);
+    if (src) free(src);
+    if (inp) free(inp);
+
+    if (ret != 0) {
+        if (stm) memstream_destroy(stm);
+        return ret;
+    }
+
+    write_entry_name(output_file, relpath);
+    if (filter != BCJ_NONE) {
+        uint8_t header[2] = { DIFF_TYPE_FILTERED, (uint8_t)filter };
+        vfs.write(output_file, header, 2);
+    }
+    fprintf(stdout, "  Patch data size:  %'lu\n", memstream_size(stm));
+    /* sections are already compressed, another pass over the whole patch gains next to nothing */
+    if (config.flags & XD3_SEC_TYPE) {
+        compress = 0;
+    }
+    if (compress && !sa_engine && !sample_compressible(sample_read_memstream, stm, memstream_size(stm))) {
+        compress = 0;
+    }
+    if (compress) {
+        seq_in_stream_t stm_in;
+        seq_out_file_t stm_out;
+
+        uint32_t size = memstream_size(stm);
+        compress_profile_t tuned;
+        uint8_t type;
+        profile = tune_profile(profile, relpath, sa_engine ? "/sadiff" : "/xdelta", sample_read_memstream, stm, size, &tuned);
+        type = sa_engine ? DIFF_TYPE_CHANGE_SA_LZMA :
+               profile->codec == CODEC_FAST ? DIFF_TYPE_CHANGE_FAST : DIFF_TYPE_CHANGE_LZMA;
+        vfs.write(output_file, &type, 1);
+
+        stm_in.stream.Read = stream_read;
+        stm_in.stm = stm;
+        stm_out.stream.Write = stream_write;
+        stm_out.fout = output_file;
+        if (profile->codec == CODEC_FAST) {
+            do_fast_compress(&stm_in.stream, size, &stm_out, profile);
+        } else {
+            do_stream_compress(&stm_in.stream, size, &stm_out, profile, NULL, 0);
+        }
+    } else {
+        uint32_t size = memstream_size(stm);
+
+        uint8_t type = DIFF_TYPE_CHANGE;
+        vfs.write(output_file, &type, 1);
+        vfs.write(output_file, &size, sizeof(uint32_t));
+        write_payload_padding(output_file);
+        while (1) {
+            uint8_t buf[256 * 1024];
+            size_t rd = memstream_read(stm, buf, 256 * 1024);
+            vfs.write(output_file, buf, rd);
+            if (rd < 256 * 1024) {
+                break;
+            }
+        }
+    }
+    memstream_destroy(stm);
+
+    return 0;
+}
+
+/* Reads a branch filtered copy of the file when its profile asks for a filter, NULL otherwise */
+static uint8_t *read_filtered(const char *relpath, struct vfs_file_handle *input_file, uint32_t size, int *filter) {
+    const compress_profile_t *profile = select_profile(relpath, size);
+    uint8_t *data;
+    *filter = BCJ_NONE;
+    if (profile->filter == BCJ_NONE || size == 0) {
+        return NULL;
+    }
+    data = malloc(size);
+    if (!data) {
+        return NULL;
+    }
+    vfs.seek(input_file, 0, VFS_SEEK_POSITION_START);
+    if (vfs.read(input_file, data, size) == size) {
+        *filter = profile->filter < 0 ? bcj_detect(data, size) : profile->filter;
+    }
+    vfs.seek(input_file, 0, VFS_SEEK_POSITION_START);
+    if (*filter == BCJ_NONE) {
+        free(data);
+        return NULL;
+    }
+    fprintf(stdout, "  Branch filter:    %s\n", *filter == BCJ_X86 ? "x86" : "arm64");
+    bcj_convert(*filter, data, size, 0, 1);
+    return data;
+}
+
+static int write_add_payload(const char *relpath,
+                             struct vfs_file_handle *input_file,
+                             struct vfs_file_handle *output_file,
+                             int compress) {
+    uint32_t size = vfs.size(input_file);
+    int filter;
+    uint8_t *data = read_filtered(relpath, input_file, size, &filter);
+    if (data) {
+        uint8_t header[2] = { DIFF_TYPE_FILTERED, (uint8_t)filter };
+        vfs.write(output_file, header, 2);
+    }
+    if (compress && !sample_compressible(data ? sample_read_buf : sample_read_file,
+                                         data ? (void*)data : (void*)input_file, size)) {
+        compress = 0;
+    }
+    vfs.seek(input_file, 0, VFS_SEEK_POSITION_START);
+    if (compress) {
+        seq_in_file_t stm_in;
+        seq_in_buf_t stm_buf;
+        seq_out_file_t stm_out;
+
+        compress_profile_t tuned;
+        const compress_profile_t *profile = tune_profile(select_profile(relpath, size), relpath, "",
+                                                         data ? sample_read_buf : sample_read_file,
+                                                         data ? (void*)data : (void*)input_file, size, &tuned);
+        uint8_t type = profile->codec == CODEC_FAST ? DIFF_TYPE_ADD_OR_REPLACE_FAST : DIFF_TYPE_ADD_OR_REPLACE_LZMA;
+        vfs.write(output_file, &type, 1);
+        vfs.seek(input_file, 0, VFS_SEEK_POSITION_START);
+
+        stm_in.stream.Read = file_read;
+        stm_in.fin = input_file;
+        stm_buf.stream.Read = buf_read;
+        stm_buf.data = data;
+        stm_buf.left = size;
+        stm_out.stream.Write = stream_write;
+        stm_out.fout = output_file;
+        if (profile->codec == CODEC_FAST) {
+            do_fast_compress(data ? &stm_buf.stream : &stm_in.stream, size, &stm_out, profile);
+        } else {
+            do_stream_compress(data ? &stm_buf.stream : &stm_in.stream, size, &stm_out, profile, NULL, 0);
+        }
+    } else {
+        uint8_t type = DIFF_TYPE_ADD_OR_REPLACE;
+        vfs.write(output_file, &type, 1);
+        vfs.write(output_file, &size, sizeof(uint32_t));
+        write_payload_padding(output_file);
+        if (data) {
+            vfs.write(output_file, data, size);
+        } else {
+            while (1) {
+                uint8_t buf[256 * 1024];
+                int64_t rd = vfs.read(input_file, buf, 256 * 1024);
+                if (rd > 0) {
+                    vfs.write(output_file, buf, rd);
+                }
+                if (rd < 256 * 1024) {
+                    break;
+                }
+            }
+        }
+    }
+    free(data);
+    return 0;
+}
+
+int make_add_file(const char *relpath,
+                  struct vfs_file_handle *input_file,
+                  struct vfs_file_handle *output_file,
+                  int compress) {
+    fprintf(stdout, "  Add file path:    %s\n", vfs.get_path(input_file));
+    write_entry_name(output_file, relpath);
+    return write_add_payload(relpath, input_file, output_file, compress);
+}
+
+/* Solid blocks are LZMA, files whose profile picks another codec or a branch filter are added on their own */
+static int solid_accepts(const char *relpath, int64_t size) {
+    const compress_profile_t *profile = select_profile(relpath, size);
+    return solid.enabled && size <= solid.max_file_size
+        && profile->codec == CODEC_LZMA && profile->filter == BCJ_NONE;
+}
+
+/* strdup is not declared under the _POSIX_SOURCE xdelta3.h sets */
+static char *copy_string(const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = malloc(len);
+    if (copy) { memcpy(copy, str, len); }
+    return copy;
+}
+
+static int solid_queue_file(const char *relpath, const char *input_path, uint32_t size) {
+    solid_file_t *file;
+    if (solid.count == solid.capacity) {
+        size_t capacity = solid.capacity ? solid.capacity * 2 : 256;
+        solid_file_t *files = realloc(solid.files, capacity * sizeof(solid_file_t));
+        if (!files) { return -1; }
+        solid.files = files;
+        solid.capacity = capacity;
+    }
+    file = &solid.files[solid.count];
+    file->relpath = copy_string(relpath);
+    file->input_path = copy_string(input_path);
+    file->size = size;
+    if (!file->relpath || !file->input_path) {
+        free(file->relpath);
+        free(file->input_path);
+        return -1;
+    }
+    ++solid.count;
+    return 0;
+}
+
+static int solid_file_compare(const void *a, const void *b) {
+    const solid_file_t *fa = a, *fb = b;
+    int ret = strcmp(path_extension(fa->relpath), path_extension(fb->relpath));
+    return ret != 0 ? ret : strcmp(fa->relpath, fb->relpath);
+}
+
+/* Block content, LZMA-compressed as a whole:
+ *   uint32_t count, count * (uint16_t namelen, name, uint32_t size), then file data in the same order */
+static int write_solid_block(struct vfs_file_handle *output_file, const solid_file_t *files, size_t count) {
+    size_t i;
+    int ret = 0;
+    uint8_t type = DIFF_TYPE_SOLID_LZMA;
+    uint32_t file_count = count;
     memstream_t *stm = memstream_create();
-    while(1) {
-        ret = xd3_encode_input(&stream);
-        switch (ret) {
-        case XD3_INPUT:
-            n = xd3_min(stream.winsize, inp_size - ipos);
-            if (n == 0) { ret = 0; goto end; }
-            xd3_avail_input(&stream, inp + ipos, n);
-            ipos += n;
+    seq_in_stream_t stm_in;
+    seq_out_file_t stm_out;
+
+    memstream_write(stm, &file_count, sizeof(uint32_t));
+    for (i = 0; i < count; ++i) {
+        uint8_t name[1024 + sizeof(uint32_t)];
+        uint16_t namelen = encode_entry_name(files[i].relpath, name);
+        memstream_write(stm, &namelen, 2);
+        memstream_write(stm, name, namelen);
+        memstream_write(stm, &files[i].size, sizeof(uint32_t));
+    }
+    for (i = 0; i < count; ++i) {
+        struct vfs_file_handle *finp = vfs.open(files[i].input_path, VFS_FILE_ACCESS_READ, 0);
+        uint8_t *data;
+        if (!finp) {
+            ret = -1;
             break;
-        case XD3_OUTPUT:
-            memstream_write(stm, stream.next_out, stream.avail_out);
-            xd3_consume_output(&stream);
+        }
+        data = malloc(files[i].size + 1);
+        if (!data) {
+            vfs.close(finp);
+            fprintf(stderr, "Out of memory!\n");
+            ret = -1;
             break;
-        case XD3_GOTHEADER:
-        case XD3_WINSTART:
-        case XD3_WINFINISH:
-            /* no action necessary */
+        }
+        if (files[i].size > 0 && vfs.read(finp, data, files[i].size) != files[i].size) {
+            free(data);
+            vfs.close(finp);
+            ret = -1;
             break;
-        default:
-            fprintf(stderr, "Error encode stream: %d\n", ret);
-            goto end;
+        }
+        memstream_write(stm, data, files[i].size);
+        free(data);
+        vfs.close(finp);
+        fprintf(stdout, "  Add file path:    %s (solid)\n", files[i].input_path);
+    }
+    if (ret == 0) {
+        write_raw_name(output_file, "");
+        vfs.write(output_file, &type, 1);
+        stm_in.stream.Read = stream_read;
+        stm_in.stm = stm;
+        stm_out.stream.Write = stream_write;
+        stm_out.fout = output_file;
+        ret = do_stream_compress(&stm_in.stream, memstream_size(stm), &stm_out,
+                                 select_profile(NULL, memstream_size(stm)), NULL, 0);
+    }
+    memstream_destroy(stm);
+    return ret;
+}
+
+/* Writes all queued small adds as solid blocks of at most solid.block_size input bytes */
+static int solid_flush(struct vfs_file_handle *output_file) {
+    size_t i, start = 0;
+    uint64_t block_bytes = 0;
+    int ret = 0;
+    if (solid.count == 0) {
+        return 0;
+    }
+    if (solid.sort_by_ext) {
+        qsort(solid.files, solid.count, sizeof(solid_file_t), solid_file_compare);
+    }
+    for (i = 0; i <= solid.count && ret == 0; ++i) {
+        if (i == solid.count || (i > start && block_bytes + solid.files[i].size > solid.block_size)) {
+            fprintf(stdout, "Solid block: %'lu file(s), %'llu bytes\n", i - start, (unsigned long long)block_bytes);
+            ret = write_solid_block(output_file, solid.files + start, i - start);
+            start = i;
+            block_bytes = 0;
+        }
+        if (i < solid.count) {
+            block_bytes += solid.files[i].size;
+        }
+    }
+    for (i = 0; i < solid.count; ++i) {
+        free(solid.files[i].relpath);
+        free(solid.files[i].input_path);
+    }
+    solid.count = 0;
+    return ret;
+}
+
+typedef struct file_list_s {
+    char **paths;
+    size_t count, capacity;
+} file_list_t;
+
+static void join_path(char *out, size_t size, const char *dir, const char *name) {
+    if (dir[0] == 0) {
+        snprintf(out, size, "%s", name);
+    } else {
+        snprintf(out, size, "%s/%s", dir, name);
+    }
+}
+
+static int file_list_add(file_list_t *list, const char *path) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        char **paths = realloc(list->paths, capacity * sizeof(char*));
+        if (!paths) { return -1; }
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    list->paths[list->count] = copy_string(path);
+    if (!list->paths[list->count]) { return -1; }
+    ++list->count;
+    return 0;
+}
+
+static void file_list_free(file_list_t *list) {
+    size_t i;
+    for (i = 0; i < list->count; ++i) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    list->paths = NULL;
+    list->count = list->capacity = 0;
+}
+
+/* Collects relative paths of all files under `dir`, in the same order make_dir_diff visits them */
+static int collect_files(const char *relpath, const char *dir, file_list_t *list) {
+    int ret = 0;
+    struct vfs_dir_handle *handle = vfs.opendir(dir, false);
+    if (!handle) {
+        return 0;
+    }
+    while (ret == 0 && vfs.readdir(handle)) {
+        char path[1024], dir_path[1024];
+        const char *dir_name = vfs.dirent_get_name(handle);
+        if (dir_name[0] == '.') {
+            continue;
+        }
+        join_path(path, 1024, relpath, dir_name);
+        join_path(dir_path, 1024, dir, dir_name);
+        if (vfs.dirent_is_dir(handle)) {
+            ret = collect_files(path, dir_path, list);
+        } else {
+            ret = file_list_add(list, path);
+        }
+    }
+    vfs.closedir(handle);
+    return ret;
+}
+
+/* Content-defined chunks of every old file, for data that moves between files. Added files that reuse enough of them
+ * are written as DIFF_TYPE_ADD_CHUNKS: records copying ranges of old files plus literal data.
+ * spatcher patches in place, so an old file is retired from the index once its own entry is written */
+#define CHUNK_MAX_SOURCES 1024
+/* Added files reusing less than this many average chunks are added as they are */
+#define CHUNK_MIN_REUSE 4
+
+typedef struct chunk_ref_s {
+    uint64_t hash;
+    uint32_t file, offset, size;
+} chunk_ref_t;
+
+static struct {
+    uint32_t avg_size;
+    cdc_params_t params;
+    /* old files sorted by path, chunk_ref_t.file indexes them */
+    file_list_t files;
+    uint8_t *retired;
+    chunk_ref_t *refs;
+    size_t count, capacity;
+    char root[512];
+    struct vfs_file_handle *open_file;
+    uint32_t open_id;
+    uint32_t entries;
+    uint64_t referenced;
+} chunk_index = { 0 };
+
+static int chunk_ref_compare(const void *a, const void *b) {
+    const chunk_ref_t *ca = a, *cb = b;
+    if (ca->hash != cb->hash) return ca->hash < cb->hash ? -1 : 1;
+    if (ca->file != cb->file) return ca->file < cb->file ? -1 : 1;
+    return ca->offset < cb->offset ? -1 : ca->offset > cb->offset;
+}
+
+static int chunk_index_build(const char *source_dir) {
+    uint64_t start = util_time_usec();
+    size_t i;
+    snprintf(chunk_index.root, sizeof(chunk_index.root), "%s", source_dir);
+    cdc_init(&chunk_index.params, chunk_index.avg_size);
+    if (collect_files("", source_dir, &chunk_index.files) != 0) {
+        return -1;
+    }
+    qsort(chunk_index.files.paths, chunk_index.files.count, sizeof(char*), dir_path_compare);
+    chunk_index.retired = calloc(chunk_index.files.count + 1, 1);
+    if (!chunk_index.retired) {
+        return -1;
+    }
+    for (i = 0; i < chunk_index.files.count; ++i) {
+        char path[1024];
+        struct vfs_file_handle *f;
+        int64_t size, offset;
+        uint8_t *data;
+        join_path(path, 1024, source_dir, chunk_index.files.paths[i]);
+        f = vfs.open(path, VFS_FILE_ACCESS_READ, 0);
+        if (!f) {
+            continue;
+        }
+        size = vfs.size(f);
+        data = size > 0 && size <= 0xFFFFFFFFLL ? malloc(size) : NULL;
+        if (!data || vfs.read(f, data, size) != size) {
+            free(data);
+            vfs.close(f);
+            continue;
+        }
+        vfs.close(f);
+        for (offset = 0; offset < size;) {
+            size_t n = cdc_cut(&chunk_index.params, data + offset, size - offset);
+            if (chunk_index.count == chunk_index.capacity) {
+                size_t capacity = chunk_index.capacity ? chunk_index.capacity * 2 : 4096;
+                chunk_ref_t *refs = realloc(chunk_index.refs, capacity * sizeof(chunk_ref_t));
+                if (!refs) {
+                    free(data);
+                    return -1;
+                }
+                chunk_index.refs = refs;
+                chunk_index.capacity = capacity;
+            }
+            /* the tail of a file is shorter than a chunk and rarely reappears elsewhere */
+            if (n >= chunk_index.params.min_size) {
+                chunk_ref_t *ref = &chunk_index.refs[chunk_index.count++];
+                ref->hash = util_hash64(0, data + offset, n);
+                ref->file = i;
+                ref->offset = offset;
+                ref->size = n;
+            }
+            offset += n;
+        }
+        free(data);
+    }
+    qsort(chunk_index.refs, chunk_index.count, sizeof(chunk_ref_t), chunk_ref_compare);
+    fprintf(stdout, "Chunk index: %'lu old file(s), %'lu chunk(s), %'llu ms\n", chunk_index.files.count,
+            chunk_index.count, (unsigned long long)(util_time_usec() - start) / 1000);
+    return 0;
+}
+
+static void chunk_index_free() {
+    if (chunk_index.open_file) vfs.close(chunk_index.open_file);
+    file_list_free(&chunk_index.files);
+    free(chunk_index.retired);
+    free(chunk_index.refs);
+    chunk_index.open_file = NULL;
+    chunk_index.retired = NULL;
+    chunk_index.refs = NULL;
+    chunk_index.count = chunk_index.capacity = 0;
+}
+
+static void chunk_retire(const char *relpath) {
+    char **found;
+    if (!chunk_index.retired) {
+        return;
+    }
+    found = bsearch(&relpath, chunk_index.files.paths, chunk_index.files.count, sizeof(char*), dir_path_compare);
+    if (found) {
+        chunk_index.retired[found - chunk_index.files.paths] = 1;
+    }
+}
+
+static int chunk_read(uint32_t file, uint32_t offset, uint8_t *buf, uint32_t size) {
+    if (!chunk_index.open_file || chunk_index.open_id != file) {
+        char path[1024];
+        if (chunk_index.open_file) vfs.close(chunk_index.open_file);
+        join_path(path, 1024, chunk_index.root, chunk_index.files.paths[file]);
+        chunk_index.open_file = vfs.open(path, VFS_FILE_ACCESS_READ, 0);
+        chunk_index.open_id = file;
+        if (!chunk_index.open_file) {
+            return -1;
         }
     }
+    vfs.seek(chunk_index.open_file, offset, VFS_SEEK_POSITION_START);
+    return vfs.read(chunk_index.open_file, buf, size) == size ? 0 : -1;
+}
 
-end:
-    xd3_close_stream(&stream);
-    if (src) free(src);
-    if (inp) free(inp);
+/* A live chunk of an old file holding the same bytes as data, verified against the file */
+static const chunk_ref_t *chunk_find(const uint8_t *data, uint32_t size, uint8_t *buf) {
+    uint64_t hash = util_hash64(0, data, size);
+    size_t lo = 0, hi = chunk_index.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (chunk_index.refs[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < chunk_index.count && chunk_index.refs[lo].hash == hash; ++lo) {
+        const chunk_ref_t *ref = &chunk_index.refs[lo];
+        if (ref->size == size && !chunk_index.retired[ref->file]
+            && chunk_read(ref->file, ref->offset, buf, size) == 0 && !memcmp(buf, data, size)) {
+            return ref;
+        }
+    }
+    return NULL;
+}
 
-    if (ret != 0) { return ret; }
+/* How many bytes before data + size equal those of the old file before `offset`, at most max and one chunk */
+static uint32_t chunk_extend_backward(uint32_t file, uint32_t offset, const uint8_t *data, uint32_t size, uint32_t max, uint8_t *buf) {
+    uint32_t n = xd3_min(xd3_min(xd3_min(size, max), offset), chunk_index.params.max_size), i;
+    if (n == 0 || chunk_read(file, offset - n, buf, n) != 0) {
+        return 0;
+    }
+    for (i = 0; i < n && buf[n - 1 - i] == data[size - 1 - i]; ++i) {}
+    return i;
+}
 
-    {
-        uint16_t namelen = strlen(relpath);
-        vfs.write(output_file, &namelen, 2);
-        vfs.write(output_file, relpath, namelen);
+/* How many bytes of data equal those of the old file from `offset` on */
+static uint32_t chunk_extend_forward(uint32_t file, uint32_t offset, const uint8_t *data, uint32_t size, uint8_t *buf) {
+    uint32_t i;
+    while (size > 0 && chunk_read(file, offset, buf, size) != 0) {
+        size /= 2;
     }
-    fprintf(stdout, "  Patch data size:  %'lu\n", memstream_size(stm));
-    if (compress) {
-        seq_in_stream_t stm_in;
-        seq_out_file_t stm_out;
+    for (i = 0; i < size && buf[i] == data[i]; ++i) {}
+    return i;
+}
 
-        uint32_t size = memstream_size(stm);
-        uint8_t type = DIFF_TYPE_CHANGE_LZMA;
-        vfs.write(output_file, &type, 1);
+typedef struct chunk_record_s {
+    uint32_t literal_start, literal, copy, source, offset;
+} chunk_record_t;
 
-        stm_in.stream.Read = stream_read;
-        stm_in.stm = stm;
-        stm_out.stream.Write = stream_write;
-        stm_out.fout = output_file;
-        do_stream_compress(&stm_in.stream, size, &stm_out);
-    } else {
-        uint32_t size = memstream_size(stm);
+static void chunk_write_record(memstream_t *stm, const uint8_t *inp, const chunk_record_t *record) {
+    uint32_t header[4] = { record->literal, record->copy, record->source, record->offset };
+    memstream_write(stm, header, CDC_RECORD_SIZE);
+    memstream_write(stm, inp + record->literal_start, record->literal);
+}
 
-        uint8_t type = DIFF_TYPE_CHANGE;
-        vfs.write(output_file, &type, 1);
-        vfs.write(output_file, &size, sizeof(uint32_t));
-        while (1) {
-            uint8_t buf[256 * 1024];
-            size_t rd = memstream_read(stm, buf, 256 * 1024);
-            vfs.write(output_file, buf, rd);
-            if (rd < 256 * 1024) {
-                break;
+/* Encodes inp as records into stm and the old files they copy from into sources, returns the bytes copied */
+static uint64_t chunk_encode(const uint8_t *inp, uint32_t size, memstream_t *stm, uint32_t *sources, uint32_t *source_count) {
+    uint8_t *buf = malloc(chunk_index.params.max_size);
+    chunk_record_t record = {0};
+    uint32_t pos, literal_start = 0, file = 0;
+    uint64_t copied = 0;
+    *source_count = 0;
+    if (!buf) {
+        return 0;
+    }
+    for (pos = 0; pos < size;) {
+        uint32_t n = cdc_cut(&chunk_index.params, inp + pos, size - pos);
+        const chunk_ref_t *ref = n >= chunk_index.params.min_size ? chunk_find(inp + pos, n, buf) : NULL;
+        uint32_t source = 0;
+        if (ref) {
+            for (source = 0; source < *source_count && sources[source] != ref->file; ++source) {}
+            if (source == CHUNK_MAX_SOURCES) {
+                ref = NULL;
+            }
+        }
+        if (ref && record.copy > 0 && literal_start == pos && file == ref->file
+            && record.offset + record.copy == ref->offset) {
+            /* the next chunk of the same old file */
+            record.copy += n;
+            literal_start = pos + n;
+        } else if (ref) {
+            uint32_t back = chunk_extend_backward(ref->file, ref->offset, inp, pos, pos - literal_start, buf);
+            if (source == *source_count) {
+                sources[(*source_count)++] = ref->file;
             }
+            if (record.copy > 0) {
+                chunk_write_record(stm, inp, &record);
+                copied += record.copy;
+            }
+            record.literal_start = literal_start;
+            record.literal = pos - back - literal_start;
+            record.copy = back + n;
+            record.source = source;
+            record.offset = ref->offset - back;
+            file = ref->file;
+            literal_start = pos + n;
+        } else if (record.copy > 0 && literal_start == pos) {
+            /* the copied range may go on past the last chunk boundary it shares with the old file */
+            uint32_t fwd = chunk_extend_forward(file, record.offset + record.copy, inp + pos, n, buf);
+            record.copy += fwd;
+            literal_start = pos + fwd;
         }
+        pos += n;
     }
-    memstream_destroy(stm);
-
-    return 0;
+    if (record.copy > 0) {
+        chunk_write_record(stm, inp, &record);
+        copied += record.copy;
+    }
+    if (literal_start < size) {
+        chunk_record_t tail = { literal_start, size - literal_start, 0, 0, 0 };
+        chunk_write_record(stm, inp, &tail);
+    }
+    free(buf);
+    return copied;
 }
 
-int make_add_file(const char *relpath,
-                  struct vfs_file_handle *input_file,
-                  struct vfs_file_handle *output_file,
-                  int compress) {
+/* Writes an added file as DIFF_TYPE_ADD_CHUNKS when it reuses enough of the old files, returns 1 if it does not */
+static int make_chunk_add(const char *relpath, struct vfs_file_handle *input_file, struct vfs_file_handle *output_file,
+                          int compress) {
+    uint32_t sources[CHUNK_MAX_SOURCES], source_count, i;
+    int64_t size = vfs.size(input_file);
+    uint64_t copied;
+    uint8_t *inp;
+    memstream_t *stm;
+    uint8_t type = compress ? DIFF_TYPE_ADD_CHUNKS_LZMA : DIFF_TYPE_ADD_CHUNKS;
+
+    if (!chunk_index.refs || size < (int64_t)chunk_index.params.avg_size * CHUNK_MIN_REUSE || size > 0xFFFFFFFFLL) {
+        return 1;
+    }
+    inp = malloc(size);
+    if (!inp) {
+        return 1;
+    }
+    vfs.seek(input_file, 0, VFS_SEEK_POSITION_START);
+    if (vfs.read(input_file, inp, size) != size) {
+        free(inp);
+        return 1;
+    }
+    stm = memstream_create();
+    copied = chunk_encode(inp, size, stm, sources, &source_count);
+    free(inp);
+    vfs.seek(input_file, 0, VFS_SEEK_POSITION_START);
+    if (copied < (uint64_t)chunk_index.params.avg_size * CHUNK_MIN_REUSE) {
+        memstream_destroy(stm);
+        return 1;
+    }
+
     fprintf(stdout, "  Add file path:    %s\n", vfs.get_path(input_file));
-    {
-        uint16_t namelen = strlen(relpath);
-        vfs.write(output_file, &namelen, 2);
-        vfs.write(output_file, relpath, namelen);
+    fprintf(stdout, "  Chunk references: %'llu of %'lld bytes from %u old file(s)\n", (unsigned long long)copied,
+            (long long)size, source_count);
+    ++chunk_index.entries;
+    chunk_index.referenced += copied;
+    write_entry_name(output_file, relpath);
+    vfs.write(output_file, &type, 1);
+    vfs.write(output_file, &source_count, sizeof(uint32_t));
+    for (i = 0; i < source_count; ++i) {
+        const char *name = chunk_index.files.paths[sources[i]];
+        uint16_t len = strlen(name);
+        vfs.write(output_file, &len, 2);
+        vfs.write(output_file, name, len);
     }
     if (compress) {
-        seq_in_file_t stm_in;
+        seq_in_stream_t stm_in;
         seq_out_file_t stm_out;
-
-        uint32_t size = vfs.size(input_file);
-        uint8_t type = DIFF_TYPE_ADD_OR_REPLACE_LZMA;
-        vfs.write(output_file, &type, 1);
-
-        stm_in.stream.Read = file_read;
-        stm_in.fin = input_file;
+        const compress_profile_t *profile = select_profile(relpath, size);
+        /* the records are always LZMA coded, a profile with another codec falls back to the default one */
+        if (profile->codec != CODEC_LZMA || profile->primed) {
+            profile = select_profile(NULL, size);
+        }
+        stm_in.stream.Read = stream_read;
+        stm_in.stm = stm;
         stm_out.stream.Write = stream_write;
         stm_out.fout = output_file;
-        do_stream_compress(&stm_in.stream, size, &stm_out);
+        do_stream_compress(&stm_in.stream, memstream_size(stm), &stm_out, profile, NULL, 0);
     } else {
-        uint32_t size = vfs.size(input_file);
-
-        uint8_t type = DIFF_TYPE_ADD_OR_REPLACE;
-        vfs.write(output_file, &type, 1);
-        vfs.write(output_file, &size, sizeof(uint32_t));
+        uint32_t payload_size = memstream_size(stm);
+        vfs.write(output_file, &payload_size, sizeof(uint32_t));
+        write_payload_padding(output_file);
         while (1) {
             uint8_t buf[256 * 1024];
-            int64_t rd = vfs.read(input_file, buf, 256 * 1024);
-            if (rd > 0) {
-                vfs.write(output_file, buf, rd);
-            }
+            size_t rd = memstream_read(stm, buf, 256 * 1024);
+            vfs.write(output_file, buf, rd);
             if (rd < 256 * 1024) {
                 break;
             }
         }
     }
+    memstream_destroy(stm);
     return 0;
 }
 
@@ -344,10 +1901,16 @@ int make_dir_diff(const char *relpath, const char *source_dir, const char *input
             }
             fsrc = vfs.open(source_path, VFS_FILE_ACCESS_READ, 0);
             if (fsrc) {
+                chunk_retire(path);
                 ret = make_diff(path, fsrc, finp, output_file, compress);
                 vfs.close(fsrc);
             } else {
-                ret = make_add_file(path, finp, output_file, compress);
+                ret = make_chunk_add(path, finp, output_file, compress);
+                if (ret > 0 && compress && solid_accepts(path, vfs.size(finp))) {
+                    ret = solid_queue_file(path, input_path, vfs.size(finp));
+                } else if (ret > 0) {
+                    ret = make_add_file(path, finp, output_file, compress);
+                }
             }
             vfs.close(finp);
             if (ret != 0) {
@@ -407,30 +1970,513 @@ int make_dir_deletes(const char *relpath, const char *source_dir, const char *in
             }
             fprintf(stdout, "  Delete file:  %s\n", path);
             {
-                uint16_t namelen = strlen(path);
                 uint8_t type = DIFF_TYPE_DELETE;
-                vfs.write(output_file, &namelen, 2);
-                vfs.write(output_file, path, namelen);
+                write_entry_name(output_file, path);
+                vfs.write(output_file, &type, 1);
+            }
+        }
+    }
+    return 0;
+}
+
+static int collect_dirs(const char *relpath, const char *dir, file_list_t *list) {
+    int ret = 0;
+    struct vfs_dir_handle *handle = vfs.opendir(dir, false);
+    if (!handle) {
+        return 0;
+    }
+    while (ret == 0 && vfs.readdir(handle)) {
+        char path[1024], dir_path[1024];
+        const char *dir_name = vfs.dirent_get_name(handle);
+        if (dir_name[0] == '.' || !vfs.dirent_is_dir(handle)) {
+            continue;
+        }
+        join_path(path, 1024, relpath, dir_name);
+        join_path(dir_path, 1024, dir, dir_name);
+        ret = file_list_add(list, path);
+        if (ret == 0) {
+            ret = collect_dirs(path, dir_path, list);
+        }
+    }
+    vfs.closedir(handle);
+    return ret;
+}
+
+/* Writes the DIR_TABLE entry covering every directory of the input and source trees.
+ * Payload: uint32_t count, count * (uint32_t parent id, uint16_t len, last path component),
+ * parents always come before their children, so only the last component has to be stored */
+static int write_name_table(struct vfs_file_handle *output_file, const char *input_dir,
+                            char source_paths[][512], int nsources) {
+    file_list_t dirs = {0};
+    size_t i, count = 0;
+    int j, ret;
+    uint8_t type = DIFF_TYPE_DIR_TABLE;
+    uint32_t size = sizeof(uint32_t), dir_count;
+    ret = collect_dirs("", input_dir, &dirs);
+    for (j = 0; j < nsources && ret == 0; ++j) {
+        if (strcmp(source_paths[j], "-") != 0) {
+            ret = collect_dirs("", source_paths[j], &dirs);
+        }
+    }
+    if (ret != 0) {
+        file_list_free(&dirs);
+        return ret;
+    }
+    qsort(dirs.paths, dirs.count, sizeof(char*), dir_path_compare);
+    for (i = 0; i < dirs.count; ++i) {
+        if (count > 0 && !strcmp(dirs.paths[count - 1], dirs.paths[i])) {
+            free(dirs.paths[i]);
+            continue;
+        }
+        dirs.paths[count++] = dirs.paths[i];
+    }
+    name_table.dirs = dirs.paths;
+    name_table.count = count;
+    for (i = 0; i < count; ++i) {
+        const char *slash = strrchr(name_table.dirs[i], '/');
+        size += sizeof(uint32_t) + 2 + strlen(slash ? slash + 1 : name_table.dirs[i]);
+    }
+    write_raw_name(output_file, "");
+    vfs.write(output_file, &type, 1);
+    vfs.write(output_file, &size, sizeof(uint32_t));
+    dir_count = count;
+    vfs.write(output_file, &dir_count, sizeof(uint32_t));
+    for (i = 0; i < count; ++i) {
+        const char *slash = strrchr(name_table.dirs[i], '/');
+        const char *component = slash ? slash + 1 : name_table.dirs[i];
+        uint16_t len = strlen(component);
+        uint32_t parent = 0;
+        if (slash) {
+            char parent_dir[1024];
+            memcpy(parent_dir, name_table.dirs[i], slash - name_table.dirs[i]);
+            parent_dir[slash - name_table.dirs[i]] = 0;
+            parent = name_table_lookup(parent_dir);
+        }
+        vfs.write(output_file, &parent, sizeof(uint32_t));
+        vfs.write(output_file, &len, 2);
+        vfs.write(output_file, component, len);
+    }
+    name_table.enabled = 1;
+    fprintf(stdout, "Name table: %'lu directories\n", count);
+    return 0;
+}
+
+typedef struct base_file_s {
+    uint64_t size;
+    uint64_t hash;
+    int64_t blob_offset;
+} base_file_t;
+
+static int base_files_differ(const base_file_t *a, const base_file_t *b) {
+    return a->size != b->size || a->hash != b->hash;
+}
+
+/* Picks probe files until every pair of bases differs in at least one of them, each time taking the file that
+ * separates the most pairs still alike. spatcher applies the first section whose probes all match, so a pair left
+ * alike would patch one base with the other's section. Returns the probe count, or -1 if that needs more than
+ * SPATCH_MAX_PROBES files or two bases have identical files */
+static int choose_probes(const file_list_t *files, const base_file_t *fps, char source_paths[][512], int nbases,
+                         size_t *probes) {
+    uint8_t alike[SPATCH_MAX_BASES][SPATCH_MAX_BASES] = {{0}};
+    int left = 0, count = 0;
+    int j, k;
+    size_t i;
+    for (j = 0; j < nbases; ++j) {
+        for (k = j + 1; k < nbases; ++k) {
+            alike[j][k] = 1;
+            ++left;
+        }
+    }
+    while (left > 0) {
+        size_t best = 0;
+        int best_pairs = 0;
+        for (i = 0; i < files->count; ++i) {
+            const base_file_t *fp = &fps[i * nbases];
+            int pairs = 0;
+            for (j = 0; j < nbases; ++j) {
+                for (k = j + 1; k < nbases; ++k) {
+                    if (alike[j][k] && base_files_differ(&fp[j], &fp[k])) ++pairs;
+                }
+            }
+            if (pairs > best_pairs) {
+                best = i;
+                best_pairs = pairs;
+            }
+        }
+        if (best_pairs == 0 || count == SPATCH_MAX_PROBES) {
+            for (j = 0; j < nbases; ++j) {
+                for (k = j + 1; k < nbases; ++k) {
+                    if (alike[j][k]) break;
+                }
+                if (k < nbases) break;
+            }
+            if (best_pairs == 0) {
+                fprintf(stderr, "Bases %s and %s have identical files, a patch cannot tell them apart!\n",
+                        source_paths[j], source_paths[k]);
+            } else {
+                fprintf(stderr, "Bases %s and %s are not told apart by %d probe files!\n",
+                        source_paths[j], source_paths[k], SPATCH_MAX_PROBES);
+            }
+            return -1;
+        }
+        probes[count++] = best;
+        for (j = 0; j < nbases; ++j) {
+            for (k = j + 1; k < nbases; ++k) {
+                if (alike[j][k] && base_files_differ(&fps[best * nbases + j], &fps[best * nbases + k])) {
+                    alike[j][k] = 0;
+                    --left;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+/* Probe record layout: uint16_t namelen, name, uint64_t size (PROBE_ABSENT if the file must not exist), uint64_t util_hash64 of the content
+ * Returns offset of the section size field, which is filled after the section is written */
+static int64_t write_base_header(struct vfs_file_handle *output_file, const char *label,
+                              const file_list_t *files, const base_file_t *fps, int nbases, int base,
+                              const size_t *probes, int nprobes) {
+    int i;
+    uint16_t probe_count = 0;
+    int64_t payload_offset, section_size = 0;
+    uint32_t size = 0;
+    uint8_t type = DIFF_TYPE_BASE;
+    write_raw_name(output_file, label);
+    vfs.write(output_file, &type, 1);
+    payload_offset = vfs.tell(output_file);
+    vfs.write(output_file, &size, sizeof(uint32_t));
+    vfs.write(output_file, &section_size, sizeof(int64_t));
+    vfs.write(output_file, &probe_count, sizeof(uint16_t));
+    for (i = 0; i < nprobes; ++i) {
+        const base_file_t *fp = &fps[probes[i] * nbases + base];
+        write_raw_name(output_file, files->paths[probes[i]]);
+        vfs.write(output_file, &fp->size, sizeof(uint64_t));
+        vfs.write(output_file, &fp->hash, sizeof(uint64_t));
+        ++probe_count;
+    }
+    {
+        int64_t end_offset = vfs.tell(output_file);
+        size = end_offset - payload_offset - sizeof(uint32_t);
+        vfs.seek(output_file, payload_offset, VFS_SEEK_POSITION_START);
+        vfs.write(output_file, &size, sizeof(uint32_t));
+        vfs.seek(output_file, sizeof(int64_t), VFS_SEEK_POSITION_CURRENT);
+        vfs.write(output_file, &probe_count, sizeof(uint16_t));
+        vfs.seek(output_file, end_offset, VFS_SEEK_POSITION_START);
+    }
+    fprintf(stdout, "Base %s: %u probe(s)\n", label, probe_count);
+    return payload_offset + sizeof(uint32_t);
+}
+
+/* One patch for several bases:
+ *   1. BLOB entries hold adds needed by some but not all bases, they are skipped on sequential apply;
+ *   2. each base gets a BASE entry (fingerprint probes + section size) followed by its own diffs,
+ *      ADD_REF entries pointing to the shared blobs, and deletes;
+ *   3. adds needed by every base are stored once after all sections and applied unconditionally. */
+int make_multi_base_diff(char source_paths[][512], int nbases, const char *input_dir,
+                         struct vfs_file_handle *output_file, int compress) {
+    int ret = 0;
+    int j, nprobes;
+    size_t i, ninput;
+    file_list_t files = {0}, removed = {0}, sorted = {0};
+    base_file_t *fps = NULL;
+    size_t probes[SPATCH_MAX_PROBES];
+    ret = collect_files("", input_dir, &files);
+    ninput = files.count;
+    /* files only some bases have are appended after the input files, they can serve as probes too */
+    for (j = 0; j < nbases && ret == 0; ++j) {
+        ret = collect_files("", source_paths[j], &removed);
+    }
+    if (ret == 0 && ninput > 0) {
+        sorted.paths = malloc(ninput * sizeof(char*));
+        if (!sorted.paths) ret = -1;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Out of memory!\n");
+        goto end;
+    }
+    if (ninput > 0) {
+        memcpy(sorted.paths, files.paths, ninput * sizeof(char*));
+        qsort(sorted.paths, ninput, sizeof(char*), dir_path_compare);
+    }
+    qsort(removed.paths, removed.count, sizeof(char*), dir_path_compare);
+    for (i = 0; i < removed.count && ret == 0; ++i) {
+        if ((i > 0 && !strcmp(removed.paths[i - 1], removed.paths[i]))
+            || (ninput > 0 && bsearch(&removed.paths[i], sorted.paths, ninput, sizeof(char*), dir_path_compare))) {
+            continue;
+        }
+        ret = file_list_add(&files, removed.paths[i]);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Out of memory!\n");
+        goto end;
+    }
+    fps = calloc(files.count * nbases + 1, sizeof(base_file_t));
+    if (!fps) {
+        ret = -1;
+        fprintf(stderr, "Out of memory!\n");
+        goto end;
+    }
+    for (i = 0; i < files.count; ++i) {
+        for (j = 0; j < nbases; ++j) {
+            char path[1024];
+            base_file_t *fp = &fps[i * nbases + j];
+            join_path(path, 1024, source_paths[j], files.paths[i]);
+            fp->blob_offset = -1;
+            if (util_file_fingerprint(path, &fp->size, &fp->hash) != 0) {
+                fp->size = PROBE_ABSENT;
+                fp->hash = 0;
+            }
+        }
+    }
+
+    nprobes = choose_probes(&files, fps, source_paths, nbases, probes);
+    if (nprobes < 0) {
+        ret = -1;
+        goto end;
+    }
+
+    for (i = 0; i < ninput; ++i) {
+        int missing = 0;
+        for (j = 0; j < nbases; ++j) {
+            if (fps[i * nbases + j].size == PROBE_ABSENT) ++missing;
+        }
+        if (missing > 0 && missing < nbases) {
+            char input_path[1024];
+            struct vfs_file_handle *finp;
+            uint8_t type = DIFF_TYPE_BLOB;
+            uint32_t size = 0;
+            int64_t size_offset, blob_offset, end_offset;
+            join_path(input_path, 1024, input_dir, files.paths[i]);
+            finp = vfs.open(input_path, VFS_FILE_ACCESS_READ, 0);
+            if (!finp) {
+                ret = -1;
+                goto end;
+            }
+            fprintf(stdout, "  Shared add:       %s\n", input_path);
+            write_entry_name(output_file, files.paths[i]);
+            vfs.write(output_file, &type, 1);
+            size_offset = vfs.tell(output_file);
+            vfs.write(output_file, &size, sizeof(uint32_t));
+            blob_offset = vfs.tell(output_file);
+            ret = write_add_payload(files.paths[i], finp, output_file, compress);
+            vfs.close(finp);
+            if (ret != 0) {
+                goto end;
+            }
+            end_offset = vfs.tell(output_file);
+            size = end_offset - blob_offset;
+            vfs.seek(output_file, size_offset, VFS_SEEK_POSITION_START);
+            vfs.write(output_file, &size, sizeof(uint32_t));
+            vfs.seek(output_file, end_offset, VFS_SEEK_POSITION_START);
+            for (j = 0; j < nbases; ++j) {
+                fps[i * nbases + j].blob_offset = blob_offset;
+            }
+        }
+    }
+
+    for (j = 0; j < nbases; ++j) {
+        int64_t section_offset, section_start, section_end, section_size;
+        section_offset = write_base_header(output_file, source_paths[j], &files, fps, nbases, j, probes, nprobes);
+        section_start = vfs.tell(output_file);
+        for (i = 0; i < ninput; ++i) {
+            const base_file_t *fp = &fps[i * nbases + j];
+            char source_path[1024], input_path[1024];
+            struct vfs_file_handle *finp;
+            if (fp->size == PROBE_ABSENT && fp->blob_offset < 0) {
+                continue;
+            }
+            join_path(input_path, 1024, input_dir, files.paths[i]);
+            if (fp->size == PROBE_ABSENT) {
+                uint8_t type = DIFF_TYPE_ADD_REF;
+                uint32_t size = sizeof(int64_t);
+                fprintf(stdout, "  Add file path:    %s (shared)\n", input_path);
+                write_entry_name(output_file, files.paths[i]);
                 vfs.write(output_file, &type, 1);
+                vfs.write(output_file, &size, sizeof(uint32_t));
+                vfs.write(output_file, &fp->blob_offset, sizeof(int64_t));
+                continue;
+            }
+            join_path(source_path, 1024, source_paths[j], files.paths[i]);
+            finp = vfs.open(input_path, VFS_FILE_ACCESS_READ, 0);
+            if (!finp) {
+                ret = -1;
+                goto end;
+            }
+            {
+                struct vfs_file_handle *fsrc = vfs.open(source_path, VFS_FILE_ACCESS_READ, 0);
+                if (fsrc) {
+                    ret = make_diff(files.paths[i], fsrc, finp, output_file, compress);
+                    vfs.close(fsrc);
+                } else {
+                    ret = make_add_file(files.paths[i], finp, output_file, compress);
+                }
+            }
+            vfs.close(finp);
+            if (ret != 0) {
+                goto end;
+            }
+        }
+        ret = make_dir_deletes("", source_paths[j], input_dir, output_file);
+        if (ret != 0) {
+            goto end;
+        }
+        section_end = vfs.tell(output_file);
+        section_size = section_end - section_start;
+        vfs.seek(output_file, section_offset, VFS_SEEK_POSITION_START);
+        vfs.write(output_file, &section_size, sizeof(int64_t));
+        vfs.seek(output_file, section_end, VFS_SEEK_POSITION_START);
+    }
+
+    for (i = 0; i < ninput; ++i) {
+        int missing = 0;
+        for (j = 0; j < nbases; ++j) {
+            if (fps[i * nbases + j].size == PROBE_ABSENT) ++missing;
+        }
+        if (missing == nbases) {
+            char input_path[1024];
+            struct vfs_file_handle *finp;
+            join_path(input_path, 1024, input_dir, files.paths[i]);
+            finp = vfs.open(input_path, VFS_FILE_ACCESS_READ, 0);
+            if (!finp) {
+                ret = -1;
+                goto end;
+            }
+            if (compress && solid_accepts(files.paths[i], vfs.size(finp))) {
+                ret = solid_queue_file(files.paths[i], input_path, vfs.size(finp));
+            } else {
+                ret = make_add_file(files.paths[i], finp, output_file, compress);
+            }
+            vfs.close(finp);
+            if (ret != 0) {
+                goto end;
             }
         }
     }
+    ret = solid_flush(output_file);
+
+end:
+    free(fps);
+    free(sorted.paths);
+    file_list_free(&removed);
+    file_list_free(&files);
+    return ret;
 }
 
 struct config {
-    char source_path[512];
+    char source_path[SPATCH_MAX_BASES][512];
+    int source_count;
     char input_path[512];
     char output_path[512];
     char icon_file[512];
     int compress;
+    int name_table;
 };
 
+/* Parses a byte count with optional K/M/G suffix */
+static uint64_t parse_size(const char *value) {
+    char *end;
+    uint64_t size = strtoull(value, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': size <<= 10; break;
+    case 'm': case 'M': size <<= 20; break;
+    case 'g': case 'G': size <<= 30; break;
+    default: break;
+    }
+    return size;
+}
+
+/* Parses space separated rule conditions: a glob and/or size bounds like <64K, >=1G */
+static int parse_rule(const char *profile_name, const char *value) {
+    compress_rule_t *rule;
+    char buf[256], *token;
+    int profile = find_profile(profile_name, 0);
+    if (profile < 0) {
+        fprintf(stderr, "Unknown compression profile in rules: %s\n", profile_name);
+        return 0;
+    }
+    if (profiles.rule_count >= SPATCH_MAX_RULES) {
+        return 0;
+    }
+    rule = &profiles.rules[profiles.rule_count];
+    rule->glob[0] = 0;
+    rule->min_size = 0;
+    rule->max_size = UINT64_MAX;
+    rule->profile = profile;
+    snprintf(buf, sizeof(buf), "%s", value);
+    for (token = strtok(buf, " \t"); token; token = strtok(NULL, " \t")) {
+        if (token[0] == '<' && token[1] == '=') {
+            rule->max_size = parse_size(token + 2);
+        } else if (token[0] == '<') {
+            rule->max_size = parse_size(token + 1) - 1;
+        } else if (token[0] == '>' && token[1] == '=') {
+            rule->min_size = parse_size(token + 2);
+        } else if (token[0] == '>') {
+            rule->min_size = parse_size(token + 1) + 1;
+        } else {
+            snprintf(rule->glob, sizeof(rule->glob), "%s", token);
+        }
+    }
+    ++profiles.rule_count;
+    return 1;
+}
+
+static int parse_profile_key(compress_profile_t *profile, const char *name, const char *value) {
+    if (!strcmp(name, "codec")) {
+        profile->codec = strcmp(value, "fast") ? CODEC_LZMA : CODEC_FAST;
+    } else if (!strcmp(name, "level")) {
+        profile->level = atoi(value);
+    } else if (!strcmp(name, "dict_size")) {
+        profile->dict_size = parse_size(value);
+    } else if (!strcmp(name, "fb")) {
+        profile->fb = atoi(value);
+    } else if (!strcmp(name, "mc")) {
+        profile->mc = atoi(value);
+    } else if (!strcmp(name, "bt_mode")) {
+        profile->bt_mode = atoi(value);
+    } else if (!strcmp(name, "hash_bytes")) {
+        profile->hash_bytes = atoi(value);
+    } else if (!strcmp(name, "lc")) {
+        profile->lc = atoi(value);
+        profile->literals_set = 1;
+    } else if (!strcmp(name, "lp")) {
+        profile->lp = atoi(value);
+        profile->literals_set = 1;
+    } else if (!strcmp(name, "pb")) {
+        profile->pb = atoi(value);
+        profile->literals_set = 1;
+    } else if (!strcmp(name, "primed")) {
+        profile->primed = atoi(value);
+    } else if (!strcmp(name, "filter")) {
+        profile->filter = !strcmp(value, "x86") ? BCJ_X86 :
+                          !strcmp(value, "arm64") ? BCJ_ARM64 :
+                          !strcmp(value, "auto") ? -1 : BCJ_NONE;
+    } else if (!strcmp(name, "engine")) {
+        profile->engine = strcmp(value, "sa") ? ENGINE_XDELTA : ENGINE_SA;
+    } else if (!strcmp(name, "secondary")) {
+        profile->secondary = (profile->secondary & XD3_SEC_NOALL) |
+                             (!strcmp(value, "lzma") ? XD3_SEC_LZMA :
+                              !strcmp(value, "djw") ? XD3_SEC_DJW :
+                              !strcmp(value, "fgk") ? XD3_SEC_FGK : 0);
+    } else if (!strcmp(name, "secondary_sections")) {
+        profile->secondary = (profile->secondary & XD3_SEC_TYPE) | XD3_SEC_NOALL;
+        if (strstr(value, "data")) profile->secondary &= ~XD3_SEC_NODATA;
+        if (strstr(value, "inst")) profile->secondary &= ~XD3_SEC_NOINST;
+        if (strstr(value, "addr")) profile->secondary &= ~XD3_SEC_NOADDR;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
 int sdiffer_ini_handler(void* user, const char* section,
                     const char* name, const char* value) {
     struct config *config = user;
     if (!strcmp(section, "compare")) {
         if (!strcmp(name, "from")) {
-            snprintf(config->source_path, 512, "%s", value);
+            if (config->source_count < SPATCH_MAX_BASES) {
+                snprintf(config->source_path[config->source_count++], 512, "%s", value);
+            }
         } else if (!strcmp(name, "to")) {
             snprintf(config->input_path, 512, "%s", value);
         }
@@ -443,7 +2489,50 @@ int sdiffer_ini_handler(void* user, const char* section,
 #endif
         } else if (!strcmp(name, "compress")) {
             config->compress = strcmp(value, "0") != 0 && strcmp(value, "false") != 0;
+        } else if (!strcmp(name, "name_table")) {
+            config->name_table = strcmp(value, "0") != 0 && strcmp(value, "false") != 0;
+        } else if (!strcmp(name, "align")) {
+            payload_align = parse_size(value);
+        } else if (!strcmp(name, "solid")) {
+            solid.enabled = strcmp(value, "0") != 0 && strcmp(value, "false") != 0;
+        } else if (!strcmp(name, "solid_sort")) {
+            solid.sort_by_ext = strcmp(value, "0") != 0 && strcmp(value, "false") != 0;
+        } else if (!strcmp(name, "solid_file_size")) {
+            solid.max_file_size = parse_size(value);
+        } else if (!strcmp(name, "solid_block_size")) {
+            solid.block_size = parse_size(value);
+        } else if (!strcmp(name, "min_gain")) {
+            sampling.min_gain = atoi(value);
+        } else if (!strcmp(name, "autotune")) {
+            autotune.enabled = strcmp(value, "0") != 0 && strcmp(value, "false") != 0;
+        } else if (!strcmp(name, "autotune_cache")) {
+            snprintf(autotune.cache_path, sizeof(autotune.cache_path), "%s", value);
+        } else if (!strcmp(name, "autotune_budget")) {
+            autotune.budget_ms = atoi(value);
+        } else if (!strcmp(name, "encode_threads")) {
+            encode_threads = atoi(value);
+            if (encode_threads < 1) encode_threads = 1;
+            if (encode_threads > SPATCH_MAX_ENCODE_THREADS) encode_threads = SPATCH_MAX_ENCODE_THREADS;
+        } else if (!strcmp(name, "chunk_dedup")) {
+            chunk_index.avg_size = parse_size(value);
+        } else if (!strcmp(name, "window_checksum")) {
+            window_checksum = strcmp(value, "0") != 0 && strcmp(value, "false") != 0;
+        } else if (!strcmp(name, "huge_pages")) {
+            xd3_arenas.huge_pages = strcmp(value, "0") != 0 && strcmp(value, "false") != 0;
+        } else if (!strcmp(name, "index_cache")) {
+            snprintf(index_cache.dir, sizeof(index_cache.dir), "%s", value);
+        } else if (!strcmp(name, "index_threads")) {
+            index_threads = atoi(value);
+            if (index_threads < 1) index_threads = 1;
+            if (index_threads > 64) index_threads = 64;
+        }
+    } else if (!strncmp(section, "profile:", 8)) {
+        int profile = find_profile(section + 8, 1);
+        if (profile >= 0) {
+            parse_profile_key(&profiles.profiles[profile], name, value);
         }
+    } else if (!strcmp(section, "rules")) {
+        parse_rule(name, value);
     }
     return 1;
 }
@@ -573,7 +2662,22 @@ int main(int argc, char *argv[]) {
     int64_t org_tail_offset = 0;
     struct config config = {{0}};
     setlocale(LC_NUMERIC, "");
+    /* Picks the SSE4.1/AVX2/NEON match finder normalization for this CPU */
+    LzFindPrepare();
     ini_parse(argc > 1 ? argv[1] : "sdiffer.ini", sdiffer_ini_handler, &config);
+    if (autotune.enabled) {
+        ini_parse(autotune.cache_path, tune_cache_handler, NULL);
+    }
+    /* Parallel indexing only pays off with a second core, the serial path builds the same table */
+    if (index_threads > 1 && thread_cpu_count() < 2) {
+        fprintf(stdout, "Single CPU, indexing sources on one thread\n");
+        index_threads = 1;
+    }
+    lzma_arena = arena_create(ARENA_PERSISTENT | (xd3_arenas.huge_pages ? ARENA_HUGE_PAGES : 0));
+    if (!lzma_arena) {
+        fprintf(stderr, "Out of memory!\n");
+        goto end;
+    }
 #if defined(_WIN32)
     util_copy_file("spatcher_header_win32.exe", config.output_path);
     {
@@ -594,25 +2698,54 @@ int main(int argc, char *argv[]) {
     vfs.seek(output_file, 0, VFS_SEEK_POSITION_END);
 #endif
     org_tail_offset = vfs.tell(output_file);
-    if (!strcmp(config.source_path, "-") || vfs.stat(config.source_path, NULL) & VFS_STAT_IS_DIRECTORY) {
+    if (config.source_count > 1) {
+        int i;
+        for (i = 0; i < config.source_count; ++i) {
+            if (!(vfs.stat(config.source_path[i], NULL) & VFS_STAT_IS_DIRECTORY)) {
+                fprintf(stderr, "Multiple `from` paths must all be directories!\n");
+                goto end;
+            }
+        }
+        if (!(vfs.stat(config.input_path, NULL) & VFS_STAT_IS_DIRECTORY)) {
+            fprintf(stderr, "Path of `to` is not a directory!\n");
+            goto end;
+        }
+        if (config.name_table && write_name_table(output_file, config.input_path, config.source_path, config.source_count) != 0) {
+            goto end;
+        }
+        ret = make_multi_base_diff(config.source_path, config.source_count, config.input_path, output_file, config.compress);
+        goto end;
+    }
+    if (!strcmp(config.source_path[0], "-") || vfs.stat(config.source_path[0], NULL) & VFS_STAT_IS_DIRECTORY) {
         if (!(vfs.stat(config.input_path, NULL) & VFS_STAT_IS_DIRECTORY)) {
             fprintf(stderr, "Path of `to` is not a directory!\n");
             return -1;
         }
-        ret = make_dir_diff("", config.source_path, config.input_path, output_file, config.compress);
+        if (config.name_table && write_name_table(output_file, config.input_path, config.source_path, 1) != 0) {
+            goto end;
+        }
+        if (chunk_index.avg_size > 0 && chunk_index_build(config.source_path[0]) != 0) {
+            fprintf(stderr, "Out of memory!\n");
+            goto end;
+        }
+        ret = make_dir_diff("", config.source_path[0], config.input_path, output_file, config.compress);
+        chunk_index_free();
+        if (ret == 0) {
+            ret = solid_flush(output_file);
+        }
         if (ret == 0) {
-            ret = make_dir_deletes("", config.source_path, config.input_path, output_file);
+            ret = make_dir_deletes("", config.source_path[0], config.input_path, output_file);
         }
         goto end;
     }
-    source_file = !strcmp(config.source_path, "-") ? NULL : vfs.open(config.source_path, VFS_FILE_ACCESS_READ, 0);
+    source_file = !strcmp(config.source_path[0], "-") ? NULL : vfs.open(config.source_path[0], VFS_FILE_ACCESS_READ, 0);
     input_file = vfs.open(config.input_path, VFS_FILE_ACCESS_READ, 0);
     if (!input_file) {
         fprintf(stderr, "Unable to read from input file!\n");
         goto end;
     }
     if (source_file) {
-        ret = make_diff(config.source_path, source_file, input_file, output_file, config.compress);
+        ret = make_diff(config.source_path[0], source_file, input_file, output_file, config.compress);
     } else {
         ret = make_add_file(config.input_path, input_file, output_file, config.compress);
     }
@@ -621,7 +2754,7 @@ end:
     if (ret == 0) {
         uint64_t tag = 0xBADC0DEDEADBEEFULL;
         int64_t org_config_offset = vfs.tell(output_file);
-        patch_config_t patch_config = { SPATCH_FORMAT_VERSION };
+        patch_config_t patch_config = { SPATCH_FORMAT_VERSION, payload_align };
         vfs.write(output_file, &patch_config, sizeof(patch_config_t));
         vfs.write(output_file, &org_tail_offset, sizeof(int64_t));
         vfs.write(output_file, &org_config_offset, sizeof(int64_t));
@@ -630,6 +2763,53 @@ end:
     if (output_file) vfs.close(output_file);
     if (input_file) vfs.close(input_file);
     if (source_file) vfs.close(source_file);
+    if (pooled_enc) {
+        uint64_t requests, mallocs;
+        LzmaEnc_Destroy(pooled_enc, &my_alloc, &my_alloc);
+        arena_stats(lzma_arena, &requests, &mallocs);
+        fprintf(stdout, "LZMA allocations: %'llu (%'llu bytes), %'llu from the system\n", (unsigned long long)lzma_alloc_count,
+                (unsigned long long)lzma_alloc_bytes, (unsigned long long)mallocs);
+    }
+    arena_destroy(lzma_arena);
+    if (xd3_arenas.main) {
+        uint64_t requests = 0, mallocs = 0, job_requests, job_mallocs;
+        int i;
+        arena_stats(xd3_arenas.main, &requests, &mallocs);
+        arena_destroy(xd3_arenas.main);
+        for (i = 0; i < SPATCH_MAX_ENCODE_THREADS; ++i) {
+            arena_stats(xd3_arenas.jobs[i], &job_requests, &job_mallocs);
+            requests += job_requests;
+            mallocs += job_mallocs;
+            arena_destroy(xd3_arenas.jobs[i]);
+        }
+        fprintf(stdout, "xdelta allocations: %'llu, %'llu from the system\n", (unsigned long long)requests,
+                (unsigned long long)mallocs);
+    }
+    if (autotune.enabled) {
+        tune_cache_save();
+        fprintf(stdout, "Autotune: %d file class(es), %'llu ms in trials\n", autotune.count,
+                (unsigned long long)(autotune.usec / 1000));
+    }
+    if (chunk_index.entries > 0) {
+        fprintf(stdout, "Chunk references: %u added file(s), %'llu bytes copied from old files\n",
+                chunk_index.entries, (unsigned long long)chunk_index.referenced);
+    }
+    if (index_batches > 0) {
+        fprintf(stdout, "Parallel source indexing: %u batch(es) on %u threads\n", index_batches, index_threads);
+    }
+    if (encode_parallel_files > 0) {
+        fprintf(stdout, "Window-parallel encoding: %u file(s) on %u threads\n", encode_parallel_files, encode_threads);
+    }
+    if (index_cache.dir[0]) {
+        fprintf(stdout, "Source index cache: %u loaded, %u saved\n", index_cache.loaded, index_cache.saved);
+    }
+    if (sampling.stored > 0) {
+        /* time saved is estimated from the LZMA throughput of the payloads that were compressed */
+        uint64_t saved_msec = sampling.lzma_bytes > 0 ? sampling.stored_bytes * sampling.lzma_usec / sampling.lzma_bytes / 1000 : 0;
+        fprintf(stdout, "Stored uncompressed: %'llu payload(s), %'llu bytes, sampling took %'llu ms, ~%'llu ms of LZMA saved\n",
+                (unsigned long long)sampling.stored, (unsigned long long)sampling.stored_bytes,
+                (unsigned long long)(sampling.sample_usec / 1000), (unsigned long long)saved_msec);
+    }
 
     return ret;
 }
@@ -0,0 +1,133 @@
+#include "dircache.h"
+
+#include "vfs.h"
+#include "thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct dircache_s {
+    thread_mutex_t *mutex;
+    char **slots;
+    uint32_t capacity;
+    uint32_t count;
+    uint64_t requests;
+    uint64_t mkdirs;
+};
+
+static uint32_t path_hash(const char *path, size_t len) {
+    uint32_t hash = 2166136261U;
+    size_t i;
+    for (i = 0; i < len; ++i) {
+        hash = (hash ^ (uint8_t)path[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/* Returns the slot holding `path` (first `len` bytes), or the empty slot where it belongs */
+static char **find_slot(dircache_t *cache, const char *path, size_t len) {
+    uint32_t mask = cache->capacity - 1;
+    uint32_t i = path_hash(path, len) & mask;
+    while (cache->slots[i]) {
+        if (!strncmp(cache->slots[i], path, len) && cache->slots[i][len] == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &cache->slots[i];
+}
+
+static int grow(dircache_t *cache) {
+    uint32_t i, old_capacity = cache->capacity;
+    char **old_slots = cache->slots;
+    cache->slots = calloc(old_capacity * 2, sizeof(char*));
+    if (!cache->slots) {
+        cache->slots = old_slots;
+        return -1;
+    }
+    cache->capacity = old_capacity * 2;
+    for (i = 0; i < old_capacity; ++i) {
+        if (old_slots[i]) {
+            *find_slot(cache, old_slots[i], strlen(old_slots[i])) = old_slots[i];
+        }
+    }
+    free(old_slots);
+    return 0;
+}
+
+static void insert(dircache_t *cache, const char *path, size_t len) {
+    char **slot;
+    if ((cache->count + 1) * 4 > cache->capacity * 3 && grow(cache) != 0) {
+        return;
+    }
+    slot = find_slot(cache, path, len);
+    if (*slot) {
+        return;
+    }
+    *slot = malloc(len + 1);
+    if (!*slot) {
+        return;
+    }
+    memcpy(*slot, path, len);
+    (*slot)[len] = 0;
+    ++cache->count;
+}
+
+dircache_t *dircache_create() {
+    dircache_t *cache = calloc(1, sizeof(dircache_t));
+    if (!cache) return NULL;
+    cache->capacity = 1024;
+    cache->slots = calloc(cache->capacity, sizeof(char*));
+    cache->mutex = thread_mutex_create();
+    if (!cache->slots || !cache->mutex) {
+        dircache_destroy(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+int dircache_ensure(dircache_t *cache, const char *path) {
+    size_t len = strlen(path);
+    int ret;
+    thread_mutex_lock(cache->mutex);
+    ++cache->requests;
+    if (*find_slot(cache, path, len)) {
+        thread_mutex_unlock(cache->mutex);
+        return 0;
+    }
+    ++cache->mkdirs;
+    ret = vfs.mkdir(path);
+    if (ret == 0 || ret == -2) {
+        /* mkdir is recursive, every parent directory exists now too */
+        size_t i;
+        insert(cache, path, len);
+        for (i = len; i > 0; --i) {
+            if (path[i - 1] == '/' || path[i - 1] == '\\') {
+                insert(cache, path, i - 1);
+            }
+        }
+        ret = 0;
+    }
+    thread_mutex_unlock(cache->mutex);
+    return ret;
+}
+
+void dircache_stats(dircache_t *cache, uint64_t *requests, uint64_t *mkdirs) {
+    thread_mutex_lock(cache->mutex);
+    if (requests) *requests = cache->requests;
+    if (mkdirs) *mkdirs = cache->mkdirs;
+    thread_mutex_unlock(cache->mutex);
+}
+
+void dircache_destroy(dircache_t *cache) {
+    uint32_t i;
+    if (!cache) return;
+    if (cache->slots) {
+        for (i = 0; i < cache->capacity; ++i) {
+            free(cache->slots[i]);
+        }
+        free(cache->slots);
+    }
+    thread_mutex_destroy(cache->mutex);
+    free(cache);
+}
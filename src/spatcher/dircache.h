@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Set of directories already ensured during one patch run, safe to share between threads */
+typedef struct dircache_s dircache_t;
+
+extern dircache_t *dircache_create();
+/* Creates directory `path` (recursively) unless it or one of its children was ensured before.
+ * Returns 0 if the directory exists afterwards, -1 on failure */
+extern int dircache_ensure(dircache_t *cache, const char *path);
+/* Number of ensure requests, and of those that had to reach vfs.mkdir */
+extern void dircache_stats(dircache_t *cache, uint64_t *requests, uint64_t *mkdirs);
+extern void dircache_destroy(dircache_t *cache);
@@ -1,35 +1,1136 @@
-#include "patch.h"
-
 #include "xdelta3.h"
 #include "LzmaDec.h"
 
+#include "patch.h"
+#include "dircache.h"
+#include "thread.h"
+#include "ring.h"
+#include "lz77.h"
+#include "bcj.h"
+#include "sadiff.h"
+#include "cdc.h"
+#include "arena.h"
+
 #include "vfs.h"
+#include "util.h"
 
 #include <stdint.h>
 
+#define PROBE_ABSENT 0xFFFFFFFFFFFFFFFFULL
+
 static void *cb_opaque = NULL;
 static info_callback_t info_cb = NULL;
 static progress_callback_t progress_cb = NULL;
 static message_callback_t message_cb = NULL;
 
-static void *SzAlloc(ISzAllocPtr p, size_t size) { (void*)p; return malloc(size); }
-static void SzFree(ISzAllocPtr p, void *address) { (void*)p; free(address); }
+/* multi-base patches: set once a BASE entry was met, and once one of them matched the installed files */
+static int base_sections_seen = 0;
+static int base_selected = 0;
+
+/* directories ensured during do_multi_patch(), and totals over all runs */
+static dircache_t *dir_cache = NULL;
+static uint64_t dir_requests = 0, dir_mkdirs = 0;
+
+/* directory table of the current patch, names of later entries are a directory id plus the base name */
+typedef struct name_dir_s {
+    char *path;
+    uint32_t parent;
+    int created;
+} name_dir_t;
+static name_dir_t *name_dirs = NULL;
+static uint32_t name_dir_count = 0;
+
+/* aligned layout: payloads start at multiples of payload_align, and are read in place from the mapped patch */
+static uint32_t payload_align = 0;
+static const uint8_t *patch_map = NULL;
+static int64_t patch_map_size = 0;
+
+static uint64_t lzma_alloc_count = 0, lzma_alloc_bytes = 0;
+/* Probability tables and dictionaries of the pooled decoders, only used under lzma_dec_pool_mutex */
+static arena_t *lzma_arena = NULL;
+/* Allocations of the xdelta3 decoder and source block of the current entry, reset after each entry */
+static arena_t *xd3_arena = NULL;
+/* Requests and system allocations of arenas already destroyed: LZMA, xdelta */
+static uint64_t arena_requests[2] = {0}, arena_mallocs[2] = {0};
+
+static void *SzAlloc(ISzAllocPtr p, size_t size) {
+    (void*)p;
+    ++lzma_alloc_count;
+    lzma_alloc_bytes += size;
+    return lzma_arena ? arena_alloc(lzma_arena, size) : NULL;
+}
+static void SzFree(ISzAllocPtr p, void *address) { (void*)p; arena_free(lzma_arena, address); }
+
+static ISzAlloc my_alloc = { SzAlloc, SzFree };
+
+/* Pool of LZMA decoders, one slot per concurrently decoding thread.
+ * Probability tables and dictionaries stay allocated between entries and are only
+ * reallocated when the props of the next payload need other sizes */
+#define LZMA_DEC_POOL_SIZE 4
+static struct {
+    CLzmaDec dec;
+    int in_use;
+} lzma_dec_pool[LZMA_DEC_POOL_SIZE];
+static thread_mutex_t *lzma_dec_pool_mutex = NULL;
+
+/* Must be called before worker threads are started */
+static void lzma_dec_pool_init() {
+    int i;
+    if (lzma_dec_pool_mutex) {
+        return;
+    }
+    lzma_dec_pool_mutex = thread_mutex_create();
+    lzma_arena = arena_create(ARENA_PERSISTENT);
+    for (i = 0; i < LZMA_DEC_POOL_SIZE; ++i) {
+        LzmaDec_Construct(&lzma_dec_pool[i].dec);
+        lzma_dec_pool[i].in_use = 0;
+    }
+}
+
+static void destroy_arena(arena_t **arena, int index) {
+    uint64_t requests, mallocs;
+    arena_stats(*arena, &requests, &mallocs);
+    arena_requests[index] += requests;
+    arena_mallocs[index] += mallocs;
+    arena_destroy(*arena);
+    *arena = NULL;
+}
+
+static void lzma_dec_pool_free() {
+    int i;
+    destroy_arena(&xd3_arena, 1);
+    if (!lzma_dec_pool_mutex) {
+        return;
+    }
+    for (i = 0; i < LZMA_DEC_POOL_SIZE; ++i) {
+        LzmaDec_Free(&lzma_dec_pool[i].dec, &my_alloc);
+    }
+    destroy_arena(&lzma_arena, 0);
+    thread_mutex_destroy(lzma_dec_pool_mutex);
+    lzma_dec_pool_mutex = NULL;
+}
+
+/* Takes a free decoder and prepares it for `props`, with a dictionary if `with_dict` is set */
+static CLzmaDec *lzma_dec_acquire(const uint8_t *props, int with_dict) {
+    int i;
+    CLzmaDec *dec = NULL;
+    lzma_dec_pool_init();
+    thread_mutex_lock(lzma_dec_pool_mutex);
+    for (i = 0; i < LZMA_DEC_POOL_SIZE; ++i) {
+        if (!lzma_dec_pool[i].in_use) {
+            SRes res = with_dict ?
+                       LzmaDec_Allocate(&lzma_dec_pool[i].dec, props, LZMA_PROPS_SIZE, &my_alloc) :
+                       LzmaDec_AllocateProbs(&lzma_dec_pool[i].dec, props, LZMA_PROPS_SIZE, &my_alloc);
+            if (res == SZ_OK) {
+                lzma_dec_pool[i].in_use = 1;
+                dec = &lzma_dec_pool[i].dec;
+            }
+            break;
+        }
+    }
+    thread_mutex_unlock(lzma_dec_pool_mutex);
+    return dec;
+}
+
+static void lzma_dec_release(CLzmaDec *dec) {
+    int i;
+    thread_mutex_lock(lzma_dec_pool_mutex);
+    for (i = 0; i < LZMA_DEC_POOL_SIZE; ++i) {
+        if (&lzma_dec_pool[i].dec == dec) {
+            lzma_dec_pool[i].in_use = 0;
+        }
+    }
+    thread_mutex_unlock(lzma_dec_pool_mutex);
+}
+
+/* LzmaDecode() with a pooled decoder, decodes a whole payload into `dest` */
+static SRes lzma_decode_buf(uint8_t *dest, SizeT *dest_len, const uint8_t *src, SizeT *src_len, const uint8_t *props) {
+    ELzmaStatus status;
+    SRes res;
+    Byte *dic;
+    SizeT dic_size, out_size = *dest_len;
+    CLzmaDec *dec = lzma_dec_acquire(props, 0);
+    if (!dec) {
+        return SZ_ERROR_MEM;
+    }
+    /* the pooled dictionary is kept aside while decoding straight into dest */
+    dic = dec->dic;
+    dic_size = dec->dicBufSize;
+    dec->dic = dest;
+    dec->dicBufSize = out_size;
+    LzmaDec_Init(dec);
+    res = LzmaDec_DecodeToDic(dec, out_size, src, src_len, LZMA_FINISH_END, &status);
+    *dest_len = dec->dicPos;
+    if (res == SZ_OK && status == LZMA_STATUS_NEEDS_MORE_INPUT) {
+        res = SZ_ERROR_INPUT_EOF;
+    }
+    dec->dic = dic;
+    dec->dicBufSize = dic_size;
+    lzma_dec_release(dec);
+    return res;
+}
+
+/* Loads the tail of `fsrc` into the dictionary of an initialized decoder, the way
+ * sdiffer primed the encoder for DIFF_TYPE_CHANGE_PRIMED_LZMA */
+static int lzma_dec_prime(CLzmaDec *dec, struct vfs_file_handle *fsrc) {
+    int64_t src_size = vfs.size(fsrc);
+    SizeT len = src_size < dec->prop.dicSize ? (SizeT)src_size : dec->prop.dicSize;
+    if (len > dec->dicBufSize) {
+        return -1;
+    }
+    vfs.seek(fsrc, src_size - len, VFS_SEEK_POSITION_START);
+    if (vfs.read(fsrc, dec->dic, len) != (int64_t)len) {
+        return -1;
+    }
+    LzmaDec_InitPrimed(dec, len);
+    return 0;
+}
+
+/* Decodes one DIFF_TYPE_*_FAST block, returns its raw size or -1 */
+static int64_t fast_decode_block(const uint8_t *src, uint32_t header, uint8_t *dest, size_t dest_len) {
+    uint32_t len = header & 0x7FFFFFFFU;
+    if (header & 0x80000000U) {
+        if (len > dest_len) {
+            return -1;
+        }
+        memcpy(dest, src, len);
+        return len;
+    }
+    return lz77_decompress(src, len, dest, dest_len);
+}
+
+/* Decodes a whole DIFF_TYPE_*_FAST payload (after its original size field) */
+static int fast_decode_buf(uint8_t *dest, size_t dest_len, const uint8_t *src, size_t src_len) {
+    size_t out = 0;
+    while (out < dest_len) {
+        uint32_t header;
+        int64_t n;
+        if (src_len < sizeof(uint32_t)) {
+            return -1;
+        }
+        memcpy(&header, src, sizeof(uint32_t));
+        src += sizeof(uint32_t);
+        src_len -= sizeof(uint32_t);
+        if ((header & 0x7FFFFFFFU) > src_len) {
+            return -1;
+        }
+        n = fast_decode_block(src, header, dest + out, dest_len - out);
+        if (n <= 0) {
+            return -1;
+        }
+        src += header & 0x7FFFFFFFU;
+        src_len -= header & 0x7FFFFFFFU;
+        out += n;
+    }
+    return 0;
+}
+
+/* Output of a CHANGE entry. For DIFF_TYPE_FILTERED entries the branch filter is undone
+ * in the same BCJ_BLOCK_SIZE blocks sdiffer converted, so writes are staged until a block is full */
+typedef struct entry_output_s {
+    struct vfs_file_handle *fout;
+    int filter;
+    uint8_t *buf;
+    size_t fill;
+    uint64_t offset;
+} entry_output_t;
+
+static int output_write(entry_output_t *out, const uint8_t *data, size_t size) {
+    if (out->filter == BCJ_NONE) {
+        return vfs.write(out->fout, data, size) == (int64_t)size ? 0 : -1;
+    }
+    if (!out->buf) {
+        out->buf = malloc(BCJ_BLOCK_SIZE);
+        if (!out->buf) {
+            return -1;
+        }
+    }
+    while (size > 0) {
+        size_t n = BCJ_BLOCK_SIZE - out->fill;
+        if (n > size) n = size;
+        memcpy(out->buf + out->fill, data, n);
+        out->fill += n;
+        data += n;
+        size -= n;
+        if (out->fill == BCJ_BLOCK_SIZE) {
+            bcj_convert(out->filter, out->buf, out->fill, out->offset, 0);
+            if (vfs.write(out->fout, out->buf, out->fill) != (int64_t)out->fill) {
+                return -1;
+            }
+            out->offset += out->fill;
+            out->fill = 0;
+        }
+    }
+    return 0;
+}
+
+/* Writes the last partial block, if any */
+static int output_finish(entry_output_t *out) {
+    int ret = 0;
+    if (out->fill > 0) {
+        bcj_convert(out->filter, out->buf, out->fill, out->offset, 0);
+        if (vfs.write(out->fout, out->buf, out->fill) != (int64_t)out->fill) {
+            ret = -1;
+        }
+        out->offset += out->fill;
+        out->fill = 0;
+    }
+    free(out->buf);
+    out->buf = NULL;
+    return ret;
+}
+
+static int sa_output_write(void *opaque, const uint8_t *data, size_t size) {
+    return output_write(opaque, data, size);
+}
+
+typedef int (*payload_sink_t)(void *opaque, const uint8_t *data, size_t size);
+
+/* Streams the decoded bytes of an LZMA payload (uint32_t size, props, data) into `sink`,
+ * progress reports *total, which the sink advances */
+static int decode_lzma_payload(struct vfs_file_handle *input_file, const uint8_t *payload, uint32_t inp_size,
+                               payload_sink_t sink, void *opaque, const uint64_t *total) {
+    int ret = -1;
+    CLzmaDec *dec = NULL;
+    uint8_t props[LZMA_PROPS_SIZE];
+    ELzmaStatus status = LZMA_STATUS_NOT_SPECIFIED;
+    uint8_t buf[256 * 1024], buf_out[256 * 1024];
+    uint32_t output_size;
+    int64_t left = (int64_t)inp_size - LZMA_PROPS_SIZE - sizeof(uint32_t);
+
+    if (payload) {
+        memcpy(&output_size, payload, sizeof(uint32_t));
+        memcpy(props, payload + sizeof(uint32_t), LZMA_PROPS_SIZE);
+    } else {
+        vfs.read(input_file, &output_size, sizeof(uint32_t));
+        vfs.read(input_file, props, LZMA_PROPS_SIZE);
+    }
+    dec = lzma_dec_acquire(props, 1);
+    if (!dec) {
+        if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+        return -1;
+    }
+    LzmaDec_Init(dec);
+    if (progress_cb) progress_cb(cb_opaque, 0);
+    while (left > 0 && status != LZMA_STATUS_FINISHED_WITH_MARK) {
+        const uint8_t *data;
+        int64_t bytes, offset = 0;
+        if (payload) {
+            data = payload + inp_size - left;
+            bytes = left;
+        } else {
+            bytes = vfs.read(input_file, buf, left < 256 * 1024 ? left : 256 * 1024);
+            if (bytes <= 0) {
+                break;
+            }
+            data = buf;
+        }
+        while (offset < bytes) {
+            SizeT sz_input = bytes - offset;
+            SizeT sz_output = 256 * 1024;
+            if (LzmaDec_DecodeToBuf(dec, buf_out, &sz_output, data + offset, &sz_input, LZMA_FINISH_ANY, &status) != SZ_OK
+                || sink(opaque, buf_out, sz_output) != 0) {
+                if (message_cb) message_cb(cb_opaque, -1, "Error decompress patch data!");
+                goto end;
+            }
+            offset += sz_input;
+            if (progress_cb) progress_cb(cb_opaque, *total);
+            if (sz_output == 0) {
+                break;
+            }
+        }
+        left -= bytes;
+    }
+    if (status != LZMA_STATUS_FINISHED_WITH_MARK) {
+        SizeT sz_input = 0;
+        SizeT sz_output = 256 * 1024;
+        if (LzmaDec_DecodeToBuf(dec, buf_out, &sz_output, NULL, &sz_input, LZMA_FINISH_END, &status) != SZ_OK
+            || sink(opaque, buf_out, sz_output) != 0) {
+            if (message_cb) message_cb(cb_opaque, -1, "Error decompress patch data!");
+            goto end;
+        }
+    }
+    if (progress_cb) progress_cb(cb_opaque, -1);
+    ret = 0;
+
+end:
+    lzma_dec_release(dec);
+    return ret;
+}
+
+static int sa_sink(void *opaque, const uint8_t *data, size_t size) {
+    return sadiff_apply((sadiff_apply_t*)opaque, data, size);
+}
+
+/* Applies a DIFF_TYPE_CHANGE_SA_LZMA payload: the old file is loaded (and filtered) whole,
+ * the records are applied as they come out of the LZMA decoder */
+static int apply_sa_change(struct vfs_file_handle *input_file, const uint8_t *payload, uint32_t inp_size,
+                           struct vfs_file_handle *fsrc, entry_output_t *out) {
+    int ret = -1;
+    int64_t src_size = vfs.size(fsrc);
+    uint8_t *src = NULL;
+    sadiff_apply_t state;
+
+    src = malloc(src_size > 0 ? src_size : 1);
+    if (!src) {
+        if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+        return -1;
+    }
+    vfs.seek(fsrc, 0, VFS_SEEK_POSITION_START);
+    if (src_size > 0 && vfs.read(fsrc, src, src_size) != src_size) {
+        if (message_cb) message_cb(cb_opaque, -1, "Unable to read source file!");
+        goto end;
+    }
+    bcj_convert(out->filter, src, src_size, 0, 1);
+    sadiff_apply_init(&state, src, src_size, sa_output_write, out);
+
+    if (info_cb) info_cb(cb_opaque, vfs.get_path(out->fout), -1, DIFF_TYPE_CHANGE_LZMA);
+    if (decode_lzma_payload(input_file, payload, inp_size, sa_sink, &state, &state.total) != 0) {
+        goto end;
+    }
+    if (sadiff_apply_finish(&state) != 0) {
+        if (message_cb) message_cb(cb_opaque, -1, "Error decompress patch data!");
+        goto end;
+    }
+    ret = 0;
+
+end:
+    free(src);
+    return ret;
+}
+
+/* CHANGE entries at least this large are applied by the read/LZMA -> xdelta -> write pipeline */
+#define PIPELINE_MIN_SIZE (1024 * 1024)
+#define PIPELINE_SLOTS 4
+#define PIPELINE_SLOT_SIZE (256 * 1024)
+
+/* Per stage (read+LZMA, xdelta, write): bytes produced, time spent blocked on a neighbour, and wall time */
+static uint64_t stage_bytes[3] = {0}, stage_stall[3] = {0}, pipeline_wall = 0;
+
+/* Online CPUs, 0 until the first large CHANGE entry. On a single CPU the stages could only take turns,
+ * so the entry is applied sequentially without the thread setup */
+static int pipeline_cpus = 0;
+
+enum {
+    PIPELINE_RAW,
+    PIPELINE_LZMA,
+    PIPELINE_FAST,
+};
+
+typedef struct pipeline_reader_s {
+    struct vfs_file_handle *input_file;
+    const uint8_t *payload;
+    int64_t size, pos;
+    int codec;
+    ring_t *ring;
+    int ret;
+    uint64_t bytes;
+} pipeline_reader_t;
+
+typedef struct pipeline_writer_s {
+    entry_output_t *out;
+    ring_t *ring;
+    int ret;
+    uint64_t bytes;
+} pipeline_writer_t;
+
+/* Reads `len` payload bytes into buf, or points *src at them if the patch is mapped */
+static int pipeline_read_exact(pipeline_reader_t *reader, uint8_t *buf, int64_t len, const uint8_t **src) {
+    if (reader->size - reader->pos < len) {
+        return -1;
+    }
+    if (reader->payload) {
+        *src = reader->payload + reader->pos;
+    } else {
+        if (vfs.read(reader->input_file, buf, len) < len) {
+            return -1;
+        }
+        *src = buf;
+    }
+    reader->pos += len;
+    return 0;
+}
+
+/* Returns the next chunk of the raw payload in *src, 0 at its end, -1 on read error */
+static int64_t pipeline_next_chunk(pipeline_reader_t *reader, uint8_t *buf, const uint8_t **src) {
+    int64_t bytes = reader->size - reader->pos;
+    if (bytes <= 0) {
+        return 0;
+    }
+    if (reader->payload) {
+        *src = reader->payload + reader->pos;
+    } else {
+        bytes = vfs.read(reader->input_file, buf, bytes < PIPELINE_SLOT_SIZE ? bytes : PIPELINE_SLOT_SIZE);
+        if (bytes <= 0) {
+            return -1;
+        }
+        *src = buf;
+    }
+    reader->pos += bytes;
+    return bytes;
+}
+
+static void pipeline_read_thread(void *arg) {
+    pipeline_reader_t *reader = arg;
+    uint8_t *buf = reader->payload ? NULL : malloc(PIPELINE_SLOT_SIZE);
+    const uint8_t *src = NULL;
+    int64_t avail = 0;
+    reader->ret = -1;
+    if (!reader->payload && !buf) {
+        goto end;
+    }
+    if (reader->codec == PIPELINE_FAST) {
+        uint8_t *packed = reader->payload ? NULL : malloc(lz77_bound(LZ77_BLOCK_SIZE));
+        uint32_t orig_size, header;
+        uint64_t out = 0;
+        if (!reader->payload && !packed) {
+            goto end;
+        }
+        if (pipeline_read_exact(reader, (uint8_t*)&orig_size, sizeof(uint32_t), &src) == 0) {
+            memcpy(&orig_size, src, sizeof(uint32_t));
+            while (out < orig_size) {
+                uint8_t *slot;
+                int64_t n;
+                if (pipeline_read_exact(reader, (uint8_t*)&header, sizeof(uint32_t), &src) != 0) {
+                    break;
+                }
+                memcpy(&header, src, sizeof(uint32_t));
+                if ((header & 0x7FFFFFFFU) > lz77_bound(LZ77_BLOCK_SIZE)
+                    || pipeline_read_exact(reader, packed, header & 0x7FFFFFFFU, &src) != 0) {
+                    break;
+                }
+                slot = ring_write_acquire(reader->ring);
+                if (!slot) {
+                    break;
+                }
+                n = fast_decode_block(src, header, slot, PIPELINE_SLOT_SIZE);
+                if (n <= 0) {
+                    break;
+                }
+                ring_write_commit(reader->ring, n);
+                reader->bytes += n;
+                out += n;
+            }
+            if (out == orig_size) {
+                reader->ret = 0;
+            }
+        }
+        free(packed);
+    } else if (reader->codec == PIPELINE_RAW) {
+        while ((avail = pipeline_next_chunk(reader, buf, &src)) > 0) {
+            uint8_t *slot = ring_write_acquire(reader->ring);
+            if (!slot) {
+                goto end;
+            }
+            memcpy(slot, src, avail);
+            ring_write_commit(reader->ring, avail);
+            reader->bytes += avail;
+        }
+        reader->ret = avail == 0 ? 0 : -1;
+    } else {
+        uint8_t header[sizeof(uint32_t) + LZMA_PROPS_SIZE];
+        CLzmaDec *dec;
+        ELzmaStatus status = LZMA_STATUS_NOT_SPECIFIED;
+        if (reader->payload) {
+            memcpy(header, reader->payload, sizeof(header));
+        } else if (vfs.read(reader->input_file, header, sizeof(header)) < sizeof(header)) {
+            goto end;
+        }
+        reader->pos = sizeof(header);
+        dec = lzma_dec_acquire(header + sizeof(uint32_t), 1);
+        if (!dec) {
+            goto end;
+        }
+        LzmaDec_Init(dec);
+        while (status != LZMA_STATUS_FINISHED_WITH_MARK) {
+            SizeT in_len, out_len = PIPELINE_SLOT_SIZE;
+            uint8_t *slot;
+            int last;
+            if (avail == 0) {
+                avail = pipeline_next_chunk(reader, buf, &src);
+                if (avail < 0) {
+                    break;
+                }
+            }
+            last = avail == 0;
+            slot = ring_write_acquire(reader->ring);
+            if (!slot) {
+                break;
+            }
+            in_len = avail;
+            if (LzmaDec_DecodeToBuf(dec, slot, &out_len, src, &in_len,
+                                    last ? LZMA_FINISH_END : LZMA_FINISH_ANY, &status) != SZ_OK) {
+                break;
+            }
+            src += in_len;
+            avail -= in_len;
+            if (out_len > 0) {
+                ring_write_commit(reader->ring, out_len);
+                reader->bytes += out_len;
+            } else if (last || in_len == 0) {
+                /* Input exhausted without an end mark */
+                status = LZMA_STATUS_FINISHED_WITH_MARK;
+            }
+        }
+        if (status == LZMA_STATUS_FINISHED_WITH_MARK) {
+            reader->ret = 0;
+        }
+        lzma_dec_release(dec);
+    }
+end:
+    ring_close(reader->ring);
+    free(buf);
+}
+
+static void pipeline_write_thread(void *arg) {
+    pipeline_writer_t *writer = arg;
+    const uint8_t *data;
+    size_t len;
+    writer->ret = 0;
+    while ((data = ring_read_acquire(writer->ring, &len)) != NULL) {
+        if (output_write(writer->out, data, len) != 0) {
+            writer->ret = -1;
+            ring_abort(writer->ring);
+            break;
+        }
+        writer->bytes += len;
+        ring_read_release(writer->ring);
+    }
+}
+
+/* Applies a CHANGE payload with patch reading and LZMA decoding, xdelta decoding and
+ * output writing each on their own thread, linked by bounded rings */
+static int run_change_pipeline(xd3_stream *stream, struct vfs_file_handle *input_file, const uint8_t *payload,
+                               int64_t size, int codec, entry_output_t *out) {
+    pipeline_reader_t reader = {0};
+    pipeline_writer_t writer = {0};
+    thread_t *read_thread = NULL, *write_thread = NULL;
+    const uint8_t *chunk;
+    size_t chunk_len = 0;
+    int64_t total = 0;
+    uint64_t start = util_time_usec(), read_stall = 0, xdelta_stall = 0, wait;
+    int ret = -1;
+
+    reader.input_file = input_file;
+    reader.payload = payload;
+    reader.size = size;
+    reader.codec = codec;
+    reader.ring = ring_create(PIPELINE_SLOTS, PIPELINE_SLOT_SIZE);
+    writer.out = out;
+    writer.ring = ring_create(PIPELINE_SLOTS, PIPELINE_SLOT_SIZE);
+    if (!reader.ring || !writer.ring) {
+        if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+        goto end;
+    }
+    read_thread = thread_create(pipeline_read_thread, &reader);
+    write_thread = thread_create(pipeline_write_thread, &writer);
+    if (!read_thread || !write_thread) {
+        if (message_cb) message_cb(cb_opaque, -1, "Unable to start patch threads!");
+        goto end;
+    }
+
+    stream->flags |= XD3_FLUSH;
+    chunk = ring_read_acquire(reader.ring, &chunk_len);
+    if (!chunk) {
+        goto end;
+    }
+    xd3_avail_input(stream, chunk, chunk_len);
+    if (progress_cb) progress_cb(cb_opaque, 0);
+    while (1) {
+        ret = xd3_decode_input(stream);
+        switch (ret) {
+        case XD3_INPUT:
+            ring_read_release(reader.ring);
+            chunk = ring_read_acquire(reader.ring, &chunk_len);
+            if (!chunk) {
+                if (progress_cb) progress_cb(cb_opaque, -1);
+                ret = 0;
+                goto end;
+            }
+            xd3_avail_input(stream, chunk, chunk_len);
+            break;
+        case XD3_OUTPUT: {
+            usize_t offset = 0;
+            while (offset < stream->avail_out) {
+                usize_t n = xd3_min(stream->avail_out - offset, PIPELINE_SLOT_SIZE);
+                uint8_t *slot = ring_write_acquire(writer.ring);
+                if (!slot) {
+                    ret = -1;
+                    goto end;
+                }
+                memcpy(slot, stream->next_out + offset, n);
+                ring_write_commit(writer.ring, n);
+                offset += n;
+            }
+            total += stream->avail_out;
+            if (progress_cb) progress_cb(cb_opaque, total);
+            xd3_consume_output(stream);
+            break;
+        }
+        case XD3_GOTHEADER:
+        case XD3_WINSTART:
+        case XD3_WINFINISH:
+            /* no action necessary */
+            break;
+        default:
+            if (message_cb) message_cb(cb_opaque, -1, "Error decode stream: %d", ret);
+            goto end;
+        }
+    }
+
+end:
+    if (reader.ring) ring_abort(reader.ring);
+    if (writer.ring) ring_close(writer.ring);
+    thread_join(read_thread);
+    thread_join(write_thread);
+    if (ret == 0 && reader.ret != 0) {
+        if (message_cb) message_cb(cb_opaque, -1, "Error decompress patch data!");
+        ret = -1;
+    }
+    if (ret == 0 && writer.ret != 0) {
+        if (message_cb) message_cb(cb_opaque, -1, "Unable to write output file!");
+        ret = -1;
+    }
+    if (reader.ring) {
+        ring_stall_stats(reader.ring, &read_stall, &xdelta_stall);
+        stage_stall[0] += read_stall;
+        stage_stall[1] += xdelta_stall;
+        ring_destroy(reader.ring);
+    }
+    if (writer.ring) {
+        ring_stall_stats(writer.ring, &wait, &read_stall);
+        stage_stall[1] += wait;
+        stage_stall[2] += read_stall;
+        ring_destroy(writer.ring);
+    }
+    stage_bytes[0] += reader.bytes;
+    stage_bytes[1] += total;
+    stage_bytes[2] += writer.bytes;
+    pipeline_wall += util_time_usec() - start;
+    return ret;
+}
+
+/* Source block buffer of a CHANGE entry, blocks of filtered entries are converted as they are read */
+typedef struct source_block_s {
+    uint8_t *data;
+    int filter;
+    /* serves the stream allocations too, the block is the stream opaque */
+    arena_t *arena;
+} source_block_t;
+
+static void *sp_alloc(void *opaque, size_t items, usize_t size) {
+    return arena_alloc(((source_block_t*)opaque)->arena, items * size);
+}
+
+static void sp_free(void *opaque, void *address) {
+    arena_free(((source_block_t*)opaque)->arena, address);
+}
 
 static int sp_getblk(xd3_stream *stream, xd3_source *source, xoff_t blkno) {
-    uint8_t *blkdata = *(uint8_t**)stream->opaque;
+    source_block_t *blk = stream->opaque;
     int64_t bytes;
-    if (!blkdata) {
-        *(void**)stream->opaque = malloc(source->blksize);
-        blkdata = *(uint8_t**)stream->opaque;
+    if (!blk->data) {
+        blk->data = arena_alloc(blk->arena, source->blksize);
+        if (!blk->data) {
+            return ENOMEM;
+        }
     }
     vfs.seek(source->ioh, source->blksize * blkno, VFS_SEEK_POSITION_START);
-    bytes = vfs.read(source->ioh, blkdata, source->blksize);
+    bytes = vfs.read(source->ioh, blk->data, source->blksize);
+    if (bytes > 0) {
+        bcj_convert(blk->filter, blk->data, bytes, source->blksize * blkno, 1);
+    }
     source->curblkno = blkno;
     source->onblk = bytes;
-    source->curblk = blkdata;
+    source->curblk = blk->data;
+    return 0;
+}
+
+/* Skips the padding before a data payload of `size` bytes.
+ * If the patch is mapped the payload is consumed and a pointer to it is returned, otherwise returns NULL */
+static const uint8_t *begin_payload(struct vfs_file_handle *input_file, uint32_t size) {
+    int64_t pos = vfs.tell(input_file);
+    if (payload_align > 0) {
+        pos += (payload_align - pos % payload_align) % payload_align;
+        vfs.seek(input_file, pos, VFS_SEEK_POSITION_START);
+    }
+    if (patch_map && pos + size <= patch_map_size) {
+        vfs.seek(input_file, pos + size, VFS_SEEK_POSITION_START);
+        return patch_map + pos;
+    }
+    return NULL;
+}
+
+/* Old files a DIFF_TYPE_ADD_CHUNKS entry copies from, opened on first use */
+typedef struct chunk_sources_s {
+    uint32_t count;
+    char **paths;
+    struct vfs_file_handle **files;
+    entry_output_t *out;
+    cdc_apply_t state;
+} chunk_sources_t;
+
+static int chunk_read(void *opaque, uint32_t source, uint32_t offset, uint8_t *buf, uint32_t size) {
+    chunk_sources_t *sources = opaque;
+    if (source >= sources->count) {
+        return -1;
+    }
+    if (!sources->files[source]) {
+        sources->files[source] = vfs.open(sources->paths[source], VFS_FILE_ACCESS_READ, 0);
+        if (!sources->files[source]) {
+            return -1;
+        }
+    }
+    vfs.seek(sources->files[source], offset, VFS_SEEK_POSITION_START);
+    return vfs.read(sources->files[source], buf, size) == size ? 0 : -1;
+}
+
+static int chunk_write(void *opaque, const uint8_t *data, size_t size) {
+    return output_write(((chunk_sources_t*)opaque)->out, data, size);
+}
+
+static int chunk_sink(void *opaque, const uint8_t *data, size_t size) {
+    return cdc_apply(&((chunk_sources_t*)opaque)->state, data, size);
+}
+
+/* Applies a DIFF_TYPE_ADD_CHUNKS(_LZMA) entry: uint32_t count, count * (uint16_t len, path of an old file under `root`),
+ * then the records as a raw or LZMA payload */
+static int apply_chunk_add(struct vfs_file_handle *input_file, uint8_t type, const char *root, entry_output_t *out) {
+    int ret = -1;
+    chunk_sources_t sources = {0};
+    const uint8_t *payload;
+    uint32_t i, inp_size;
+
+    if (vfs.read(input_file, &sources.count, sizeof(uint32_t)) < sizeof(uint32_t) || sources.count > 65536) {
+        if (message_cb) message_cb(cb_opaque, -1, "Corrupted chunk table!");
+        return -1;
+    }
+    sources.paths = calloc(sources.count + 1, sizeof(char*));
+    sources.files = calloc(sources.count + 1, sizeof(struct vfs_file_handle*));
+    if (!sources.paths || !sources.files) {
+        if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+        goto end;
+    }
+    for (i = 0; i < sources.count; ++i) {
+        char name[1024];
+        uint16_t len;
+        if (vfs.read(input_file, &len, 2) < 2 || len >= 1024 || vfs.read(input_file, name, len) < len) {
+            if (message_cb) message_cb(cb_opaque, -1, "Corrupted chunk table!");
+            goto end;
+        }
+        name[len] = 0;
+        sources.paths[i] = malloc(strlen(root) + len + 2);
+        if (!sources.paths[i]) {
+            if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+            goto end;
+        }
+        sprintf(sources.paths[i], "%s/%s", root, name);
+    }
+    if (vfs.read(input_file, &inp_size, sizeof(uint32_t)) < sizeof(uint32_t)) {
+        goto end;
+    }
+    payload = begin_payload(input_file, inp_size);
+    sources.out = out;
+    cdc_apply_init(&sources.state, chunk_read, chunk_write, &sources);
+    if (type == DIFF_TYPE_ADD_CHUNKS_LZMA) {
+        if (info_cb) info_cb(cb_opaque, vfs.get_path(out->fout), -1, DIFF_TYPE_ADD_OR_REPLACE_LZMA);
+        if (decode_lzma_payload(input_file, payload, inp_size, chunk_sink, &sources, &sources.state.total) != 0) {
+            goto end;
+        }
+    } else {
+        int64_t left = inp_size;
+        uint8_t buf[256 * 1024];
+        if (info_cb) info_cb(cb_opaque, vfs.get_path(out->fout), -1, DIFF_TYPE_ADD_OR_REPLACE);
+        if (progress_cb) progress_cb(cb_opaque, 0);
+        while (left > 0) {
+            int64_t bytes = left < 256 * 1024 ? left : 256 * 1024;
+            const uint8_t *data = payload ? payload + inp_size - left : buf;
+            if (!payload && vfs.read(input_file, buf, bytes) != bytes) {
+                break;
+            }
+            if (cdc_apply(&sources.state, data, bytes) != 0) {
+                break;
+            }
+            left -= bytes;
+            if (progress_cb) progress_cb(cb_opaque, sources.state.total);
+        }
+        if (left > 0) {
+            if (message_cb) message_cb(cb_opaque, -1, "Error decompress patch data!");
+            goto end;
+        }
+        if (progress_cb) progress_cb(cb_opaque, -1);
+    }
+    if (cdc_apply_finish(&sources.state) != 0) {
+        if (message_cb) message_cb(cb_opaque, -1, "Error decompress patch data!");
+        goto end;
+    }
+    ret = 0;
+
+end:
+    for (i = 0; i < sources.count; ++i) {
+        if (sources.files && sources.files[i]) vfs.close(sources.files[i]);
+        if (sources.paths) free(sources.paths[i]);
+    }
+    free(sources.paths);
+    free(sources.files);
+    return ret;
+}
+
+static void ensure_dir(const char *path) {
+    if (dir_cache) {
+        dircache_ensure(dir_cache, path);
+        return;
+    }
+    ++dir_requests;
+    ++dir_mkdirs;
+    vfs.mkdir(path);
+}
+
+static void free_name_table() {
+    uint32_t i;
+    for (i = 0; i < name_dir_count; ++i) {
+        free(name_dirs[i].path);
+    }
+    free(name_dirs);
+    name_dirs = NULL;
+    name_dir_count = 0;
+}
+
+/* Reads a DIR_TABLE entry and builds the full relative path of every directory once */
+static int read_name_table(struct vfs_file_handle *input_file) {
+    uint32_t size, count, i;
+    uint8_t *payload, *pos, *payload_end;
+    if (vfs.read(input_file, &size, sizeof(uint32_t)) < sizeof(uint32_t) || size < sizeof(uint32_t)) {
+        return -2;
+    }
+    payload = malloc(size);
+    if (!payload) {
+        if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+        return -1;
+    }
+    if (vfs.read(input_file, payload, size) < size) {
+        free(payload);
+        return -2;
+    }
+    free_name_table();
+    count = *(uint32_t*)payload;
+    name_dirs = calloc(count + 1, sizeof(name_dir_t));
+    if (!name_dirs) {
+        free(payload);
+        if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+        return -1;
+    }
+    name_dirs[0].path = calloc(1, 1);
+    name_dir_count = 1;
+    pos = payload + sizeof(uint32_t);
+    payload_end = payload + size;
+    for (i = 1; i <= count; ++i) {
+        uint32_t parent;
+        uint16_t len;
+        size_t parent_len;
+        if (pos + sizeof(uint32_t) + 2 > payload_end) { break; }
+        parent = *(uint32_t*)pos;
+        len = *(uint16_t*)(pos + sizeof(uint32_t));
+        pos += sizeof(uint32_t) + 2;
+        if (parent >= i || pos + len > payload_end) { break; }
+        parent_len = strlen(name_dirs[parent].path);
+        name_dirs[i].path = malloc(parent_len + len + 2);
+        if (!name_dirs[i].path) { break; }
+        if (parent_len > 0) {
+            memcpy(name_dirs[i].path, name_dirs[parent].path, parent_len);
+            name_dirs[i].path[parent_len++] = '/';
+        }
+        memcpy(name_dirs[i].path + parent_len, pos, len);
+        name_dirs[i].path[parent_len + len] = 0;
+        name_dirs[i].parent = parent;
+        name_dir_count = i + 1;
+        pos += len;
+    }
+    free(payload);
+    if (name_dir_count != count + 1) {
+        if (message_cb) message_cb(cb_opaque, -1, "Corrupted name table!");
+        return -1;
+    }
+    return 0;
+}
+
+/* Turns a stored name (uint32_t directory id + base name) into a relative path, returns the directory id or -1 */
+static int64_t decode_entry_name(const char *raw, uint16_t namelen, char *name, size_t size) {
+    uint32_t id;
+    if (namelen < sizeof(uint32_t)) {
+        return -1;
+    }
+    memcpy(&id, raw, sizeof(uint32_t));
+    if (id >= name_dir_count) {
+        return -1;
+    }
+    if (id == 0) {
+        snprintf(name, size, "%.*s", (int)(namelen - sizeof(uint32_t)), raw + sizeof(uint32_t));
+    } else {
+        snprintf(name, size, "%s/%.*s", name_dirs[id].path, (int)(namelen - sizeof(uint32_t)), raw + sizeof(uint32_t));
+    }
+    return id;
+}
+
+/* Creates a table directory under output_path, once per patch run */
+static void ensure_name_dir(const char *output_path, uint32_t id) {
+    char path[1024];
+    if (name_dirs[id].created) {
+        return;
+    }
+    if (name_dirs[id].path[0] != 0) {
+        snprintf(path, 1024, "%s/%s", output_path, name_dirs[id].path);
+    } else {
+        snprintf(path, 1024, "%s", output_path);
+    }
+    ensure_dir(path);
+    /* mkdir is recursive, so every parent exists now as well */
+    while (!name_dirs[id].created) {
+        name_dirs[id].created = 1;
+        id = name_dirs[id].parent;
+    }
+}
+
+/* Reads a BASE entry, checks its probes against files under `root`,
+ * and skips the following section unless this is the first matching base */
+static int read_base_entry(struct vfs_file_handle *input_file, const char *label, const char *root) {
+    uint32_t size;
+    int64_t section_size, payload_end;
+    uint16_t probe_count, i;
+    int matched = !base_selected;
+    if (vfs.read(input_file, &size, sizeof(uint32_t)) < sizeof(uint32_t)) {
+        return -2;
+    }
+    payload_end = vfs.tell(input_file) + size;
+    if (vfs.read(input_file, &section_size, sizeof(int64_t)) < sizeof(int64_t)
+        || vfs.read(input_file, &probe_count, sizeof(uint16_t)) < sizeof(uint16_t)) {
+        return -2;
+    }
+    for (i = 0; i < probe_count && matched; ++i) {
+        uint16_t namelen;
+        uint64_t probe_size, file_size, probe_hash, file_hash;
+        char name[1024], path[1024];
+        if (vfs.read(input_file, &namelen, 2) < 2 || namelen >= 1024
+            || vfs.read(input_file, name, namelen) < namelen
+            || vfs.read(input_file, &probe_size, sizeof(uint64_t)) < sizeof(uint64_t)
+            || vfs.read(input_file, &probe_hash, sizeof(uint64_t)) < sizeof(uint64_t)) {
+            return -2;
+        }
+        name[namelen] = 0;
+        snprintf(path, 1024, "%s/%s", root, name);
+        if (util_file_fingerprint(path, &file_size, &file_hash) != 0) {
+            matched = probe_size == PROBE_ABSENT;
+        } else {
+            matched = probe_size == file_size && probe_hash == file_hash;
+        }
+    }
+    base_sections_seen = 1;
+    vfs.seek(input_file, payload_end, VFS_SEEK_POSITION_START);
+    if (matched) {
+        base_selected = 1;
+        if (message_cb) message_cb(cb_opaque, 0, "Installed version matches base: %s", label);
+        return 0;
+    }
+    vfs.seek(input_file, section_size, VFS_SEEK_POSITION_CURRENT);
     return 0;
 }
 
+/* Decodes a whole solid block into memory and splits it into the files listed in its index */
+static int apply_solid_block(struct vfs_file_handle *input_file, const char *output_path) {
+    int ret = -1;
+    uint32_t inp_size, count, i;
+    const uint8_t *payload;
+    uint8_t *inp = NULL, *data = NULL;
+    SizeT orig_size, comp_size;
+    size_t pos, data_pos;
+    if (vfs.read(input_file, &inp_size, sizeof(uint32_t)) < sizeof(uint32_t)
+        || inp_size < LZMA_PROPS_SIZE + sizeof(uint32_t)) {
+        return -2;
+    }
+    payload = begin_payload(input_file, inp_size);
+    if (!payload) {
+        inp = malloc(inp_size);
+        if (!inp) {
+            if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+            return -1;
+        }
+        if (vfs.read(input_file, inp, inp_size) < inp_size) {
+            free(inp);
+            return -2;
+        }
+        payload = inp;
+    }
+    orig_size = *(uint32_t*)payload;
+    comp_size = inp_size - LZMA_PROPS_SIZE - sizeof(uint32_t);
+    data = malloc(orig_size + 1);
+    if (!data) {
+        if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+        goto end;
+    }
+    if (lzma_decode_buf(data, &orig_size,
+                        payload + LZMA_PROPS_SIZE + sizeof(uint32_t), &comp_size,
+                        payload + sizeof(uint32_t)) != SZ_OK || orig_size < sizeof(uint32_t)) {
+        if (message_cb) message_cb(cb_opaque, -1, "Error decompress patch data!");
+        goto end;
+    }
+    count = *(uint32_t*)data;
+    pos = sizeof(uint32_t);
+    /* skip the index once to find where file data starts */
+    for (i = 0; i < count; ++i) {
+        uint16_t namelen;
+        if (pos + 2 > orig_size) { goto corrupt; }
+        namelen = *(uint16_t*)(data + pos);
+        pos += 2 + namelen + sizeof(uint32_t);
+        if (pos > orig_size) { goto corrupt; }
+    }
+    data_pos = pos;
+    pos = sizeof(uint32_t);
+    for (i = 0; i < count; ++i) {
+        char path[1024], *rslash;
+        uint16_t namelen = *(uint16_t*)(data + pos);
+        uint32_t size = *(uint32_t*)(data + pos + 2 + namelen);
+        struct vfs_file_handle *fout;
+        if (data_pos + size > orig_size) { goto corrupt; }
+        if (name_dirs) {
+            char name[1024];
+            int64_t dir_id = decode_entry_name((const char*)data + pos + 2, namelen, name, 1024);
+            if (dir_id < 0) { goto corrupt; }
+            snprintf(path, 1024, "%s/%s", output_path, name);
+            ensure_name_dir(output_path, dir_id);
+        } else {
+            snprintf(path, 1024, "%s/%.*s", output_path, (int)namelen, (const char*)data + pos + 2);
+            rslash = strrchr(path, '/');
+            if (rslash) {
+                *rslash = 0;
+                ensure_dir(path);
+                *rslash = '/';
+            }
+        }
+        pos += 2 + namelen + sizeof(uint32_t);
+        fout = vfs.open(path, VFS_FILE_ACCESS_WRITE, 0);
+        if (!fout) {
+            if (message_cb) message_cb(cb_opaque, -1, "Unable to write output file!");
+            goto end;
+        }
+        if (info_cb) info_cb(cb_opaque, path, size, DIFF_TYPE_ADD_OR_REPLACE_LZMA);
+        if (progress_cb) progress_cb(cb_opaque, 0);
+        if (size > 0) vfs.write(fout, data + data_pos, size);
+        vfs.close(fout);
+        data_pos += size;
+        if (progress_cb) progress_cb(cb_opaque, size);
+        if (progress_cb) progress_cb(cb_opaque, -1);
+    }
+    ret = 0;
+    goto end;
+
+corrupt:
+    if (message_cb) message_cb(cb_opaque, -1, "Corrupted solid block!");
+end:
+    free(data);
+    free(inp);
+    return ret;
+}
+
 void set_callback_opaque(void *opaque) {
     cb_opaque = opaque;
 }
@@ -46,10 +1147,66 @@ void set_message_callback(message_callback_t cb) {
     message_cb = cb;
 }
 
+void get_lzma_alloc_stats(uint64_t *count, uint64_t *bytes) {
+    if (count) *count = lzma_alloc_count;
+    if (bytes) *bytes = lzma_alloc_bytes;
+}
+
+void get_arena_stats(uint64_t requests[2], uint64_t mallocs[2]) {
+    arena_t *arenas[2] = { lzma_arena, xd3_arena };
+    int i;
+    for (i = 0; i < 2; ++i) {
+        arena_stats(arenas[i], &requests[i], &mallocs[i]);
+        requests[i] += arena_requests[i];
+        mallocs[i] += arena_mallocs[i];
+    }
+}
+
+void get_pipeline_stats(uint64_t bytes[3], uint64_t stall_usec[3], uint64_t *wall_usec) {
+    int i;
+    for (i = 0; i < 3; ++i) {
+        bytes[i] = stage_bytes[i];
+        stall_usec[i] = stage_stall[i];
+    }
+    *wall_usec = pipeline_wall;
+}
+
+void get_dir_stats(uint64_t *requests, uint64_t *mkdirs) {
+    if (requests) *requests = dir_requests;
+    if (mkdirs) *mkdirs = dir_mkdirs;
+}
+
+int read_patch_config(struct vfs_file_handle *input_file, int64_t config_offset, patch_config_t *config) {
+    config->format_version = 0;
+    config->payload_align = 0;
+    vfs.seek(input_file, config_offset, VFS_SEEK_POSITION_START);
+    if (vfs.read(input_file, &config->format_version, sizeof(uint32_t)) != sizeof(uint32_t)) {
+        return -1;
+    }
+    if (config->format_version > SPATCH_FORMAT_VERSION) {
+        return -2;
+    }
+    if (config->format_version >= 1
+        && vfs.read(input_file, &config->payload_align, sizeof(uint32_t)) != sizeof(uint32_t)) {
+        return -1;
+    }
+    return 0;
+}
+
+void set_payload_alignment(uint32_t align) {
+    payload_align = align;
+}
+
+void set_patch_mapping(const void *data, int64_t size) {
+    patch_map = data;
+    patch_map_size = size;
+}
+
 int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, const char *output_path, int is_dir) {
     int ret = -1;
     void *data = NULL;
-    void *blkdata = NULL;
+    source_block_t blk = {0};
+    entry_output_t out = {0};
     size_t data_size = 0;
     uint8_t *inp = NULL;
     size_t src_size = 0, inp_size = 0;
@@ -58,17 +1215,21 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
     xd3_stream stream = {0};
     xd3_config config = {0};
     struct vfs_file_handle *fsrc = NULL, *fout = NULL;
+    const uint8_t *payload = NULL;
+    int inp_mapped = 0;
     uint16_t namelen = 0;
     uint8_t type = 0;
     int64_t total;
     char name[1024];
     char bakpath[1024] = {0};
     char outpath[1024] = {0};
+    int64_t ref_return = -1;
+    int64_t name_dir_id = -1;
     if (vfs.read(input_file, &namelen, 2) < 2) {
         ret = -2;
         goto end;
     }
-    if (vfs.read(input_file, name, namelen) < namelen) {
+    if (namelen > 0 && vfs.read(input_file, name, namelen) < namelen) {
         ret = -2;
         goto end;
     }
@@ -77,7 +1238,74 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
         ret = -2;
         goto end;
     }
-    if (type < 2) {
+    if (type == DIFF_TYPE_DIR_TABLE) {
+        ret = read_name_table(input_file);
+        goto end;
+    }
+    if (name_dirs && type != DIFF_TYPE_BASE && type != DIFF_TYPE_SOLID_LZMA) {
+        char raw[1024];
+        memcpy(raw, name, namelen);
+        name_dir_id = decode_entry_name(raw, namelen, name, 1024);
+        if (name_dir_id < 0) {
+            if (message_cb) message_cb(cb_opaque, -1, "Corrupted entry name!");
+            goto end;
+        }
+    }
+    if (type == DIFF_TYPE_BASE) {
+        ret = read_base_entry(input_file, name, src_path && src_path[0] != 0 ? src_path : output_path);
+        goto end;
+    }
+    if (type == DIFF_TYPE_BLOB) {
+        uint32_t size;
+        if (vfs.read(input_file, &size, sizeof(uint32_t)) < sizeof(uint32_t)) {
+            ret = -2;
+            goto end;
+        }
+        vfs.seek(input_file, size, VFS_SEEK_POSITION_CURRENT);
+        ret = 0;
+        goto end;
+    }
+    if (base_sections_seen && !base_selected) {
+        if (message_cb) message_cb(cb_opaque, -1, "Installed version does not match any base of this patch!");
+        goto end;
+    }
+    if (type == DIFF_TYPE_ADD_REF) {
+        uint32_t size;
+        int64_t blob_offset;
+        if (vfs.read(input_file, &size, sizeof(uint32_t)) < sizeof(uint32_t)
+            || vfs.read(input_file, &blob_offset, sizeof(int64_t)) < sizeof(int64_t)) {
+            ret = -2;
+            goto end;
+        }
+        ref_return = vfs.tell(input_file);
+        vfs.seek(input_file, blob_offset, VFS_SEEK_POSITION_START);
+        if (vfs.read(input_file, &type, 1) < 1 || (type != DIFF_TYPE_ADD_OR_REPLACE && type != DIFF_TYPE_ADD_OR_REPLACE_LZMA
+                                                       && type != DIFF_TYPE_ADD_OR_REPLACE_FAST && type != DIFF_TYPE_FILTERED)) {
+            ret = -2;
+            goto end;
+        }
+    }
+    if (type == DIFF_TYPE_FILTERED) {
+        uint8_t filter[2];
+        if (vfs.read(input_file, filter, 2) < 2) {
+            ret = -2;
+            goto end;
+        }
+        if ((filter[0] != BCJ_X86 && filter[0] != BCJ_ARM64)
+            || (filter[1] > DIFF_TYPE_ADD_OR_REPLACE_LZMA && filter[1] != DIFF_TYPE_CHANGE_FAST
+                && filter[1] != DIFF_TYPE_ADD_OR_REPLACE_FAST && filter[1] != DIFF_TYPE_CHANGE_SA_LZMA)) {
+            if (message_cb) message_cb(cb_opaque, -1, "Unsupported entry filter!");
+            goto end;
+        }
+        out.filter = blk.filter = filter[0];
+        type = filter[1];
+    }
+    if (type == DIFF_TYPE_SOLID_LZMA) {
+        ret = apply_solid_block(input_file, output_path);
+        goto end;
+    }
+    if (type < 2 || type == DIFF_TYPE_CHANGE_FAST || type == DIFF_TYPE_CHANGE_PRIMED_LZMA
+        || type == DIFF_TYPE_CHANGE_SA_LZMA) {
         if (is_dir) {
             if (src_path && src_path[0] != 0) {
                 snprintf(outpath, 1024, "%s/%s", src_path, name);
@@ -107,7 +1335,7 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
         , *rslash2
 #endif
         ;
-        vfs.mkdir(output_path);
+        if (name_dir_id < 0) ensure_dir(output_path);
         snprintf(path, 1024, "%s/%s", output_path, name);
         if (type == 4) {
             if (info_cb) info_cb(cb_opaque, path, 0, 4);
@@ -116,15 +1344,19 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
             goto end;
         }
         // fprintf(stdout, "Target file path: %s\n", path);
-        rslash = strrchr(path, '/');
+        if (name_dir_id >= 0) {
+            ensure_name_dir(output_path, name_dir_id);
+        } else {
+            rslash = strrchr(path, '/');
 #if defined(_WIN32)
-        rslash2 = strrchr(path, '\\');
-        if (rslash < rslash2) rslash = rslash2;
+            rslash2 = strrchr(path, '\\');
+            if (rslash < rslash2) rslash = rslash2;
 #endif
-        if (rslash) {
-            *rslash = 0;
-            vfs.mkdir(path);
-            *rslash = '/';
+            if (rslash) {
+                *rslash = 0;
+                ensure_dir(path);
+                *rslash = '/';
+            }
         }
         fout = vfs.open(path, VFS_FILE_ACCESS_WRITE, 0);
     } else {
@@ -147,7 +1379,7 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
 #endif
         if (rslash) {
             *rslash = 0;
-            vfs.mkdir(output_path);
+            ensure_dir(output_path);
             *rslash = '/';
         }
         fout = vfs.open(output_path, VFS_FILE_ACCESS_WRITE, 0);
@@ -157,64 +1389,175 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
         ret = -1;
         goto end;
     }
+    out.fout = fout;
+    if (type == DIFF_TYPE_ADD_CHUNKS || type == DIFF_TYPE_ADD_CHUNKS_LZMA) {
+        ret = apply_chunk_add(input_file, type, src_path && src_path[0] != 0 ? src_path : output_path, &out);
+        if (ret == 0 && output_finish(&out) != 0) {
+            if (message_cb) message_cb(cb_opaque, -1, "Unable to write output file!");
+            ret = -1;
+        }
+        goto end;
+    }
     if (vfs.read(input_file, &inp_size, sizeof(uint32_t)) < sizeof(uint32_t)) {
         ret = -2;
         goto end;
     }
-    if (type == 2 || type == 3) {
+    payload = begin_payload(input_file, inp_size);
+    if (type == DIFF_TYPE_CHANGE_SA_LZMA) {
+        ret = apply_sa_change(input_file, payload, inp_size, fsrc, &out);
+        if (ret == 0 && output_finish(&out) != 0) {
+            if (message_cb) message_cb(cb_opaque, -1, "Unable to write output file!");
+            ret = -1;
+        }
+        goto end;
+    }
+    if (type == 2 || type == 3 || type == DIFF_TYPE_ADD_OR_REPLACE_FAST || type == DIFF_TYPE_CHANGE_PRIMED_LZMA) {
         if (type == 2) {
             int64_t left = inp_size;
             uint8_t buf[256 * 1024];
             if (info_cb) info_cb(cb_opaque, vfs.get_path(fout), inp_size, 2);
             if (progress_cb) progress_cb(cb_opaque, 0);
             while (left > 0) {
-                int64_t bytes = vfs.read(input_file, buf, left < 256 * 1024 ? left : 256 * 1024);
-                if (bytes <= 0) {
-                    break;
+                int64_t bytes = left < 256 * 1024 ? left : 256 * 1024;
+                if (payload) {
+                    output_write(&out, payload + inp_size - left, bytes);
+                } else {
+                    bytes = vfs.read(input_file, buf, bytes);
+                    if (bytes <= 0) {
+                        break;
+                    }
+                    output_write(&out, buf, bytes);
                 }
-                vfs.write(fout, buf, bytes);
                 left -= bytes;
                 if (progress_cb) progress_cb(cb_opaque, inp_size - left);
             }
             if (progress_cb) progress_cb(cb_opaque, -1);
+        } else if (type == DIFF_TYPE_ADD_OR_REPLACE_FAST) {
+            uint8_t *packed = malloc(lz77_bound(LZ77_BLOCK_SIZE)), *raw = malloc(LZ77_BLOCK_SIZE);
+            const uint8_t *src = payload;
+            int64_t left = inp_size - sizeof(uint32_t);
+            uint32_t output_size = 0;
+            total = 0;
+            if (!packed || !raw) {
+                free(packed);
+                free(raw);
+                if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+                ret = -1;
+                goto end;
+            }
+            if (payload) {
+                memcpy(&output_size, payload, sizeof(uint32_t));
+                src += sizeof(uint32_t);
+            } else {
+                vfs.read(input_file, &output_size, sizeof(uint32_t));
+            }
+            if (info_cb) info_cb(cb_opaque, vfs.get_path(fout), output_size, 3);
+            if (progress_cb) progress_cb(cb_opaque, 0);
+            ret = 0;
+            while (total < output_size) {
+                uint32_t header, len;
+                int64_t n;
+                if (left < sizeof(uint32_t)) {
+                    ret = -1;
+                    break;
+                }
+                if (payload) {
+                    memcpy(&header, src, sizeof(uint32_t));
+                    src += sizeof(uint32_t);
+                } else {
+                    vfs.read(input_file, &header, sizeof(uint32_t));
+                }
+                len = header & 0x7FFFFFFFU;
+                left -= sizeof(uint32_t);
+                if (len > left || len > lz77_bound(LZ77_BLOCK_SIZE)) {
+                    ret = -1;
+                    break;
+                }
+                if (payload) {
+                    n = fast_decode_block(src, header, raw, LZ77_BLOCK_SIZE);
+                    src += len;
+                } else if (vfs.read(input_file, packed, len) == len) {
+                    n = fast_decode_block(packed, header, raw, LZ77_BLOCK_SIZE);
+                } else {
+                    n = -1;
+                }
+                if (n <= 0) {
+                    ret = -1;
+                    break;
+                }
+                left -= len;
+                output_write(&out, raw, n);
+                total += n;
+                if (progress_cb) progress_cb(cb_opaque, total);
+            }
+            free(packed);
+            free(raw);
+            if (progress_cb) progress_cb(cb_opaque, -1);
+            if (ret != 0) {
+                if (message_cb) message_cb(cb_opaque, -1, "Error decompress patch data!");
+                goto end;
+            }
         } else {
-            CLzmaDec dec;
+            CLzmaDec *dec;
             uint8_t props[LZMA_PROPS_SIZE];
             ELzmaStatus status = LZMA_STATUS_NOT_SPECIFIED;
-            ISzAlloc my_alloc = { SzAlloc, SzFree };
             uint8_t buf[256 * 1024], buf_out[256 * 1024];
             uint32_t output_size;
             int64_t left = inp_size;
             total = 0;
-            vfs.read(input_file, &output_size, sizeof(uint32_t));
-            if (info_cb) info_cb(cb_opaque, vfs.get_path(fout), output_size, 3);
+            if (payload) {
+                output_size = *(const uint32_t*)payload;
+                memcpy(props, payload + sizeof(uint32_t), LZMA_PROPS_SIZE);
+            } else {
+                vfs.read(input_file, &output_size, sizeof(uint32_t));
+                vfs.read(input_file, props, LZMA_PROPS_SIZE);
+            }
+            if (info_cb) info_cb(cb_opaque, vfs.get_path(fout), output_size,
+                                 type == DIFF_TYPE_CHANGE_PRIMED_LZMA ? DIFF_TYPE_CHANGE_LZMA : 3);
             if (progress_cb) progress_cb(cb_opaque, 0);
             // fprintf(stdout, "Original size: %'u\n", output_size);
-            vfs.read(input_file, props, LZMA_PROPS_SIZE);
             left -= LZMA_PROPS_SIZE + sizeof(uint32_t);
-            LzmaDec_Construct(&dec);
-            LzmaDec_Allocate(&dec, props, LZMA_PROPS_SIZE, &my_alloc);
-            LzmaDec_Init(&dec);
+            dec = lzma_dec_acquire(props, 1);
+            if (!dec) {
+                if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+                ret = -1;
+                goto end;
+            }
+            LzmaDec_Init(dec);
+            if (type == DIFF_TYPE_CHANGE_PRIMED_LZMA && lzma_dec_prime(dec, fsrc) != 0) {
+                lzma_dec_release(dec);
+                if (message_cb) message_cb(cb_opaque, -1, "Unable to read source file!");
+                ret = -1;
+                goto end;
+            }
             while (left > 0) {
                 int64_t offset;
-                int64_t bytes = vfs.read(input_file, buf, left < 256 * 1024 ? left : 256 * 1024);
-                if (bytes <= 0) {
-                    break;
+                const uint8_t *src;
+                int64_t bytes;
+                if (payload) {
+                    src = payload + inp_size - left;
+                    bytes = left;
+                } else {
+                    bytes = vfs.read(input_file, buf, left < 256 * 1024 ? left : 256 * 1024);
+                    if (bytes <= 0) {
+                        break;
+                    }
+                    src = buf;
                 }
                 offset = 0;
                 while (offset < bytes) {
                     SizeT sz_input = bytes - offset;
                     SizeT sz_output = 256 * 1024;
-                    ret = -LzmaDec_DecodeToBuf(&dec, buf_out, &sz_output, buf + offset, &sz_input, LZMA_FINISH_ANY, &status);
+                    ret = -LzmaDec_DecodeToBuf(dec, buf_out, &sz_output, src + offset, &sz_input, LZMA_FINISH_ANY, &status);
                     if (ret != SZ_OK) {
-                        LzmaDec_Free(&dec, &my_alloc);
+                        lzma_dec_release(dec);
                         goto end;
                     }
                     offset += sz_input;
                     if (sz_output == 0) {
                         break;
                     }
-                    vfs.write(fout, buf_out, sz_output);
+                    output_write(&out, buf_out, sz_output);
                     total += sz_output;
                     if (progress_cb) progress_cb(cb_opaque, total);
                 }
@@ -223,41 +1566,42 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
             if (status != LZMA_STATUS_FINISHED_WITH_MARK) {
                 SizeT sz_input = 0;
                 SizeT sz_output = 256 * 1024;
-                ret = -LzmaDec_DecodeToBuf(&dec, buf_out, &sz_output, NULL, &sz_input, LZMA_FINISH_END, &status);
+                ret = -LzmaDec_DecodeToBuf(dec, buf_out, &sz_output, NULL, &sz_input, LZMA_FINISH_END, &status);
                 if (ret == SZ_OK && sz_output != 0) {
-                    vfs.write(fout, buf_out, sz_output);
+                    output_write(&out, buf_out, sz_output);
                     total += sz_output;
                     if (progress_cb) progress_cb(cb_opaque, total);
                 }
             }
-            LzmaDec_Free(&dec, &my_alloc);
+            lzma_dec_release(dec);
             if (progress_cb) progress_cb(cb_opaque, -1);
         }
-        ret = 0;
+        ret = output_finish(&out);
         goto end;
     }
-    inp = malloc(inp_size);
-    if (!inp) {
-        if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
-        goto end;
-    }
-    if (vfs.read(input_file, inp, inp_size) < inp_size) {
-        ret = -2;
-        goto end;
-    }
-
     src_size = vfs.size(fsrc);
 
     xd3_init_config(&config, 0);
     config.winsize = 256 * 1024;
     config.getblk = sp_getblk;
-    config.opaque = &blkdata;
+    if (!xd3_arena) {
+        xd3_arena = arena_create(0);
+        if (!xd3_arena) {
+            if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+            goto end;
+        }
+    }
+    blk.arena = xd3_arena;
+    config.alloc = sp_alloc;
+    config.freef = sp_free;
+    config.opaque = &blk;
     ret = xd3_config_stream(&stream, &config);
     if (ret != 0) {
         if (message_cb) message_cb(cb_opaque, -1, "Error create stream!");
         goto end;
     }
-    source.blksize  = 256 * 1024;
+    /* one BCJ block per source block, so filtered blocks convert on their own */
+    source.blksize  = BCJ_BLOCK_SIZE;
     source.ioh = fsrc;
     ret = xd3_set_source(&stream, &source);
     if (ret != 0) {
@@ -265,16 +1609,46 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
         goto end;
     }
 
+    if (inp_size >= PIPELINE_MIN_SIZE && !pipeline_cpus) {
+        pipeline_cpus = thread_cpu_count();
+    }
+    if (inp_size >= PIPELINE_MIN_SIZE && pipeline_cpus > 1) {
+        if (info_cb) info_cb(cb_opaque, vfs.get_path(fout), -1, DIFF_TYPE_CHANGE_LZMA);
+        ret = run_change_pipeline(&stream, input_file, payload, inp_size,
+                                  type == DIFF_TYPE_CHANGE_LZMA ? PIPELINE_LZMA :
+                                  type == DIFF_TYPE_CHANGE_FAST ? PIPELINE_FAST : PIPELINE_RAW, &out);
+        if (ret == 0 && output_finish(&out) != 0) {
+            if (message_cb) message_cb(cb_opaque, -1, "Unable to write output file!");
+            ret = -1;
+        }
+        goto end;
+    }
+
+    if (payload) {
+        inp = (uint8_t*)payload;
+        inp_mapped = 1;
+    } else {
+        inp = malloc(inp_size);
+        if (!inp) {
+            if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+            ret = -1;
+            goto end;
+        }
+        if (vfs.read(input_file, inp, inp_size) < inp_size) {
+            ret = -2;
+            goto end;
+        }
+    }
+
+
 /*
     fprintf(stdout, "Source file size: %'lu\n", src_size);
     fprintf(stdout, "Input file size:  %'lu\n", inp_size);
 */
 
     if (type == 1) {
-        ELzmaStatus status;
-        ISzAlloc my_alloc = { SzAlloc, SzFree };
-        size_t orig_size = *(uint32_t*)(inp);
-        size_t comp_size = inp_size - LZMA_PROPS_SIZE - sizeof(uint32_t);
+        SizeT orig_size = *(uint32_t*)(inp);
+        SizeT comp_size = inp_size - LZMA_PROPS_SIZE - sizeof(uint32_t);
         uint8_t *old = inp;
         inp = malloc(orig_size);
         if (!inp) {
@@ -282,17 +1656,35 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
             if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
             goto end;
         }
-        if (LzmaDecode(inp, &orig_size,
-                       old + LZMA_PROPS_SIZE + sizeof(uint32_t), &comp_size,
-                       old + sizeof(uint32_t), LZMA_PROPS_SIZE,
-                       LZMA_FINISH_END, &status, &my_alloc) != SZ_OK) {
+        if (lzma_decode_buf(inp, &orig_size,
+                            old + LZMA_PROPS_SIZE + sizeof(uint32_t), &comp_size,
+                            old + sizeof(uint32_t)) != SZ_OK) {
             free(inp);
             inp = old;
             if (message_cb) message_cb(cb_opaque, -1, "Error decompress patch data!");
             goto end;
         }
         inp_size = orig_size;
-        free(old);
+        if (!inp_mapped) free(old);
+        inp_mapped = 0;
+    } else if (type == DIFF_TYPE_CHANGE_FAST) {
+        uint32_t orig_size = *(uint32_t*)(inp);
+        uint8_t *old = inp;
+        inp = malloc(orig_size);
+        if (!inp) {
+            inp = old;
+            if (message_cb) message_cb(cb_opaque, -1, "Out of memory!");
+            goto end;
+        }
+        if (fast_decode_buf(inp, orig_size, old + sizeof(uint32_t), inp_size - sizeof(uint32_t)) != 0) {
+            free(inp);
+            inp = old;
+            if (message_cb) message_cb(cb_opaque, -1, "Error decompress patch data!");
+            goto end;
+        }
+        inp_size = orig_size;
+        if (!inp_mapped) free(old);
+        inp_mapped = 0;
     }
     ipos = 0;
     n = xd3_min(stream.winsize, inp_size - ipos);
@@ -301,7 +1693,7 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
     ipos += n;
 
     total = 0;
-    if (info_cb) info_cb(cb_opaque, vfs.get_path(fout), -1, type);
+    if (info_cb) info_cb(cb_opaque, vfs.get_path(fout), -1, DIFF_TYPE_CHANGE_LZMA);
     if (progress_cb) progress_cb(cb_opaque, 0);
     data_size = stream.winsize;
     data = malloc(data_size);
@@ -312,14 +1704,20 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
             n = xd3_min(stream.winsize, inp_size - ipos);
             if (n == 0) {
                 if (progress_cb) progress_cb(cb_opaque, -1);
-                ret = 0; goto end;
+                ret = output_finish(&out);
+                if (ret != 0 && message_cb) message_cb(cb_opaque, -1, "Unable to write output file!");
+                goto end;
             }
             xd3_avail_input(&stream, inp + ipos, n);
             ipos += n;
             break;
         }
         case XD3_OUTPUT:
-            vfs.write(fout, stream.next_out, stream.avail_out);
+            if (output_write(&out, stream.next_out, stream.avail_out) != 0) {
+                if (message_cb) message_cb(cb_opaque, -1, "Unable to write output file!");
+                ret = -1;
+                goto end;
+            }
             total += stream.avail_out;
             if (progress_cb) progress_cb(cb_opaque, total);
             xd3_consume_output(&stream);
@@ -337,11 +1735,16 @@ int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, co
 
 end:
     xd3_close_stream(&stream);
+    xd3_free_stream(&stream);
+    if (xd3_arena) arena_reset(xd3_arena);
+    if (lzma_arena) arena_reset(lzma_arena);
     if (fout) vfs.close(fout);
     if (fsrc) vfs.close(fsrc);
-    if (inp) free(inp);
-    if (blkdata) free(blkdata);
+    if (inp && !inp_mapped) free(inp);
+    if (out.buf) free(out.buf);
     if (data) free(data);
+    if (ref_return >= 0) vfs.seek(input_file, ref_return, VFS_SEEK_POSITION_START);
+    if (!is_dir) lzma_dec_pool_free();
     if (bakpath[0] != 0) {
         if (ret == 0 || outpath[0] == 0) {
             vfs.remove(bakpath);
@@ -356,14 +1759,30 @@ end:
 
 int do_multi_patch(const char *src_path, struct vfs_file_handle *input_file, int64_t bytes_left, const char *output_path) {
     int64_t offset_end = vfs.tell(input_file) + bytes_left;
+    int ret = 0;
+    base_sections_seen = 0;
+    base_selected = 0;
+    free_name_table();
+    lzma_dec_pool_init();
+    dir_cache = dircache_create();
     while (vfs.tell(input_file) < offset_end) {
-        int ret = do_single_patch(input_file, src_path, output_path, 1);
+        ret = do_single_patch(input_file, src_path, output_path, 1);
         if (ret != 0) {
             if (ret == -2) {
-                break;
+                ret = 0;
             }
-            return ret;
+            break;
         }
     }
-    return 0;
+    free_name_table();
+    if (dir_cache) {
+        uint64_t requests, mkdirs;
+        dircache_stats(dir_cache, &requests, &mkdirs);
+        dir_requests += requests;
+        dir_mkdirs += mkdirs;
+        dircache_destroy(dir_cache);
+        dir_cache = NULL;
+    }
+    lzma_dec_pool_free();
+    return ret;
 }
@@ -2,6 +2,7 @@
 
 #include "vfs.h"
 #include <stdint.h>
+#include "patch_config.h"
 
 enum {
     DIFF_TYPE_CHANGE = 0,
@@ -9,6 +10,18 @@ enum {
     DIFF_TYPE_ADD_OR_REPLACE = 2,
     DIFF_TYPE_ADD_OR_REPLACE_LZMA = 3,
     DIFF_TYPE_DELETE = 4,
+    DIFF_TYPE_BASE = 5,
+    DIFF_TYPE_BLOB = 6,
+    DIFF_TYPE_ADD_REF = 7,
+    DIFF_TYPE_SOLID_LZMA = 8,
+    DIFF_TYPE_DIR_TABLE = 9,
+    DIFF_TYPE_CHANGE_FAST = 10,
+    DIFF_TYPE_ADD_OR_REPLACE_FAST = 11,
+    DIFF_TYPE_CHANGE_PRIMED_LZMA = 12,
+    DIFF_TYPE_FILTERED = 13,
+    DIFF_TYPE_CHANGE_SA_LZMA = 14,
+    DIFF_TYPE_ADD_CHUNKS = 15,
+    DIFF_TYPE_ADD_CHUNKS_LZMA = 16,
 };
 
 typedef void (*info_callback_t)(void *opaque, const char *filename, int64_t file_size, int diff_type);
@@ -19,5 +32,20 @@ extern void set_callback_opaque(void *opaque);
 extern void set_info_callback(info_callback_t cb);
 extern void set_progress_callback(progress_callback_t cb);
 extern void set_message_callback(message_callback_t cb);
+/* Allocations made through the LZMA allocator while patching */
+extern void get_lzma_alloc_stats(uint64_t *count, uint64_t *bytes);
+/* Arena requests and how many of them needed a system allocation: [0] LZMA decoders, [1] xdelta3 decoder */
+extern void get_arena_stats(uint64_t requests[2], uint64_t mallocs[2]);
+/* CHANGE pipeline counters per stage (read+LZMA, xdelta, write): bytes out, time blocked on a neighbour, total wall time */
+extern void get_pipeline_stats(uint64_t bytes[3], uint64_t stall_usec[3], uint64_t *wall_usec);
+/* Directory ensure requests made while patching, and how many of them reached vfs.mkdir */
+extern void get_dir_stats(uint64_t *requests, uint64_t *mkdirs);
+/* Reads the patch_config_t at config_offset. Version 0 configs hold only format_version and get payload_align 0.
+ * Returns 0 on success, -1 if the config cannot be read, -2 if format_version is newer than SPATCH_FORMAT_VERSION */
+extern int read_patch_config(struct vfs_file_handle *input_file, int64_t config_offset, patch_config_t *config);
+/* Payload alignment recorded in patch_config_t, 0 for the packed layout */
+extern void set_payload_alignment(uint32_t align);
+/* Optional read-only mapping of the whole patch file, payloads are then decoded in place */
+extern void set_patch_mapping(const void *data, int64_t size);
 extern int do_single_patch(struct vfs_file_handle *input_file, const char *src_path, const char *output_path, int is_dir);
 extern int do_multi_patch(const char *src_path, struct vfs_file_handle *input_file, int64_t bytes_left, const char *output_path);
@@ -4,6 +4,7 @@
 #include "util.h"
 #include <stdio.h>
 #include <stdarg.h>
+#include <inttypes.h>
 #include <locale.h>
 
 static char output_prefix[1024] = {0};
@@ -21,9 +22,9 @@ void progress_callback(void *opaque, int64_t progress) {
         return;
     }
     if (total_file_size > 0) {
-        fprintf(stdout, "\r%s: %llu/%llu", output_prefix, progress, total_file_size);
+        fprintf(stdout, "\r%s: %" PRId64 "/%" PRId64, output_prefix, progress, total_file_size);
     } else {
-        fprintf(stdout, "\r%s: %llu", output_prefix, progress);
+        fprintf(stdout, "\r%s: %" PRId64, output_prefix, progress);
     }
 }
 
@@ -44,6 +45,8 @@ int main(int argc, char *argv[]) {
     int64_t patch_offset = 0, config_offset = 0;
     uint64_t tag = 0;
     int64_t bytes_left = 0;
+    void *patch_map = NULL;
+    int64_t patch_map_size = 0;
     setlocale(LC_NUMERIC, "");
     switch (argc) {
     case 0:
@@ -85,11 +88,21 @@ int main(int argc, char *argv[]) {
     }
     if (config_offset > 0) {
         patch_config_t patch_config;
-        vfs.seek(input_file, config_offset, VFS_SEEK_POSITION_START);
-        if (vfs.read(input_file, &patch_config, sizeof(patch_config_t)) != sizeof(patch_config_t)
-            || patch_config.format_version != SPATCH_FORMAT_VERSION) {
+        int res = read_patch_config(input_file, config_offset, &patch_config);
+        if (res == -2) {
+            fprintf(stderr, "Unsupported patch version %u, this spatcher reads up to version %u!\n",
+                    patch_config.format_version, SPATCH_FORMAT_VERSION);
             ret = -1;
             goto end;
+        } else if (res != 0) {
+            fprintf(stderr, "Unable to read patch config!\n");
+            ret = -1;
+            goto end;
+        }
+        if (patch_config.payload_align > 0) {
+            set_payload_alignment(patch_config.payload_align);
+            patch_map = util_map_file(input_path, &patch_map_size);
+            if (patch_map) set_patch_mapping(patch_map, patch_map_size);
         }
     }
     vfs.seek(input_file, patch_offset, VFS_SEEK_POSITION_START);
@@ -104,8 +117,41 @@ int main(int argc, char *argv[]) {
     } else {
         ret = do_single_patch(input_file, src_path, output_path, is_dir);
     }
+    {
+        uint64_t requests, mkdirs, allocs, alloc_bytes;
+        uint64_t stage_bytes[3], stage_stall[3], wall;
+        uint64_t arena_requests[2], arena_mallocs[2];
+        get_lzma_alloc_stats(&allocs, &alloc_bytes);
+        get_arena_stats(arena_requests, arena_mallocs);
+        if (allocs > 0) {
+            fprintf(stdout, "LZMA allocations: %'llu (%'llu bytes), %'llu from the system\n", (unsigned long long)allocs,
+                    (unsigned long long)alloc_bytes, (unsigned long long)arena_mallocs[0]);
+        }
+        if (arena_requests[1] > 0) {
+            fprintf(stdout, "xdelta allocations: %'llu, %'llu from the system\n", (unsigned long long)arena_requests[1],
+                    (unsigned long long)arena_mallocs[1]);
+        }
+        get_dir_stats(&requests, &mkdirs);
+        if (requests > 0) {
+            fprintf(stdout, "Directories: %'llu ensure request(s), %'llu mkdir call(s), %'llu skipped by cache\n",
+                    (unsigned long long)requests, (unsigned long long)mkdirs, (unsigned long long)(requests - mkdirs));
+        }
+        get_pipeline_stats(stage_bytes, stage_stall, &wall);
+        if (wall > 0) {
+            static const char *stage_names[3] = { "read+LZMA", "xdelta", "write" };
+            int i;
+            fprintf(stdout, "Pipeline: %'llu ms\n", (unsigned long long)(wall / 1000));
+            for (i = 0; i < 3; ++i) {
+                uint64_t busy = wall > stage_stall[i] ? wall - stage_stall[i] : 1;
+                fprintf(stdout, "  %-10s %'llu bytes, stalled %'llu ms, %'llu MB/s while busy\n", stage_names[i],
+                        (unsigned long long)stage_bytes[i], (unsigned long long)(stage_stall[i] / 1000),
+                        (unsigned long long)(stage_bytes[i] / busy));
+            }
+        }
+    }
 
 end:
+    if (patch_map) util_unmap_file(patch_map, patch_map_size);
     if (input_file) vfs.close(input_file);
 
     return ret;
@@ -63,6 +63,8 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     char exepath[1024];
     int i, dirname_length;
     struct callback_context ctx;
+    void *patch_map = NULL;
+    int64_t patch_map_size = 0;
 
     wai_getExecutablePath(exepath, 1024, &dirname_length);
     i = dirname_length;
@@ -78,12 +80,18 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     if (tag == 0xBADC0DEDEADBEEFULL) {
         if (config_offset > 0) {
             patch_config_t patch_config;
-            vfs.seek(input_file, config_offset, VFS_SEEK_POSITION_START);
-            if (vfs.read(input_file, &patch_config, sizeof(patch_config_t)) != sizeof(patch_config_t)
-                || patch_config.format_version != SPATCH_FORMAT_VERSION) {
+            int res = read_patch_config(input_file, config_offset, &patch_config);
+            if (res != 0) {
+                MessageBoxA(NULL, res == -2 ? "Unsupported patch version, a newer patcher is required."
+                                            : "Unable to read patch config.", "spatcher", MB_OK | MB_ICONERROR);
                 ret = -1;
                 goto end;
             }
+            if (patch_config.payload_align > 0) {
+                set_payload_alignment(patch_config.payload_align);
+                patch_map = util_map_file(exepath, &patch_map_size);
+                if (patch_map) set_patch_mapping(patch_map, patch_map_size);
+            }
         }
         ctx.input_file = input_file;
         ctx.bytes_left = config_offset > 0 ?
@@ -104,6 +112,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
     }
 
 end:
+    if (patch_map) util_unmap_file(patch_map, patch_map_size);
     if (input_file) vfs.close(input_file);
 
     return ret;
@@ -395,6 +395,32 @@ xd3_decode_instruction (xd3_stream *stream)
   return 0;
 }
 
+/* Copy from earlier in the target window, dst > src.  If the ranges
+ * overlap the output repeats the (dst - src) bytes before dst, and each
+ * memcpy doubles the repeated prefix the next one can read from, so a
+ * short period costs log2(take / period) calls instead of a byte loop. */
+static inline void
+xd3_decode_copy_target (uint8_t *dst, const uint8_t *src, usize_t take)
+{
+  usize_t dist = (usize_t) (dst - src);
+
+  if (dist == 1)
+    {
+      memset (dst, *src, take);
+      return;
+    }
+
+  while (take > dist)
+    {
+      memcpy (dst, src, dist);
+      dst += dist;
+      take -= dist;
+      dist += dist;
+    }
+
+  memcpy (dst, src, take);
+}
+
 /* Output the result of a single half-instruction. OPT: This the
    decoder hotspot.  Modifies "hinst", see below.  */
 static int
@@ -455,7 +481,6 @@ xd3_decode_output_halfinst (xd3_stream *stream, xd3_hinst *inst)
       }
     default:
       {
-	usize_t i;
 	const uint8_t *src;
 	uint8_t *dst;
 	int overlap;
@@ -557,10 +582,6 @@ xd3_decode_output_halfinst (xd3_stream *stream, xd3_hinst *inst)
 	  }
 	else
 	  {
-	    /* TODO: the memcpy/overlap optimization, etc.  Overlap
-	     * here could be more specific, it's whether (inst->addr -
-	     * srclen) + inst->size > input_pos ?  And is the system
-	     * memcpy really any good? */
 	    overlap = 1;
 
 	    /* For a target-window copy, we know the entire range is
@@ -578,11 +599,7 @@ xd3_decode_output_halfinst (xd3_stream *stream, xd3_hinst *inst)
 
 	if (overlap)
 	  {
-	    /* Can't just memcpy here due to possible overlap. */
-	    for (i = take; i != 0; i -= 1)
-	      {
-		*dst++ = *src++;
-	      }
+	    xd3_decode_copy_target (dst, src, take);
 	  }
 	else
 	  {
@@ -594,6 +611,125 @@ xd3_decode_output_halfinst (xd3_stream *stream, xd3_hinst *inst)
   return 0;
 }
 
+/* Source bytes of a VCD_SOURCE copy if all of it lies in the source
+ * block already loaded, otherwise NULL. */
+static inline const uint8_t*
+xd3_decode_source_inmem (xd3_stream *stream, const xd3_hinst *inst)
+{
+  xd3_source *source = stream->src;
+  xoff_t block;
+  usize_t blkoff;
+
+  if ((stream->dec_win_ind & VCD_TARGET) || source->curblk == NULL)
+    {
+      return NULL;
+    }
+
+  block = source->cpyoff_blocks;
+  blkoff = source->cpyoff_blkoff;
+  xd3_blksize_add (&block, &blkoff, source, inst->addr);
+
+  if (block != source->curblkno || blkoff + inst->size > source->onblk)
+    {
+      return NULL;
+    }
+
+  return source->curblk + blkoff;
+}
+
+/* Non-reentrant fast path of xd3_decode_emit: decodes and outputs
+ * instructions back to back while both halves can finish from memory,
+ * which is every ADD, RUN and target copy and the source copies inside
+ * the loaded block.  The first instruction that needs another source
+ * block is left in dec_current1/2 for xd3_decode_output_halfinst. */
+static int
+xd3_decode_emit_batch (xd3_stream *stream)
+{
+  int ret;
+
+  while (stream->inst_sect.buf != stream->inst_sect.buf_max)
+    {
+      xd3_hinst *half[2];
+      const uint8_t *src[2];
+      int i;
+
+      if ((ret = xd3_decode_instruction (stream))) { return ret; }
+
+      half[0] = & stream->dec_current1;
+      half[1] = & stream->dec_current2;
+
+      for (i = 0; i < 2; i += 1)
+	{
+	  src[i] = NULL;
+
+	  if (half[i]->type >= XD3_CPY &&
+	      half[i]->addr < stream->dec_cpylen &&
+	      (src[i] = xd3_decode_source_inmem (stream, half[i])) == NULL)
+	    {
+	      return 0;
+	    }
+	}
+
+      for (i = 0; i < 2; i += 1)
+	{
+	  xd3_hinst *inst = half[i];
+	  usize_t take = inst->size;
+	  uint8_t *dst = stream->next_out + stream->avail_out;
+
+	  if (inst->type == XD3_NOOP)
+	    {
+	      continue;
+	    }
+
+	  if (USIZE_T_OVERFLOW (stream->avail_out, take) ||
+	      stream->avail_out + take > stream->space_out)
+	    {
+	      stream->msg = "overflow while decoding";
+	      return XD3_INVALID_INPUT;
+	    }
+
+	  switch (inst->type)
+	    {
+	    case XD3_RUN:
+	      if (stream->data_sect.buf == stream->data_sect.buf_max)
+		{
+		  stream->msg = "data underflow";
+		  return XD3_INVALID_INPUT;
+		}
+
+	      memset (dst, stream->data_sect.buf[0], take);
+	      stream->data_sect.buf += 1;
+	      break;
+	    case XD3_ADD:
+	      if (stream->data_sect.buf + take > stream->data_sect.buf_max)
+		{
+		  stream->msg = "data underflow";
+		  return XD3_INVALID_INPUT;
+		}
+
+	      memcpy (dst, stream->data_sect.buf, take);
+	      stream->data_sect.buf += take;
+	      break;
+	    default:
+	      if (src[i] != NULL)
+		{
+		  memcpy (dst, src[i], take);
+		}
+	      else
+		{
+		  xd3_decode_copy_target (dst, stream->dec_tgtaddrbase +
+					  inst->addr, take);
+		}
+	    }
+
+	  stream->avail_out += take;
+	  inst->type = XD3_NOOP;
+	}
+    }
+
+  return 0;
+}
+
 static int
 xd3_decode_finish_window (xd3_stream *stream)
 {
@@ -745,10 +881,11 @@ xd3_decode_emit (xd3_stream *stream)
 	 stream->dec_current1.type != XD3_NOOP ||
 	 stream->dec_current2.type != XD3_NOOP)
     {
-      /* Decode next instruction pair. */
+      /* Decode next instruction pairs, all of them unless one needs a
+       * source block that is not loaded. */
       if ((stream->dec_current1.type == XD3_NOOP) &&
 	  (stream->dec_current2.type == XD3_NOOP) &&
-	  (ret = xd3_decode_instruction (stream))) { return ret; }
+	  (ret = xd3_decode_emit_batch (stream))) { return ret; }
 
       /* Output dec_current1 */
       while ((stream->dec_current1.type != XD3_NOOP))
@@ -106,15 +106,16 @@ static fgk_stream*     fgk_alloc           (xd3_stream *stream /*, usize_t alpha
 static int             fgk_init            (xd3_stream *stream,
 					    fgk_stream *h, 
 					    int is_encode);
+#if XD3_ENCODER
 static usize_t         fgk_encode_data     (fgk_stream *h,
 					    usize_t    n);
 static inline fgk_bit  fgk_get_encoded_bit (fgk_stream *h);
-
 static int             xd3_encode_fgk      (xd3_stream  *stream,
 					    fgk_stream  *sec_stream,
 					    xd3_output  *input,
 					    xd3_output  *output,
 					    xd3_sec_cfg *cfg);
+#endif
 
 /*********************************************************************/
 /* 			       Decoder                               */
@@ -137,7 +138,9 @@ static int             xd3_decode_fgk      (xd3_stream     *stream,
 /* 			       Private                               */
 /*********************************************************************/
 
+#if XD3_ENCODER
 static unsigned int fgk_find_nth_zero        (fgk_stream *h, usize_t n);
+#endif
 static usize_t      fgk_nth_zero             (fgk_stream *h, usize_t n);
 static void         fgk_update_tree          (fgk_stream *h, usize_t n);
 static fgk_node*    fgk_increase_zero_weight (fgk_stream *h, usize_t n);
@@ -229,6 +232,7 @@ static void fgk_swap_ptrs(fgk_node **one, fgk_node **two)
   *two = tmp;
 }
 
+#if XD3_ENCODER
 /* Takes huffman transmitter h and n, the nth elt in the alphabet, and
  * returns the number of required to encode n. */
 static usize_t fgk_encode_data (fgk_stream* h, usize_t n)
@@ -297,6 +301,7 @@ static inline fgk_bit fgk_get_encoded_bit (fgk_stream *h)
 
   return h->coded_bits[--h->coded_depth];
 }
+#endif /* XD3_ENCODER */
 
 /* This procedure updates the tree after alphabet[n] has been encoded
  * or decoded.
@@ -541,6 +546,7 @@ static fgk_node* fgk_increase_zero_weight (fgk_stream *h, usize_t n)
   return this_zero;
 }
 
+#if XD3_ENCODER
 /* When a zero frequency element is encoded, it is followed by the
  * binary representation of the index into the remaining elements.
  * Sets a cache to the element before it so that it can be removed
@@ -559,6 +565,7 @@ static unsigned int fgk_find_nth_zero (fgk_stream* h, usize_t n)
 
   return idx;
 }
+#endif /* XD3_ENCODER */
 
 /* Splices node out of the list of zeros. */
 static void fgk_eliminate_zero (fgk_stream* h, fgk_node *node)
@@ -780,6 +787,7 @@ static void fgk_destroy (xd3_stream *stream,
 /* 			       Xdelta                                */
 /*********************************************************************/
 
+#if XD3_ENCODER
 static int
 xd3_encode_fgk (xd3_stream *stream, fgk_stream *sec_stream, xd3_output *input, xd3_output *output, xd3_sec_cfg *cfg)
 {
@@ -787,6 +795,10 @@ xd3_encode_fgk (xd3_stream *stream, fgk_stream *sec_stream, xd3_output *input, x
   xd3_output *cur_page;
   int ret;
 
+  /* Start every section from an empty tree: the secondary encoder may
+   * throw this output away, and then the decoder never sees it */
+  fgk_init (stream, sec_stream, 1);
+
   /* OPT: quit compression early if it looks bad */
   for (cur_page = input; cur_page; cur_page = cur_page->next_page)
     {
@@ -806,6 +818,7 @@ xd3_encode_fgk (xd3_stream *stream, fgk_stream *sec_stream, xd3_output *input, x
 
   return xd3_flush_bits (stream, & output, & bstate);
 }
+#endif /* XD3_ENCODER */
 
 static int
 xd3_decode_fgk (xd3_stream     *stream,
@@ -819,6 +832,8 @@ xd3_decode_fgk (xd3_stream     *stream,
   uint8_t *output = *output_pos;
   const uint8_t *input = *input_pos;
 
+  fgk_init (stream, sec_stream, 0);
+
   for (;;)
     {
       if (input == input_max)
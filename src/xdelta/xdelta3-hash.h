@@ -106,6 +106,39 @@ xd3_large64_cksum_update (xd3_hash_cfg *cfg, const uint64_t cksum,
 }
 #endif
 
+#if XD3_ENCODER
+#define XD3_CKSUM_BATCH 4
+
+/* Large checksums of the XD3_CKSUM_BATCH windows starting at base,
+ * base - step, base - 2*step, ...  Sharing each power between the
+ * windows and keeping independent sums lets the multiplies overlap,
+ * where xd3_large_cksum is one long dependency chain. */
+static inline void
+xd3_large_cksum_batch (xd3_hash_cfg *cfg, const uint8_t *base,
+		       const usize_t look, const usize_t step,
+		       usize_t *cksums)
+{
+  const uint8_t *b1 = base - step;
+  const uint8_t *b2 = b1 - step;
+  const uint8_t *b3 = b2 - step;
+  usize_t h0 = 0, h1 = 0, h2 = 0, h3 = 0;
+
+  for (usize_t i = 0; i < look; i++)
+    {
+      usize_t p = cfg->powers[i];
+      h0 += base[i] * p;
+      h1 += b1[i] * p;
+      h2 += b2[i] * p;
+      h3 += b3[i] * p;
+    }
+
+  cksums[0] = h0;
+  cksums[1] = h1;
+  cksums[2] = h2;
+  cksums[3] = h3;
+}
+#endif
+
 static usize_t
 xd3_size_hashtable_bits (usize_t slots)
 {
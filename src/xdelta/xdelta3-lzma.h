@@ -14,71 +14,99 @@
    limitations under the License.
 */
 
-/* Note: The use of the _easy_ decoder means we're not calling the
- * xd3_stream malloc hooks.  TODO(jmacd) Fix if anyone cares. */
+/* LZMA secondary compression on the LZMA SDK.  Every section is an
+ * independent raw LZMA stream (5 property bytes, no end marker, the
+ * decoded size comes from the section header), so windows can be
+ * skipped or encoded by separate streams (XD3_NOHEADER ranges) and each
+ * section is kept only when it pays off.  Coder memory goes through the
+ * xd3_stream allocation hooks. */
 
 #ifndef _XDELTA3_LZMA_H_
 #define _XDELTA3_LZMA_H_
 
-#include <lzma.h>
+#include "LzmaDec.h"
+#if XD3_ENCODER
+#include "LzmaEnc.h"
+#endif
 
 typedef struct _xd3_lzma_stream xd3_lzma_stream;
 
 struct _xd3_lzma_stream {
-  lzma_stream lzma;
-  lzma_options_lzma options;
-  lzma_filter filters[2];
+  ISzAlloc      alloc;  /* first, the ISzAlloc callbacks cast back to it */
+  xd3_stream   *stream;
+  CLzmaDec      dec;
+#if XD3_ENCODER
+  CLzmaEncHandle enc;
+#endif
 };
 
-static xd3_sec_stream* 
-xd3_lzma_alloc (xd3_stream *stream)
+static void*
+xd3_lzma_sz_alloc (ISzAllocPtr p, size_t size)
 {
-  return (xd3_sec_stream*) xd3_alloc (stream, sizeof (xd3_lzma_stream), 1);
+  xd3_lzma_stream *ls = (xd3_lzma_stream*) p;
+  return xd3_alloc (ls->stream, (usize_t) size, 1);
 }
 
 static void
-xd3_lzma_destroy (xd3_stream *stream, xd3_sec_stream *sec_stream)
+xd3_lzma_sz_free (ISzAllocPtr p, void *address)
 {
-  xd3_lzma_stream *ls = (xd3_lzma_stream*) sec_stream;
-  lzma_end (&ls->lzma);
-  xd3_free (stream, ls);
+  xd3_lzma_stream *ls = (xd3_lzma_stream*) p;
+  xd3_free (ls->stream, address);
 }
 
-static int
-xd3_lzma_init (xd3_stream *stream, xd3_lzma_stream *sec, int is_encode)
+static xd3_sec_stream*
+xd3_lzma_alloc (xd3_stream *stream)
 {
-  int ret;
+  xd3_lzma_stream *ls =
+    (xd3_lzma_stream*) xd3_alloc (stream, sizeof (xd3_lzma_stream), 1);
 
-  memset (&sec->lzma, 0, sizeof(sec->lzma));
-
-  if (is_encode)
+  if (ls != NULL)
     {
-      uint32_t preset = 
-	(stream->flags & XD3_COMPLEVEL_MASK) >> XD3_COMPLEVEL_SHIFT;
+      memset (ls, 0, sizeof (xd3_lzma_stream));
+      ls->alloc.Alloc = xd3_lzma_sz_alloc;
+      ls->alloc.Free = xd3_lzma_sz_free;
+      ls->stream = stream;
+      LzmaDec_Construct (&ls->dec);
+    }
 
-      if (lzma_lzma_preset(&sec->options, preset)) 
-	{
-	  stream->msg = "invalid lzma preset";
-	  return XD3_INVALID;
-	}
+  return (xd3_sec_stream*) ls;
+}
 
-      sec->filters[0].id = LZMA_FILTER_LZMA2;
-      sec->filters[0].options = &sec->options;
-      sec->filters[1].id = LZMA_VLI_UNKNOWN;
+static void
+xd3_lzma_destroy (xd3_stream *stream, xd3_sec_stream *sec_stream)
+{
+  xd3_lzma_stream *ls = (xd3_lzma_stream*) sec_stream;
 
-      ret = lzma_stream_encoder (&sec->lzma, &sec->filters[0], LZMA_CHECK_NONE);
+  if (ls == NULL)
+    {
+      return;
     }
-  else 
+
+  LzmaDec_FreeProbs (&ls->dec, &ls->alloc);
+#if XD3_ENCODER
+  if (ls->enc != NULL)
     {
-      ret = lzma_stream_decoder (&sec->lzma, UINT64_MAX, LZMA_TELL_NO_CHECK);
+      LzmaEnc_Destroy (ls->enc, &ls->alloc, &ls->alloc);
     }
-  
-  if (ret != LZMA_OK)
+#endif
+  xd3_free (stream, ls);
+}
+
+static int
+xd3_lzma_init (xd3_stream *stream, xd3_lzma_stream *sec, int is_encode)
+{
+#if XD3_ENCODER
+  if (is_encode && sec->enc == NULL &&
+      (sec->enc = LzmaEnc_Create (&sec->alloc)) == NULL)
     {
       stream->msg = "lzma stream init failed";
-      return XD3_INTERNAL;
+      return ENOMEM;
     }
-
+#else
+  (void) stream;
+  (void) sec;
+  (void) is_encode;
+#endif
   return 0;
 }
 
@@ -88,103 +116,159 @@ static int xd3_decode_lzma (xd3_stream *stream, xd3_lzma_stream *sec,
 		     uint8_t       **output_pos,
 		     const uint8_t  *const output_end)
 {
-  uint8_t *output = *output_pos;
   const uint8_t *input = *input_pos;
-  size_t avail_in = input_end - input;
-  size_t avail_out = output_end - output;
-
-  sec->lzma.avail_in = avail_in;
-  sec->lzma.next_in = input;
-  sec->lzma.avail_out = avail_out;
-  sec->lzma.next_out = output;
-  
-  while (1) 
+  SizeT avail_in;
+  SizeT avail_out = output_end - *output_pos;
+  ELzmaStatus status;
+  SRes res;
+
+  if (input_end - input < LZMA_PROPS_SIZE ||
+      LzmaDec_AllocateProbs (&sec->dec, input, LZMA_PROPS_SIZE,
+			     &sec->alloc) != SZ_OK)
+    {
+      stream->msg = "lzma invalid properties";
+      return XD3_INVALID_INPUT;
+    }
+
+  input += LZMA_PROPS_SIZE;
+  avail_in = input_end - input;
+
+  /* Decode straight into the section buffer, it is not ours to free */
+  sec->dec.dic = *output_pos;
+  sec->dec.dicBufSize = avail_out;
+  LzmaDec_Init (&sec->dec);
+  res = LzmaDec_DecodeToDic (&sec->dec, avail_out, input, &avail_in,
+			     LZMA_FINISH_END, &status);
+  sec->dec.dic = NULL;
+
+  if (res != SZ_OK || sec->dec.dicPos != avail_out)
+    {
+      stream->msg = "lzma decoding error";
+      return XD3_INVALID_INPUT;
+    }
+
+  /* Whatever the decoder did not read is the range coder flush */
+  (*input_pos) = input_end;
+  (*output_pos) += avail_out;
+  return 0;
+}
+
+#if XD3_ENCODER
+
+typedef struct
+{
+  ISeqInStream  vt;
+  xd3_output   *page;
+  usize_t       pos;
+} xd3_lzma_in;
+
+typedef struct
+{
+  ISeqOutStream vt;
+  xd3_stream   *stream;
+  xd3_output   *output;
+  int           ret;
+} xd3_lzma_out;
+
+static SRes
+xd3_lzma_read (const ISeqInStream *p, void *buf, size_t *size)
+{
+  xd3_lzma_in *in = (xd3_lzma_in*) p;
+  size_t done = 0;
+
+  while (in->page != NULL && done < *size)
     {
-      int lret = lzma_code (&sec->lzma, LZMA_RUN);
+      usize_t take = xd3_min (in->page->next - in->pos,
+			      (usize_t) (*size - done));
+
+      memcpy ((uint8_t*) buf + done, in->page->base + in->pos, take);
+      done += take;
+      in->pos += take;
 
-      switch (lret)
+      if (in->pos == in->page->next)
 	{
-	case LZMA_NO_CHECK: 
-	case LZMA_OK:
-	  if (sec->lzma.avail_out == 0) 
-	    {
-	      (*output_pos) = sec->lzma.next_out;
-	      (*input_pos) = sec->lzma.next_in;
-	      return 0;
-	    }
-	  break;
-
-	default:
-	  stream->msg = "lzma decoding error";
-	  return XD3_INTERNAL;
+	  in->page = in->page->next_page;
+	  in->pos = 0;
 	}
     }
+
+  *size = done;
+  return SZ_OK;
 }
 
-#if XD3_ENCODER
+static size_t
+xd3_lzma_write (const ISeqOutStream *p, const void *buf, size_t size)
+{
+  xd3_lzma_out *out = (xd3_lzma_out*) p;
+
+  if ((out->ret = xd3_emit_bytes (out->stream, &out->output,
+				  (const uint8_t*) buf, (usize_t) size)) != 0)
+    {
+      return 0;
+    }
 
-static int xd3_encode_lzma (xd3_stream *stream, 
-		     xd3_lzma_stream *sec, 
+  return size;
+}
+
+static int xd3_encode_lzma (xd3_stream *stream,
+		     xd3_lzma_stream *sec,
 		     xd3_output   *input,
 		     xd3_output   *output,
 		     xd3_sec_cfg  *cfg)
 
 {
-  lzma_action action = LZMA_RUN;
-
-  cfg->inefficient = 1;  /* Can't skip windows */
-  sec->lzma.next_in = NULL;
-  sec->lzma.avail_in = 0;
-  sec->lzma.next_out = (output->base + output->next);
-  sec->lzma.avail_out = (output->avail - output->next);
+  CLzmaEncProps props;
+  xd3_lzma_in in;
+  xd3_lzma_out out;
+  Byte header[LZMA_PROPS_SIZE];
+  SizeT header_size = LZMA_PROPS_SIZE;
+  int level = cfg->level;
+  int ret;
 
-  while (1)
+  if (level == 0)
     {
-      int lret;
-	  size_t nwrite;
-      if (sec->lzma.avail_in == 0 && input != NULL)
-	{
-	  sec->lzma.avail_in = input->next;
-	  sec->lzma.next_in = input->base;
-	  
-	  if ((input = input->next_page) == NULL)
-	    {
-	      action = LZMA_SYNC_FLUSH;
-	    }
-	}
+      level = (stream->flags & XD3_COMPLEVEL_MASK) >> XD3_COMPLEVEL_SHIFT;
+    }
 
-      lret = lzma_code (&sec->lzma, action);
+  LzmaEncProps_Init (&props);
+  props.level = level;
+  props.reduceSize = xd3_sizeof_output (input);
+  props.writeEndMark = 0;
+  /* Sections are byte streams (added bytes, varint instructions and
+   * addresses) with no 4-byte alignment to model */
+  props.pb = 0;
+
+  in.vt.Read = xd3_lzma_read;
+  in.page = input;
+  in.pos = 0;
+  out.vt.Write = xd3_lzma_write;
+  out.stream = stream;
+  out.output = output;
+  out.ret = 0;
+
+  if (LzmaEnc_SetProps (sec->enc, &props) != SZ_OK ||
+      LzmaEnc_WriteProperties (sec->enc, header, &header_size) != SZ_OK)
+    {
+      stream->msg = "invalid lzma properties";
+      return XD3_INTERNAL;
+    }
 
-      nwrite = (output->avail - output->next) - sec->lzma.avail_out;
+  if ((ret = xd3_emit_bytes (stream, &out.output, header,
+			     (usize_t) header_size)) != 0)
+    {
+      return ret;
+    }
 
-      if (nwrite != 0) 
+  if (LzmaEnc_Encode (sec->enc, &out.vt, &in.vt, NULL,
+		      &sec->alloc, &sec->alloc) != SZ_OK)
+    {
+      if (out.ret != 0)
 	{
-	  output->next += nwrite;
-
-	  if (output->next == output->avail)
-	    {
-	      if ((output = xd3_alloc_output (stream, output)) == NULL)
-		{
-		  return ENOMEM;
-		}
-	      
-	      sec->lzma.next_out = output->base;
-	      sec->lzma.avail_out = output->avail;
-	    }
+	  return out.ret;
 	}
 
-      switch (lret)
-	{
-	case LZMA_OK:
-	  break;
-
-	case LZMA_STREAM_END:
-	  return 0;
-
-	default:
-	  stream->msg = "lzma encoding error";
-	  return XD3_INTERNAL;
-	}
+      stream->msg = "lzma encoding error";
+      return XD3_INTERNAL;
     }
 
   return 0;
@@ -0,0 +1,333 @@
+/* xdelta3 - delta compression tools and library
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/* Match extension for xd3_source_extend_match().  xd3_forward_match
+ * counts the equal bytes at the start of two strings,
+ * xd3_backward_match the equal bytes immediately before two end
+ * pointers.  Both are function pointers bound on first use to the
+ * widest implementation the running CPU supports: AVX2 or SSE2 on x86,
+ * NEON on ARM, otherwise the portable code. */
+
+#ifndef _XDELTA3_MATCH_H_
+#define _XDELTA3_MATCH_H_
+
+#if XD3_ENCODER
+
+typedef usize_t (xd3_match_func) (const uint8_t *s1,
+				  const uint8_t *s2,
+				  usize_t n);
+
+static usize_t
+xd3_forward_match_scalar (const uint8_t *s1c, const uint8_t *s2c, usize_t n)
+{
+  usize_t i = 0;
+#if UNALIGNED_OK
+  usize_t nint = n / sizeof(int);
+
+  if (nint >> 3)
+    {
+      usize_t j = 0;
+      const int *s1 = (const int*)s1c;
+      const int *s2 = (const int*)s2c;
+      usize_t nint_8 = nint - 8;
+
+      while (i <= nint_8 &&
+	     s1[i++] == s2[j++] &&
+	     s1[i++] == s2[j++] &&
+	     s1[i++] == s2[j++] &&
+	     s1[i++] == s2[j++] &&
+	     s1[i++] == s2[j++] &&
+	     s1[i++] == s2[j++] &&
+	     s1[i++] == s2[j++] &&
+	     s1[i++] == s2[j++]) { }
+
+      i = (i - 1) * sizeof(int);
+    }
+#endif
+
+  while (i < n && s1c[i] == s2c[i])
+    {
+      i++;
+    }
+  return i;
+}
+
+/* Here s1 and s2 point one past the last bytes compared. */
+static usize_t
+xd3_backward_match_scalar (const uint8_t *s1, const uint8_t *s2, usize_t n)
+{
+  usize_t i = 0;
+
+  while (i < n && *--s1 == *--s2)
+    {
+      i++;
+    }
+  return i;
+}
+
+#if XD3_SIMD_SSE2
+static usize_t
+xd3_forward_match_sse2 (const uint8_t *s1, const uint8_t *s2, usize_t n)
+{
+  usize_t i = 0;
+
+  for (; n - i >= 16; i += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i*) (s1 + i));
+      __m128i b = _mm_loadu_si128 ((const __m128i*) (s2 + i));
+      uint32_t diff = (uint32_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (a, b)) ^ 0xffff;
+
+      if (diff != 0)
+	{
+	  return i + xd3_ctz32 (diff);
+	}
+    }
+
+  while (i < n && s1[i] == s2[i])
+    {
+      i++;
+    }
+  return i;
+}
+
+static usize_t
+xd3_backward_match_sse2 (const uint8_t *s1, const uint8_t *s2, usize_t n)
+{
+  usize_t i = 0;
+
+  for (; n - i >= 16; i += 16)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i*) (s1 - i - 16));
+      __m128i b = _mm_loadu_si128 ((const __m128i*) (s2 - i - 16));
+      uint32_t diff = (uint32_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (a, b)) ^ 0xffff;
+
+      if (diff != 0)
+	{
+	  return i + xd3_clz32 (diff) - 16;
+	}
+    }
+
+  return i + xd3_backward_match_scalar (s1 - i, s2 - i, n - i);
+}
+#endif
+
+#if XD3_SIMD_AVX2
+/* Two vectors per iteration, then single 32- and 16-byte steps.  The
+ * tails stay in this function: calling the SSE2 code with dirty upper
+ * YMM halves costs more than the comparison itself. */
+XD3_TARGET_AVX2 static usize_t
+xd3_forward_match_avx2 (const uint8_t *s1, const uint8_t *s2, usize_t n)
+{
+  usize_t i = 0;
+  uint32_t diff;
+
+  for (; n - i >= 64; i += 64)
+    {
+      __m256i e0 = _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i*) (s1 + i)),
+				      _mm256_loadu_si256 ((const __m256i*) (s2 + i)));
+      __m256i e1 = _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i*) (s1 + i + 32)),
+				      _mm256_loadu_si256 ((const __m256i*) (s2 + i + 32)));
+
+      if ((uint32_t) _mm256_movemask_epi8 (_mm256_and_si256 (e0, e1)) != 0xffffffffU)
+	{
+	  diff = ~(uint32_t) _mm256_movemask_epi8 (e0);
+	  if (diff != 0)
+	    {
+	      return i + xd3_ctz32 (diff);
+	    }
+	  return i + 32 + xd3_ctz32 (~(uint32_t) _mm256_movemask_epi8 (e1));
+	}
+    }
+
+  if (n - i >= 32)
+    {
+      diff = ~(uint32_t) _mm256_movemask_epi8 (
+	_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i*) (s1 + i)),
+			   _mm256_loadu_si256 ((const __m256i*) (s2 + i))));
+      if (diff != 0)
+	{
+	  return i + xd3_ctz32 (diff);
+	}
+      i += 32;
+    }
+
+  if (n - i >= 16)
+    {
+      diff = 0xffff ^ (uint32_t) _mm_movemask_epi8 (
+	_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*) (s1 + i)),
+			_mm_loadu_si128 ((const __m128i*) (s2 + i))));
+      if (diff != 0)
+	{
+	  return i + xd3_ctz32 (diff);
+	}
+      i += 16;
+    }
+
+  while (i < n && s1[i] == s2[i])
+    {
+      i++;
+    }
+  return i;
+}
+
+XD3_TARGET_AVX2 static usize_t
+xd3_backward_match_avx2 (const uint8_t *s1, const uint8_t *s2, usize_t n)
+{
+  usize_t i = 0;
+  uint32_t diff;
+
+  for (; n - i >= 64; i += 64)
+    {
+      __m256i e0 = _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i*) (s1 - i - 32)),
+				      _mm256_loadu_si256 ((const __m256i*) (s2 - i - 32)));
+      __m256i e1 = _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i*) (s1 - i - 64)),
+				      _mm256_loadu_si256 ((const __m256i*) (s2 - i - 64)));
+
+      if ((uint32_t) _mm256_movemask_epi8 (_mm256_and_si256 (e0, e1)) != 0xffffffffU)
+	{
+	  diff = ~(uint32_t) _mm256_movemask_epi8 (e0);
+	  if (diff != 0)
+	    {
+	      return i + xd3_clz32 (diff);
+	    }
+	  return i + 32 + xd3_clz32 (~(uint32_t) _mm256_movemask_epi8 (e1));
+	}
+    }
+
+  if (n - i >= 32)
+    {
+      diff = ~(uint32_t) _mm256_movemask_epi8 (
+	_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i*) (s1 - i - 32)),
+			   _mm256_loadu_si256 ((const __m256i*) (s2 - i - 32))));
+      if (diff != 0)
+	{
+	  return i + xd3_clz32 (diff);
+	}
+      i += 32;
+    }
+
+  if (n - i >= 16)
+    {
+      diff = 0xffff ^ (uint32_t) _mm_movemask_epi8 (
+	_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i*) (s1 - i - 16)),
+			_mm_loadu_si128 ((const __m128i*) (s2 - i - 16))));
+      if (diff != 0)
+	{
+	  return i + xd3_clz32 (diff) - 16;
+	}
+      i += 16;
+    }
+
+  while (i < n && s1[-1 - (ptrdiff_t) i] == s2[-1 - (ptrdiff_t) i])
+    {
+      i++;
+    }
+  return i;
+}
+
+#endif
+
+#if XD3_SIMD_NEON
+/* Narrowing the 0x00/0xff compare result by 4 bits leaves one nibble
+ * per byte in a 64-bit mask. */
+static inline uint64_t
+xd3_neon_diff (uint8x16_t a, uint8x16_t b)
+{
+  uint8x8_t m = vshrn_n_u16 (vreinterpretq_u16_u8 (vceqq_u8 (a, b)), 4);
+  return ~vget_lane_u64 (vreinterpret_u64_u8 (m), 0);
+}
+
+static usize_t
+xd3_forward_match_neon (const uint8_t *s1, const uint8_t *s2, usize_t n)
+{
+  usize_t i = 0;
+
+  for (; n - i >= 16; i += 16)
+    {
+      uint64_t diff = xd3_neon_diff (vld1q_u8 (s1 + i), vld1q_u8 (s2 + i));
+
+      if (diff != 0)
+	{
+	  return i + (xd3_ctz64 (diff) >> 2);
+	}
+    }
+
+  while (i < n && s1[i] == s2[i])
+    {
+      i++;
+    }
+  return i;
+}
+
+static usize_t
+xd3_backward_match_neon (const uint8_t *s1, const uint8_t *s2, usize_t n)
+{
+  usize_t i = 0;
+
+  for (; n - i >= 16; i += 16)
+    {
+      uint64_t diff = xd3_neon_diff (vld1q_u8 (s1 - i - 16),
+				     vld1q_u8 (s2 - i - 16));
+
+      if (diff != 0)
+	{
+	  return i + (xd3_clz64 (diff) >> 2);
+	}
+    }
+
+  return i + xd3_backward_match_scalar (s1 - i, s2 - i, n - i);
+}
+#endif
+
+/* Scalar until xd3_match_select runs from xd3_config_stream.  Streams
+ * are configured before their threads start, so the pointers are never
+ * stored while another thread calls them. */
+static xd3_match_func *xd3_forward_match = xd3_forward_match_scalar;
+static xd3_match_func *xd3_backward_match = xd3_backward_match_scalar;
+static int xd3_match_selected = 0;
+
+static void
+xd3_match_select (void)
+{
+  xd3_match_func *fwd = xd3_forward_match_scalar;
+  xd3_match_func *back = xd3_backward_match_scalar;
+
+  if (xd3_match_selected)
+    {
+      return;
+    }
+
+#if XD3_SIMD_SSE2
+  fwd = xd3_forward_match_sse2;
+  back = xd3_backward_match_sse2;
+#if XD3_SIMD_AVX2
+  if (CPU_IsSupported_AVX2 ())
+    {
+      fwd = xd3_forward_match_avx2;
+      back = xd3_backward_match_avx2;
+    }
+#endif
+#elif XD3_SIMD_NEON
+  fwd = xd3_forward_match_neon;
+  back = xd3_backward_match_neon;
+#endif
+
+  xd3_forward_match = fwd;
+  xd3_backward_match = back;
+  xd3_match_selected = 1;
+}
+
+#endif /* XD3_ENCODER */
+#endif /* _XDELTA3_MATCH_H_ */
@@ -0,0 +1,112 @@
+/* xdelta3 - delta compression tools and library
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/* Instruction sets the compiler can target for the vector code in
+ * xdelta3-match.h and adler32.  SSE2 and NEON are assumed where the
+ * compiler enables them; SSSE3 and AVX2 functions are compiled with
+ * XD3_TARGET_* and only called after CpuArch's runtime checks.
+ * Define XD3_SIMD=0 to build only the portable code. */
+
+#ifndef _XDELTA3_SIMD_H_
+#define _XDELTA3_SIMD_H_
+
+#ifndef XD3_SIMD
+#define XD3_SIMD 1
+#endif
+
+#if XD3_SIMD
+#include "CpuArch.h"
+#endif
+
+#if XD3_SIMD && defined(MY_CPU_X86_OR_AMD64) && \
+  (defined(__SSE2__) || defined(_M_X64) || \
+   (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define XD3_SIMD_SSE2 1
+#include <emmintrin.h>
+#if defined(_MSC_VER) || defined(__clang__) || \
+    (defined(__GNUC__) && __GNUC__ >= 5)
+#define XD3_SIMD_AVX2 1
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define XD3_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define XD3_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define XD3_TARGET_SSSE3
+#define XD3_TARGET_AVX2
+#endif
+#endif
+#elif XD3_SIMD && (defined(__ARM_NEON) || defined(_M_ARM64))
+#define XD3_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if XD3_SIMD_SSE2
+/* x must be non-zero */
+static inline unsigned
+xd3_ctz32 (uint32_t x)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long r;
+  _BitScanForward (&r, x);
+  return (unsigned) r;
+#else
+  return (unsigned) __builtin_ctz (x);
+#endif
+}
+
+static inline unsigned
+xd3_clz32 (uint32_t x)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long r;
+  _BitScanReverse (&r, x);
+  return 31 - (unsigned) r;
+#else
+  return (unsigned) __builtin_clz (x);
+#endif
+}
+#endif
+
+#if XD3_SIMD_NEON
+static inline unsigned
+xd3_ctz64 (uint64_t x)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long r;
+  _BitScanForward64 (&r, x);
+  return (unsigned) r;
+#else
+  return (unsigned) __builtin_ctzll (x);
+#endif
+}
+
+static inline unsigned
+xd3_clz64 (uint64_t x)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long r;
+  _BitScanReverse64 (&r, x);
+  return 63 - (unsigned) r;
+#else
+  return (unsigned) __builtin_clzll (x);
+#endif
+}
+#endif
+
+#endif /* _XDELTA3_SIMD_H_ */
@@ -643,7 +643,9 @@ extern const xd3_sec_type lzma_sec_type;
 
 /***********************************************************************/
 
+#include "xdelta3-simd.h"
 #include "xdelta3-hash.h"
+#include "xdelta3-match.h"
 
 /* Process template passes - this includes xdelta3.c several times. */
 #define __XDELTA3_C_TEMPLATE_PASS__
@@ -1081,7 +1083,7 @@ xd3_round_blksize (usize_t sz, usize_t blksz)
 #define A32_DO8(buf,i)  A32_DO4(buf,i); A32_DO4(buf,i+4);
 #define A32_DO16(buf)   A32_DO8(buf,0); A32_DO8(buf,8);
 
-static uint32_t adler32 (uint32_t adler, const uint8_t *buf, usize_t len)
+static uint32_t adler32_scalar (uint32_t adler, const uint8_t *buf, usize_t len)
 {
     uint32_t s1 = adler & 0xffffU;
     uint32_t s2 = (adler >> 16) & 0xffffU;
@@ -1116,6 +1118,145 @@ static uint32_t adler32 (uint32_t adler, const uint8_t *buf, usize_t len)
     return (s2 << 16) | s1;
 }
 
+/* The vector versions sum whole 32-byte blocks: s1 gets the byte sums
+ * (psadbw), s2 the bytes weighted 32..1 (pmaddubsw) plus 32 times the
+ * s1 value before each block, accumulated in v_ps.  A32_NMAX bounds
+ * the blocks between reductions exactly as in the scalar code. */
+#if XD3_SIMD_AVX2
+XD3_TARGET_SSSE3 static uint32_t
+adler32_ssse3 (uint32_t adler, const uint8_t *buf, usize_t len)
+{
+  uint32_t s1 = adler & 0xffffU;
+  uint32_t s2 = (adler >> 16) & 0xffffU;
+  const __m128i tap1 = _mm_setr_epi8 (32, 31, 30, 29, 28, 27, 26, 25,
+				      24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8 (16, 15, 14, 13, 12, 11, 10, 9,
+				      8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i ones = _mm_set1_epi16 (1);
+
+  while (len >= 32)
+    {
+      usize_t n = xd3_min (len / 32, A32_NMAX / 32);
+      __m128i v_ps = _mm_setr_epi32 (0, 0, 0, (int) (s1 * n));
+      __m128i v_s1 = zero;
+      __m128i v_s2 = _mm_setr_epi32 (0, 0, 0, (int) s2);
+
+      len -= n * 32;
+
+      do
+	{
+	  __m128i b1 = _mm_loadu_si128 ((const __m128i*) buf);
+	  __m128i b2 = _mm_loadu_si128 ((const __m128i*) (buf + 16));
+
+	  v_ps = _mm_add_epi32 (v_ps, v_s1);
+	  v_s1 = _mm_add_epi32 (v_s1, _mm_sad_epu8 (b1, zero));
+	  v_s1 = _mm_add_epi32 (v_s1, _mm_sad_epu8 (b2, zero));
+	  v_s2 = _mm_add_epi32 (v_s2, _mm_madd_epi16 (_mm_maddubs_epi16 (b1, tap1), ones));
+	  v_s2 = _mm_add_epi32 (v_s2, _mm_madd_epi16 (_mm_maddubs_epi16 (b2, tap2), ones));
+	  buf += 32;
+	}
+      while (--n);
+
+      v_s2 = _mm_add_epi32 (v_s2, _mm_slli_epi32 (v_ps, 5));
+
+      v_s1 = _mm_add_epi32 (v_s1, _mm_shuffle_epi32 (v_s1, _MM_SHUFFLE (1, 0, 3, 2)));
+      v_s1 = _mm_add_epi32 (v_s1, _mm_shuffle_epi32 (v_s1, _MM_SHUFFLE (2, 3, 0, 1)));
+      s1 += (uint32_t) _mm_cvtsi128_si32 (v_s1);
+
+      v_s2 = _mm_add_epi32 (v_s2, _mm_shuffle_epi32 (v_s2, _MM_SHUFFLE (1, 0, 3, 2)));
+      v_s2 = _mm_add_epi32 (v_s2, _mm_shuffle_epi32 (v_s2, _MM_SHUFFLE (2, 3, 0, 1)));
+      s2 = (uint32_t) _mm_cvtsi128_si32 (v_s2);
+
+      s1 %= A32_BASE;
+      s2 %= A32_BASE;
+    }
+
+  return adler32_scalar ((s2 << 16) | s1, buf, len);
+}
+
+XD3_TARGET_AVX2 static uint32_t
+adler32_avx2 (uint32_t adler, const uint8_t *buf, usize_t len)
+{
+  uint32_t s1 = adler & 0xffffU;
+  uint32_t s2 = (adler >> 16) & 0xffffU;
+  const __m256i tap = _mm256_setr_epi8 (32, 31, 30, 29, 28, 27, 26, 25,
+					24, 23, 22, 21, 20, 19, 18, 17,
+					16, 15, 14, 13, 12, 11, 10, 9,
+					8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i ones = _mm256_set1_epi16 (1);
+
+  while (len >= 32)
+    {
+      usize_t n = xd3_min (len / 32, A32_NMAX / 32);
+      __m256i v_ps = _mm256_setr_epi32 (0, 0, 0, 0, 0, 0, 0, (int) (s1 * n));
+      __m256i v_s1 = zero;
+      __m256i v_s2 = _mm256_setr_epi32 (0, 0, 0, 0, 0, 0, 0, (int) s2);
+      __m128i h1, h2;
+
+      len -= n * 32;
+
+      do
+	{
+	  __m256i b = _mm256_loadu_si256 ((const __m256i*) buf);
+
+	  v_ps = _mm256_add_epi32 (v_ps, v_s1);
+	  v_s1 = _mm256_add_epi32 (v_s1, _mm256_sad_epu8 (b, zero));
+	  v_s2 = _mm256_add_epi32 (v_s2, _mm256_madd_epi16 (_mm256_maddubs_epi16 (b, tap), ones));
+	  buf += 32;
+	}
+      while (--n);
+
+      v_s2 = _mm256_add_epi32 (v_s2, _mm256_slli_epi32 (v_ps, 5));
+
+      h1 = _mm_add_epi32 (_mm256_castsi256_si128 (v_s1), _mm256_extracti128_si256 (v_s1, 1));
+      h1 = _mm_add_epi32 (h1, _mm_shuffle_epi32 (h1, _MM_SHUFFLE (1, 0, 3, 2)));
+      h1 = _mm_add_epi32 (h1, _mm_shuffle_epi32 (h1, _MM_SHUFFLE (2, 3, 0, 1)));
+      s1 += (uint32_t) _mm_cvtsi128_si32 (h1);
+
+      h2 = _mm_add_epi32 (_mm256_castsi256_si128 (v_s2), _mm256_extracti128_si256 (v_s2, 1));
+      h2 = _mm_add_epi32 (h2, _mm_shuffle_epi32 (h2, _MM_SHUFFLE (1, 0, 3, 2)));
+      h2 = _mm_add_epi32 (h2, _mm_shuffle_epi32 (h2, _MM_SHUFFLE (2, 3, 0, 1)));
+      s2 = (uint32_t) _mm_cvtsi128_si32 (h2);
+
+      s1 %= A32_BASE;
+      s2 %= A32_BASE;
+    }
+
+  return adler32_scalar ((s2 << 16) | s1, buf, len);
+}
+#endif
+
+/* Scalar until xd3_adler32_select runs from xd3_config_stream, which is
+ * before any thread of the stream can checksum a window. */
+static uint32_t (*adler32) (uint32_t adler, const uint8_t *buf, usize_t len) = adler32_scalar;
+static int adler32_selected = 0;
+
+static void xd3_adler32_select (void)
+{
+  uint32_t (*fn) (uint32_t, const uint8_t*, usize_t) = adler32_scalar;
+
+  if (adler32_selected)
+    {
+      return;
+    }
+
+#if XD3_SIMD_AVX2
+  if (CPU_IsSupported_AVX2 ())
+    {
+      fn = adler32_avx2;
+    }
+  else if (CPU_IsSupported_SSSE3 ())
+    {
+      fn = adler32_ssse3;
+    }
+#endif
+
+  adler32 = fn;
+  adler32_selected = 1;
+}
+
 /***********************************************************************
  Run-length function
  ***********************************************************************/
@@ -1572,7 +1713,10 @@ xd3_free_stream (xd3_stream *stream)
     }
 
 #if XD3_ENCODER
-  xd3_free (stream, stream->large_table);
+  if (! stream->large_shared)
+    {
+      xd3_free (stream, stream->large_table);
+    }
   xd3_free (stream, stream->small_table);
   xd3_free (stream, stream->large_hash.powers);
   xd3_free (stream, stream->small_hash.powers);
@@ -1684,6 +1828,12 @@ xd3_config_stream(xd3_stream *stream,
   /* Initial setup: no error checks yet */
   memset (stream, 0, sizeof (*stream));
 
+  /* Pick the SIMD functions before any thread can use them. */
+  xd3_adler32_select ();
+#if XD3_ENCODER
+  xd3_match_select ();
+#endif
+
   stream->winsize = config->winsize ? config->winsize : XD3_DEFAULT_WINSIZE;
   stream->sprevsz = config->sprevsz ? config->sprevsz : XD3_DEFAULT_SPREVSZ;
 
@@ -1702,6 +1852,8 @@ xd3_config_stream(xd3_stream *stream,
   stream->free      = config->freef ? config->freef : __xd3_free_func;
   stream->opaque    = config->opaque;
   stream->flags     = config->flags;
+  stream->parallel  = config->parallel;
+  stream->index_threads = config->index_threads;
 
   /* Secondary setup. */
   stream->sec_data  = config->sec_data;
@@ -2692,7 +2844,7 @@ xd3_emit_hdr (xd3_stream *stream)
   usize_t inst_len;
   usize_t addr_len;
 
-  if (stream->current_window == 0)
+  if (stream->current_window == 0 && (stream->flags & XD3_NOHEADER) == 0)
     {
       uint8_t hdr_ind = 0;
       int use_appheader  = stream->enc_appheader != NULL;
@@ -3021,6 +3173,108 @@ xd3_encode_init_partial (xd3_stream *stream)
   return xd3_encode_init (stream, 0);
 }
 
+int
+xd3_encode_index_source (xd3_stream *stream)
+{
+  usize_t next_move_point;
+  int ret;
+
+  if (stream->enc_state != ENC_INIT || stream->src == NULL ||
+      ! stream->src->eof_known ||
+      stream->src->max_winsize < xd3_source_eof (stream->src))
+    {
+      stream->msg = "source cannot be indexed in advance";
+      return XD3_INVALID;
+    }
+
+  if ((ret = xd3_encode_init_full (stream)) ||
+      (ret = xd3_string_match_init (stream)) ||
+      (ret = xd3_srcwin_move_point (stream, &next_move_point)))
+    {
+      return ret;
+    }
+
+  stream->enc_state = ENC_INPUT;
+  return 0;
+}
+
+int
+xd3_encode_share_source (xd3_stream *stream, xd3_stream *indexed)
+{
+  if (indexed->src == NULL || indexed->large_table == NULL ||
+      ! indexed->src->eof_known || stream->src == NULL ||
+      ! stream->src->eof_known ||
+      xd3_source_eof (stream->src) != xd3_source_eof (indexed->src) ||
+      indexed->srcwin_cksum_pos != xd3_source_eof (indexed->src))
+    {
+      stream->msg = "source index cannot be shared";
+      return XD3_INVALID;
+    }
+
+  return xd3_encode_load_source_index (stream, indexed->large_table,
+				       indexed->large_hash.size,
+				       indexed->smatcher.large_look,
+				       indexed->smatcher.large_step);
+}
+
+int
+xd3_encode_source_index (xd3_stream *stream, const usize_t **table,
+			 usize_t *slots, usize_t *look, usize_t *step)
+{
+  if (stream->src == NULL || stream->large_table == NULL ||
+      ! stream->src->eof_known ||
+      stream->srcwin_cksum_pos != xd3_source_eof (stream->src))
+    {
+      stream->msg = "source index is not complete";
+      return XD3_INVALID;
+    }
+
+  *table = stream->large_table;
+  *slots = stream->large_hash.size;
+  *look = stream->smatcher.large_look;
+  *step = stream->smatcher.large_step;
+  return 0;
+}
+
+int
+xd3_encode_load_source_index (xd3_stream *stream, const usize_t *table,
+			      usize_t slots, usize_t look, usize_t step)
+{
+  int ret;
+
+  if (stream->enc_state != ENC_INIT || stream->src == NULL ||
+      ! stream->src->eof_known)
+    {
+      stream->msg = "source index cannot be loaded";
+      return XD3_INVALID;
+    }
+
+  /* Checked before xd3_encode_init_full(), which sizes large_hash
+   * the same way, so a failed load can still index the source. */
+  if ((1U << xd3_size_hashtable_bits ((usize_t) (stream->src->max_winsize /
+						  stream->smatcher.large_step))) != slots ||
+      stream->smatcher.large_look != look ||
+      stream->smatcher.large_step != step)
+    {
+      stream->msg = "source index configuration differs";
+      return XD3_INVALID;
+    }
+
+  if ((ret = xd3_encode_init_full (stream)))
+    {
+      return ret;
+    }
+
+  XD3_ASSERT (stream->large_hash.size == slots);
+
+  /* The table is complete, so it is never written through. */
+  stream->large_table = (usize_t*) table;
+  stream->large_shared = 1;
+  stream->srcwin_cksum_pos = xd3_source_eof (stream->src);
+  stream->enc_state = ENC_INPUT;
+  return 0;
+}
+
 /* Called after the ENC_POSTOUT state, this puts the output buffers
  * back into separate lists and re-initializes some variables.  (The
  * output lists were spliced together during the ENC_FLUSH state.) */
@@ -3841,41 +4095,6 @@ xd3_source_match_setup (xd3_stream *stream, xoff_t srcpos)
   return 1;
 }
 
-static inline usize_t
-xd3_forward_match(const uint8_t *s1c, const uint8_t *s2c, usize_t n)
-{
-  usize_t i = 0;
-#if UNALIGNED_OK
-  usize_t nint = n / sizeof(int);
-
-  if (nint >> 3)
-    {
-      usize_t j = 0;
-      const int *s1 = (const int*)s1c;
-      const int *s2 = (const int*)s2c;
-      usize_t nint_8 = nint - 8;
-
-      while (i <= nint_8 &&
-	     s1[i++] == s2[j++] &&
-	     s1[i++] == s2[j++] &&
-	     s1[i++] == s2[j++] &&
-	     s1[i++] == s2[j++] &&
-	     s1[i++] == s2[j++] &&
-	     s1[i++] == s2[j++] &&
-	     s1[i++] == s2[j++] &&
-	     s1[i++] == s2[j++]) { }
-
-      i = (i - 1) * sizeof(int);
-    }
-#endif
-
-  while (i < n && s1c[i] == s2c[i])
-    {
-      i++;
-    }
-  return i;
-}
-
 /* This function expands the source match backward and forward.  It is
  * reentrant, since xd3_getblk may return XD3_GETSRCBLK, so most
  * variables are kept in xd3_stream.  There are two callers of this
@@ -3953,16 +4172,16 @@ xd3_source_extend_match (xd3_stream *stream)
 	  IF_DEBUG2(DP(RINT "[maxback] maxback %"W"u trysrc %"Q"u/%"W"u tgt %"W"u tryrem %"W"u\n",
 		       stream->match_maxback, tryblk, tryoff, streamoff, tryrem));
 
-	  /* TODO: This code can be optimized similar to xd3_match_forward() */
-	  for (; tryrem != 0; tryrem -= 1, stream->match_back += 1)
-	    {
-	      if (src->curblk[tryoff-1] != stream->next_in[streamoff-1])
-		{
-		  goto doneback;
-		}
+	  matched = xd3_backward_match(src->curblk + tryoff,
+				       stream->next_in + streamoff,
+				       tryrem);
+	  tryoff -= matched;
+	  streamoff -= matched;
+	  stream->match_back += matched;
 
-	      tryoff    -= 1;
-	      streamoff -= 1;
+	  if (tryrem != matched)
+	    {
+	      goto doneback;
 	    }
 	}
 
@@ -4321,6 +4540,137 @@ xd3_verify_run_state (xd3_stream    *stream,
 }
 #endif /* XD3_DEBUG */
 
+/* Parallel source indexing.  The serial loop in xd3_srcwin_move_point
+ * visits a block's positions from high to low, so every large_table
+ * slot ends up with the lowest position of the block that hashes to
+ * it, or keeps its entry from an earlier (lower) block.  The tasks
+ * reproduce that with a compare-and-swap that only replaces entries
+ * below the block's first position or above the one being inserted,
+ * so the table and the delta do not depend on the thread count. */
+#define XD3_PARALLEL_INDEX_MIN (1U << 16) /* positions per task */
+
+typedef struct _xd3_index_job xd3_index_job;
+
+struct _xd3_index_job
+{
+  xd3_stream    *stream;
+  xoff_t         blkbaseoffset;
+  ssize_t        blkpos;   /* highest position, the others step down */
+  usize_t        count;    /* positions */
+  usize_t        tasks;
+  usize_t        floor;    /* lowest table value of this block */
+};
+
+/* Stores val into *p if it still holds old, returns the value found. */
+static inline usize_t
+xd3_cas_usize (usize_t *p, usize_t old, usize_t val)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+#if SIZEOF_USIZE_T == 8
+  return (usize_t) _InterlockedCompareExchange64 ((volatile __int64*) p,
+						  (__int64) val, (__int64) old);
+#else
+  return (usize_t) _InterlockedCompareExchange ((volatile long*) p,
+						(long) val, (long) old);
+#endif
+#else
+  __atomic_compare_exchange_n (p, &old, val, 0,
+			       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  return old;
+#endif
+}
+
+static inline void
+xd3_index_insert (usize_t *slot, usize_t val, usize_t floor)
+{
+  usize_t cur = *(volatile usize_t*) slot;
+
+  while (cur < floor || cur > val)
+    {
+      usize_t seen = xd3_cas_usize (slot, cur, val);
+
+      if (seen == cur)
+	{
+	  break;
+	}
+      cur = seen;
+    }
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define XD3_PREFETCH_W(p) __builtin_prefetch ((p), 1)
+#elif XD3_SIMD_SSE2
+#define XD3_PREFETCH_W(p) _mm_prefetch ((const char*) (p), _MM_HINT_T0)
+#else
+#define XD3_PREFETCH_W(p)
+#endif
+
+/* Unlike the serial stores, an insert must read its slot first.  Slots
+ * are prefetched this many inserts ahead so the reads overlap. */
+#define XD3_INDEX_AHEAD 16
+
+static void
+xd3_index_task (void *arg, usize_t index)
+{
+  xd3_index_job *job = (xd3_index_job*) arg;
+  xd3_stream *stream = job->stream;
+  const uint8_t *blk = stream->src->curblk;
+  usize_t *table = stream->large_table;
+  usize_t look = stream->smatcher.large_look;
+  usize_t step = stream->smatcher.large_step;
+  usize_t k = (usize_t) ((xoff_t) job->count * index / job->tasks);
+  usize_t kend = (usize_t) ((xoff_t) job->count * (index + 1) / job->tasks);
+  usize_t ring_hval[XD3_INDEX_AHEAD];
+  usize_t ring_val[XD3_INDEX_AHEAD];
+  usize_t n = 0, i;
+
+  while (k < kend)
+    {
+      ssize_t pos = job->blkpos - (ssize_t) (k * step);
+      usize_t cksums[XD3_CKSUM_BATCH];
+      usize_t m = xd3_min (kend - k, XD3_CKSUM_BATCH);
+
+      if (m == XD3_CKSUM_BATCH)
+	{
+	  xd3_large_cksum_batch (&stream->large_hash, blk + pos, look, step,
+				 cksums);
+	}
+      else
+	{
+	  for (i = 0; i < m; i++)
+	    {
+	      cksums[i] = xd3_large_cksum (&stream->large_hash,
+					   blk + pos - (ssize_t) (i * step),
+					   look);
+	    }
+	}
+
+      for (i = 0; i < m; i++, n++, pos -= step)
+	{
+	  usize_t r = n % XD3_INDEX_AHEAD;
+	  usize_t hval = xd3_checksum_hash (& stream->large_hash, cksums[i]);
+
+	  if (n >= XD3_INDEX_AHEAD)
+	    {
+	      xd3_index_insert (&table[ring_hval[r]], ring_val[r], job->floor);
+	    }
+
+	  XD3_PREFETCH_W (&table[hval]);
+	  ring_hval[r] = hval;
+	  ring_val[r] = (usize_t) (job->blkbaseoffset +
+				   (xoff_t)(pos + HASH_CKOFFSET));
+	}
+
+      k += m;
+    }
+
+  for (i = n > XD3_INDEX_AHEAD ? n - XD3_INDEX_AHEAD : 0; i < n; i++)
+    {
+      usize_t r = i % XD3_INDEX_AHEAD;
+      xd3_index_insert (&table[ring_hval[r]], ring_val[r], job->floor);
+    }
+}
+
 /* This function computes more source checksums to advance the window.
  * Called at every entrance to the string-match loop and each time
  * stream->input_position reaches the value returned as
@@ -4445,11 +4795,61 @@ xd3_srcwin_move_point (xd3_stream *stream, usize_t *next_move_point)
       blkpos -= stream->smatcher.large_look;
       blkbaseoffset = stream->src->blksize * blkno;
 
-      do
+      /* The block always gets at least the checksum at blkpos. */
+      if (blkpos < oldpos)
+	{
+	  oldpos = blkpos;
+	}
+
+      if (stream->index_threads > 1 && stream->parallel != NULL &&
+	  (usize_t) (blkpos - oldpos) / stream->smatcher.large_step >=
+	  stream->index_threads * XD3_PARALLEL_INDEX_MIN)
+	{
+	  xd3_index_job job;
+
+	  job.stream = stream;
+	  job.blkbaseoffset = blkbaseoffset;
+	  job.blkpos = blkpos;
+	  job.count = (usize_t) (blkpos - oldpos) / stream->smatcher.large_step + 1;
+	  job.tasks = stream->index_threads;
+	  job.floor = (usize_t) (blkbaseoffset + (xoff_t)(oldpos + HASH_CKOFFSET));
+
+	  stream->parallel (stream->opaque, xd3_index_task, &job, job.tasks);
+	  IF_DEBUG (stream->large_ckcnt += job.count);
+
+	  blkpos -= (ssize_t) (job.count * stream->smatcher.large_step);
+	}
+
+      /* Same insertion order as the loop below: later (lower)
+       * positions overwrite earlier ones in large_table. */
+      while (blkpos - oldpos >=
+	     (ssize_t) ((XD3_CKSUM_BATCH - 1) * stream->smatcher.large_step))
+	{
+	  usize_t cksums[XD3_CKSUM_BATCH];
+	  int k;
+
+	  xd3_large_cksum_batch (&stream->large_hash,
+				 stream->src->curblk + blkpos,
+				 stream->smatcher.large_look,
+				 stream->smatcher.large_step,
+				 cksums);
+
+	  for (k = 0; k < XD3_CKSUM_BATCH; k++)
+	    {
+	      usize_t hval = xd3_checksum_hash (& stream->large_hash, cksums[k]);
+
+	      stream->large_table[hval] =
+		(usize_t) (blkbaseoffset +
+			   (xoff_t)(blkpos + HASH_CKOFFSET));
+
+	      IF_DEBUG (stream->large_ckcnt += 1);
+
+	      blkpos -= stream->smatcher.large_step;
+	    }
+	}
+
+      while (blkpos >= oldpos)
 	{
-	  /* TODO: This would be significantly faster if the compiler
-	   * knew stream->smatcher.large_look (which the template for
-	   * xd3_string_match_* allows). */
 	  usize_t cksum = xd3_large_cksum (&stream->large_hash, 
 					   stream->src->curblk + blkpos,
 					   stream->smatcher.large_look);
@@ -4463,7 +4863,6 @@ xd3_srcwin_move_point (xd3_stream *stream, usize_t *next_move_point)
 
 	  blkpos -= stream->smatcher.large_step;
 	}
-      while (blkpos >= oldpos);
 
       stream->srcwin_cksum_pos = (blkno + 1) * stream->src->blksize;
     }
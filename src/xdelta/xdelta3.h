@@ -368,6 +368,16 @@ typedef int    (xd3_getblk_func)   (xd3_stream *stream,
 
 typedef const xd3_dinst* (xd3_code_table_func) (void);
 
+/* Optional: runs task (arg, 0) ... task (arg, count - 1) concurrently
+ * and returns once all of them have finished.  With index_threads > 1
+ * the encoder uses it to checksum large source blocks in parallel. */
+typedef void   (xd3_parallel_task) (void       *arg,
+				    usize_t     index);
+typedef void   (xd3_parallel_func) (void       *opaque,
+				    xd3_parallel_task *task,
+				    void       *arg,
+				    usize_t     count);
+
 
 #ifdef _WIN32
 #define vsnprintf_func _vsnprintf
@@ -496,6 +506,9 @@ typedef enum
 				    * matching.  Greedy is off by
 				    * default. */
   XD3_ADLER32_RECODE = (1 << 15),  /* used by "recode". */
+  XD3_NOHEADER       = (1 << 16),  /* encoder: omit the VCDIFF file
+				    * header, the windows are appended
+				    * to another stream's output. */
 
   /* 4 bits to set the compression level the same as the command-line
    * setting -1 through -9 (-0 corresponds to the XD3_NOCOMPRESS flag,
@@ -786,6 +799,7 @@ struct _xd3_sec_cfg
   usize_t            ngroups;       /* Number of DJW Huffman groups. */
   usize_t            sector_size;   /* Sector size. */
   int                inefficient;   /* If true, ignore efficiency check [avoid XD3_NOSECOND]. */
+  int                level;         /* LZMA preset, 0 takes the XD3_COMPLEVEL bits. */
 };
 
 /* This is the user-visible stream configuration. */
@@ -815,6 +829,9 @@ struct _xd3_config
   xd3_smatch_cfg     smatch_cfg;    /* See enum: use fields below  for
 				       soft config */
   xd3_smatcher       smatcher_soft;
+
+  xd3_parallel_func *parallel;      /* Source indexing threads, see */
+  usize_t            index_threads; /* xd3_parallel_func */
 };
 
 /* The primary source file object. You create one of these objects and
@@ -912,7 +929,13 @@ struct _xd3_stream
 
   xd3_smatcher      smatcher;
 
+  xd3_parallel_func *parallel;         /* runs source indexing tasks */
+  usize_t            index_threads;    /* tasks per indexed block */
+
   usize_t           *large_table;      /* table of large checksums */
+  int                large_shared;     /* large_table belongs to another
+					  stream or a loaded index, see
+					  xd3_encode_share_source() */
   xd3_hash_cfg       large_hash;       /* large hash config */
 
   usize_t           *small_table;      /* table of small checksums */
@@ -1318,6 +1341,33 @@ int     xd3_get_appheader (xd3_stream     *stream,
  * set stream->enc_state to ENC_INSTR and call xd3_encode_input as usual.
  */
 int xd3_encode_init_partial (xd3_stream *stream);
+
+/* Window-parallel encoding against one source index:
+ *
+ *   xd3_encode_index_source() -- builds the complete source checksum
+ *   table before the first xd3_encode_input().  The source must be
+ *   set with xd3_set_source_and_size() and fit in max_winsize.
+ *
+ *   xd3_encode_share_source() -- lets another stream with the same
+ *   configuration and source match against that table instead of
+ *   building its own.  The table is only read, so any number of
+ *   streams can encode concurrently while the indexed stream lives.
+ *   Combined with XD3_NOHEADER, each stream can encode one range of
+ *   the target and the outputs are concatenated in order.
+ *
+ *   xd3_encode_source_index() -- returns the complete table and the
+ *   slot count, checksum width and step it was built with, e.g. to
+ *   save it for later runs against the same source.
+ *
+ *   xd3_encode_load_source_index() -- instead of indexing, installs a
+ *   table returned by xd3_encode_source_index() for the same source
+ *   and configuration.  It is only read and must outlive the stream. */
+int xd3_encode_index_source (xd3_stream *stream);
+int xd3_encode_share_source (xd3_stream *stream, xd3_stream *indexed);
+int xd3_encode_source_index (xd3_stream *stream, const usize_t **table,
+			     usize_t *slots, usize_t *look, usize_t *step);
+int xd3_encode_load_source_index (xd3_stream *stream, const usize_t *table,
+				  usize_t slots, usize_t look, usize_t step);
 void xd3_init_cache (xd3_addr_cache* acache);
 int xd3_found_match (xd3_stream *stream,
 		     usize_t pos, usize_t size,
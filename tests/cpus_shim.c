@@ -0,0 +1,16 @@
+/* Preloaded by roundtrip.sh for the threaded cases: reports 4 online CPUs, so sdiffer and spatcher take their
+ * threaded paths on single-CPU machines too */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <unistd.h>
+
+long sysconf(int name) {
+    static long (*next_sysconf)(int) = NULL;
+    if (name == _SC_NPROCESSORS_ONLN) {
+        return 4;
+    }
+    if (!next_sysconf) {
+        next_sysconf = (long (*)(int))dlsym(RTLD_NEXT, "sysconf");
+    }
+    return next_sysconf(name);
+}
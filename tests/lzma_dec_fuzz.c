@@ -0,0 +1,136 @@
+/* Decodes bit-flipped and truncated LZMA streams and prints one line per case: result, status, bytes written,
+ * bytes consumed and a hash of the output. The test builds this file with the reference byte-wise match copy,
+ * the default 8-byte match copy and _LZMA_DEC_BRANCHLESS, lzma_dec_fuzz.sh checks that all of them print the
+ * same lines. Unmodified streams must also decode to their input.
+ * Usage: lzma_dec_fuzz <cases per stream> */
+#include "LzmaDec.h"
+#include "LzmaEnc.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CORPUS_SIZE (512 * 1024)
+
+static void *fuzz_alloc(ISzAllocPtr p, size_t size) { return malloc(size); }
+static void fuzz_free(ISzAllocPtr p, void *address) { free(address); }
+static ISzAlloc allocator = { fuzz_alloc, fuzz_free };
+
+static uint32_t seed = 12345;
+
+/* Same LCG everywhere, so every variant sees the same streams and mutations */
+static uint32_t next_random() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static uint64_t hash_bytes(const uint8_t *data, size_t size) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    while (size--) {
+        h = (h ^ *data++) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/* Numbered lines, compressed with lc4 lp2 pb2 like the text profiles */
+static void make_text(uint8_t *data, size_t size) {
+    size_t pos = 0;
+    uint32_t line = 0;
+    while (pos < size) {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%u %u\n", line++, next_random() % 1000);
+        size_t n = size - pos < (size_t)len ? size - pos : (size_t)len;
+        memcpy(data + pos, buf, n);
+        pos += n;
+    }
+}
+
+/* Random bytes mixed with copies at distances 1-64, so matches overlap their source within a word */
+static void make_binary(uint8_t *data, size_t size) {
+    size_t pos = 0;
+    while (pos < size) {
+        size_t len = 4 + next_random() % 60, i;
+        if (len > size - pos) len = size - pos;
+        if (pos >= 64 && next_random() % 2) {
+            size_t dist = 1 + next_random() % 64;
+            for (i = 0; i < len; ++i) data[pos + i] = data[pos + i - dist];
+        } else {
+            for (i = 0; i < len; ++i) data[pos + i] = (uint8_t)next_random();
+        }
+        pos += len;
+    }
+}
+
+static int fuzz_stream(const char *name, const uint8_t *data, size_t size, int lc, int lp, int pb, int cases) {
+    int ret = -1, i;
+    CLzmaEncProps props;
+    uint8_t header[LZMA_PROPS_SIZE];
+    SizeT header_size = LZMA_PROPS_SIZE, packed_size = size + size / 2 + 4096;
+    uint8_t *packed = malloc(packed_size), *mutated = malloc(packed_size), *out = malloc(size);
+    if (!packed || !mutated || !out) {
+        fprintf(stderr, "Out of memory!\n");
+        goto end;
+    }
+    LzmaEncProps_Init(&props);
+    props.level = 6;
+    props.lc = lc;
+    props.lp = lp;
+    props.pb = pb;
+    props.reduceSize = size;
+    if (LzmaEncode(packed, &packed_size, data, size, &props, header, &header_size, 1, NULL, &allocator, &allocator)
+        != SZ_OK) {
+        fprintf(stderr, "%s: encoding failed!\n", name);
+        goto end;
+    }
+    for (i = 0; i < cases; ++i) {
+        SizeT out_size = size, in_size = packed_size;
+        ELzmaStatus status;
+        SRes res;
+        memcpy(mutated, packed, packed_size);
+        /* case 0 is the stream as encoded, the others flip 1-8 bits and a quarter of them are also truncated */
+        if (i > 0) {
+            int flips = 1 + next_random() % 8, j;
+            for (j = 0; j < flips; ++j) {
+                mutated[next_random() % packed_size] ^= (uint8_t)(1 << (next_random() % 8));
+            }
+            if (next_random() % 4 == 0) {
+                in_size = next_random() % packed_size;
+            }
+        }
+        res = LzmaDecode(out, &out_size, mutated, &in_size, header, LZMA_PROPS_SIZE, LZMA_FINISH_ANY, &status,
+                         &allocator);
+        if (i == 0 && (res != SZ_OK || out_size != size || memcmp(out, data, size) != 0)) {
+            fprintf(stderr, "%s: unmodified stream does not decode to its input!\n", name);
+            goto end;
+        }
+        fprintf(stdout, "%s %d: %d %d %lu %lu %016llx\n", name, i, res, (int)status, (unsigned long)out_size,
+                (unsigned long)in_size, (unsigned long long)hash_bytes(out, out_size));
+    }
+    ret = 0;
+
+end:
+    free(packed);
+    free(mutated);
+    free(out);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    int cases = argc > 1 ? atoi(argv[1]) : 200;
+    uint8_t *data = malloc(CORPUS_SIZE);
+    int ret = 1;
+    if (!data) {
+        fprintf(stderr, "Out of memory!\n");
+        return 1;
+    }
+    make_text(data, CORPUS_SIZE);
+    if (fuzz_stream("text", data, CORPUS_SIZE, 4, 2, 2, cases) != 0) goto end;
+    make_binary(data, CORPUS_SIZE);
+    if (fuzz_stream("binary", data, CORPUS_SIZE, 3, 0, 2, cases) != 0) goto end;
+    ret = 0;
+
+end:
+    free(data);
+    return ret;
+}
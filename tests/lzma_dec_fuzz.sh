@@ -0,0 +1,35 @@
+#!/bin/sh
+# Runs lzma_dec_fuzz built with each decoder variant and checks that they all agree with the reference
+# byte-copy build on every stream.
+# Usage: lzma_dec_fuzz.sh <work dir> <reference build> <variant build>...
+
+WORK=$1
+REFERENCE=$2
+failed=0
+
+if [ -z "$WORK" ] || [ -z "$REFERENCE" ] || [ -z "$3" ]; then
+    echo "Usage: lzma_dec_fuzz.sh <work dir> <reference build> <variant build>..." >&2
+    exit 2
+fi
+shift 2
+rm -rf "$WORK"
+mkdir -p "$WORK"
+
+if ! "$REFERENCE" 400 > "$WORK/reference.txt"; then
+    echo "FAIL reference: $REFERENCE failed"
+    exit 1
+fi
+for variant in "$@"; do
+    name=$(basename "$variant")
+    if ! "$variant" 400 > "$WORK/$name.txt"; then
+        echo "FAIL $name: decoder failed"
+        failed=1
+    elif ! diff "$WORK/reference.txt" "$WORK/$name.txt" > "$WORK/$name.diff"; then
+        echo "FAIL $name: decoded differently from the reference, see $WORK/$name.diff"
+        failed=1
+    else
+        echo "ok   $name: $(wc -l < "$WORK/$name.txt") cases"
+    fi
+done
+
+exit $failed
@@ -0,0 +1,218 @@
+#!/bin/sh
+# Builds patches with sdiffer for every entry type and output option, applies them with spatcher
+# and compares the result with the target tree.
+# Usage: roundtrip.sh <sdiffer> <spatcher> <work dir> [<cpus shim>]
+# The optional shim is preloaded for the threaded cases, so they take the threaded paths on a single CPU too.
+
+SDIFFER=$1
+SPATCHER=$2
+WORK=$3
+CPUS_SHIM=$4
+failed=0
+from=old
+to=new
+threaded=
+
+if [ -z "$SDIFFER" ] || [ -z "$SPATCHER" ] || [ -z "$WORK" ]; then
+    echo "Usage: roundtrip.sh <sdiffer> <spatcher> <work dir> [<cpus shim>]" >&2
+    exit 2
+fi
+rm -rf "$WORK"
+mkdir -p "$WORK"
+cd "$WORK" || exit 2
+
+# Deterministic pseudo-random lines, $1 = seed, $2 = count
+lines() {
+    awk -v seed="$1" -v n="$2" 'BEGIN { x = seed; for (i = 0; i < n; i++) { x = (x * 1103515245 + 12345) % 2147483648; print i, x } }'
+}
+
+# x86 code with E8/E9 branches so the branch filter has something to convert, $1 = seed
+code() {
+    i=0
+    while [ $i -lt 200 ]; do
+        printf '\125\110\211\345\350\020\000\000\000\351\040\001\000\000'
+        printf '%s\n' "$1 $i"
+        i=$((i + 1))
+    done
+}
+
+mkdir -p old/sub old/data new/sub new/data new/added
+lines 1 30000 > old/text.txt
+lines 1 30000 | sed 's/^\([0-9]*7\) /\1 edited /' > new/text.txt
+code 1 > old/prog.exe
+code 1 > new/prog.exe
+code 2 >> new/prog.exe
+lines 2 20000 > old/data/moved.dat
+cp old/data/moved.dat new/data/moved.dat
+lines 3 500 > old/sub/keep.txt
+cp old/sub/keep.txt new/sub/keep.txt
+lines 4 100 > old/deleted.txt
+lines 5 3000 > new/sub/added.txt
+# an added file reusing most of an old one, for chunk_dedup
+{ lines 6 100; sed -n '2000,18000p' old/data/moved.dat; lines 7 100; } > new/added/copy.dat
+for i in 1 2 3 4 5 6; do
+    lines $((10 + i)) 200 > new/added/small$i.json
+done
+: > new/added/empty.txt
+
+# Runs a command with the CPU count shim preloaded when $threaded is set
+run() {
+    if [ -n "$threaded" ] && [ -n "$CPUS_SHIM" ]; then
+        LD_PRELOAD="$CPUS_SHIM" "$@"
+    else
+        "$@"
+    fi
+}
+
+# roundtrip <name> <[output] keys> [<[profile:default] keys>], diffs $from against $to
+roundtrip() {
+    rm -rf patched
+    printf '[compare]\nfrom=%s\nto=%s\n[output]\npath=%s.bin\n%b\n[profile:default]\n%b\n' \
+        "$from" "$to" "$1" "$2" "$3" > "$1.ini"
+    if ! run "$SDIFFER" "$1.ini" > "$1.sdiffer.log" 2>&1; then
+        echo "FAIL $1: sdiffer failed, see $WORK/$1.sdiffer.log"
+        failed=1
+        return
+    fi
+    cp -r "$from" patched
+    if ! run "$SPATCHER" "$1.bin" patched > "$1.spatcher.log" 2>&1; then
+        echo "FAIL $1: spatcher failed, see $WORK/$1.spatcher.log"
+        failed=1
+        return
+    fi
+    if ! diff -r "$to" patched > "$1.diff"; then
+        echo "FAIL $1: patched tree differs, see $WORK/$1.diff"
+        failed=1
+        return
+    fi
+    echo "ok   $1"
+}
+
+# expect <name> <sdiffer|spatcher> <pattern>, checks that a case took the path it is meant to cover
+expect() {
+    if ! grep -q "$3" "$1.$2.log" 2>/dev/null; then
+        echo "FAIL $1: no '$3' in $WORK/$1.$2.log"
+        failed=1
+    fi
+}
+
+roundtrip raw 'compress=0'
+roundtrip lzma 'compress=1'
+roundtrip solid 'compress=1\nsolid=1'
+roundtrip align 'compress=1\nalign=4K'
+roundtrip name_table 'compress=1\nname_table=1'
+roundtrip fast 'compress=1' 'codec=fast'
+roundtrip primed 'compress=1' 'primed=1'
+roundtrip filter 'compress=1' 'filter=x86'
+roundtrip suffix_array 'compress=1' 'engine=sa'
+roundtrip chunk_dedup 'compress=0\nchunk_dedup=4K'
+roundtrip chunk_dedup_lzma 'compress=1\nchunk_dedup=4K'
+expect chunk_dedup sdiffer '^Chunk references: [1-9]'
+expect chunk_dedup_lzma sdiffer '^Chunk references: [1-9]'
+roundtrip secondary 'compress=1' 'secondary=lzma'
+
+# The lzma case's patch as an added file, sampling finds nothing to gain on it
+cp -r new gain
+cp lzma.bin gain/added/packed.bin
+to=gain
+roundtrip min_gain 'compress=1\nmin_gain=2'
+expect min_gain sdiffer 'Incompressible'
+to=new
+
+# The second run takes its lc/lp/pb from the cache the first one wrote
+roundtrip autotune 'compress=1\nautotune=1\nautotune_cache=autotune.tune'
+roundtrip autotune_cached 'compress=1\nautotune=1\nautotune_cache=autotune.tune'
+expect autotune sdiffer '^Autotune: [1-9]'
+expect autotune_cached sdiffer ' 0 ms in trials'
+roundtrip no_window_checksum 'compress=1\nwindow_checksum=0'
+
+# A large file with scattered edits and 6 MB of new lines, so the CHANGE payload passes the 1 MiB pipeline
+# threshold in spatcher
+mkdir -p big/old big/new
+lines 40 1100000 > big/old/big.dat
+{ sed -n '1,500000p' big/old/big.dat; lines 41 350000; sed -n '500001,$p' big/old/big.dat; } \
+    | sed 's/^\([0-9]*999\) /\1 edited /' > big/new/big.dat
+from=big/old
+to=big/new
+threaded=1
+roundtrip pipeline 'compress=1'
+[ -n "$CPUS_SHIM" ] && expect pipeline spatcher '^Pipeline:'
+roundtrip index_threads 'compress=1\nindex_threads=4'
+[ -n "$CPUS_SHIM" ] && expect index_threads sdiffer '^Parallel source indexing'
+roundtrip encode_threads 'compress=1\nencode_threads=4'
+expect encode_threads sdiffer '^Window-parallel encoding'
+# The second run maps the index the first one saved
+threaded=
+roundtrip index_cache 'compress=1\nindex_cache=index_cache'
+roundtrip index_cache_loaded 'compress=1\nindex_cache=index_cache'
+expect index_cache sdiffer '^Source index cache: 0 loaded, 1 saved'
+expect index_cache_loaded sdiffer '^Source index cache: 1 loaded, 0 saved'
+# The source hash table and LZMA match finder are large enough for huge page blocks here
+roundtrip huge_pages 'compress=1\nhuge_pages=1'
+threaded=
+from=old
+to=new
+
+# Multi-base patches: base1 differs from base2 in y.txt and in 200 more files that base2 and base3 share,
+# base2 and base3 differ only in z.txt, so the bases are told apart only with both y.txt and z.txt as probes.
+# `other` matches none of them
+mkdir -p multi/base1 multi/base2
+i=0
+while [ $i -lt 200 ]; do
+    lines $((1000 + i)) 20 > multi/base1/d$i.txt
+    lines $((2000 + i)) 20 > multi/base2/d$i.txt
+    i=$((i + 1))
+done
+lines 30 300 > multi/base1/y.txt
+lines 31 300 > multi/base1/z.txt
+lines 32 300 > multi/base2/y.txt
+cp multi/base1/z.txt multi/base2/z.txt
+cp -r multi/base2 multi/base3
+lines 33 300 > multi/base3/z.txt
+lines 34 100 > multi/base3/only3.txt
+cp -r multi/base1 multi/target
+lines 35 300 > multi/target/y.txt
+lines 36 300 > multi/target/new.txt
+cp -r multi/base1 multi/other
+lines 37 300 > multi/other/y.txt
+lines 38 300 > multi/other/z.txt
+
+printf '[compare]\nfrom=multi/base1\nfrom=multi/base2\nfrom=multi/base3\nto=multi/target\n[output]\npath=multi.bin\ncompress=1\n' > multi.ini
+if ! "$SDIFFER" multi.ini > multi.sdiffer.log 2>&1; then
+    echo "FAIL multi: sdiffer failed, see $WORK/multi.sdiffer.log"
+    failed=1
+else
+    for base in base1 base2 base3; do
+        rm -rf patched
+        cp -r multi/$base patched
+        if ! "$SPATCHER" multi.bin patched > multi.$base.log 2>&1; then
+            echo "FAIL multi $base: spatcher failed, see $WORK/multi.$base.log"
+            failed=1
+        elif ! diff -r multi/target patched > multi.$base.diff; then
+            echo "FAIL multi $base: patched tree differs, see $WORK/multi.$base.diff"
+            failed=1
+        else
+            echo "ok   multi $base"
+        fi
+    done
+    rm -rf patched
+    cp -r multi/other patched
+    if "$SPATCHER" multi.bin patched > multi.other.log 2>&1; then
+        echo "FAIL multi other: a tree matching none of the bases was patched"
+        failed=1
+    else
+        echo "ok   multi other rejected"
+    fi
+fi
+
+# Identical bases cannot be told apart, sdiffer has to refuse them
+cp -r multi/base1 multi/copy1
+printf '[compare]\nfrom=multi/base1\nfrom=multi/copy1\nto=multi/target\n[output]\npath=same.bin\ncompress=1\n' > same.ini
+if "$SDIFFER" same.ini > same.sdiffer.log 2>&1; then
+    echo "FAIL same: sdiffer accepted two identical bases"
+    failed=1
+else
+    echo "ok   same bases rejected"
+fi
+
+exit $failed
@@ -0,0 +1,96 @@
+/* Checks the SIMD adler32 variants against adler32_scalar and xd3_large_cksum_batch against xd3_large_cksum on
+ * random lengths, alignments and seeds. xdelta3.c is included to reach its static functions, variants the CPU
+ * does not support are skipped.
+ * Usage: xdelta_cksum [<cases>] */
+#include "xdelta3.c"
+
+#define BUFFER_SIZE (1024 * 1024 + 64)
+
+static uint32_t seed = 12345;
+
+static uint32_t next_random() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static int check_adler32(const char *name, uint32_t (*fn)(uint32_t, const uint8_t*, usize_t), uint32_t adler,
+                         const uint8_t *buf, usize_t len) {
+    uint32_t expected = adler32_scalar(adler, buf, len), got = fn(adler, buf, len);
+    if (got != expected) {
+        fprintf(stderr, "%s: adler32 %08x of %u bytes at %p is %08x, expected %08x\n", name, adler, (unsigned)len,
+                (const void*)buf, got, expected);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int cases = argc > 1 ? atoi(argv[1]) : 2000;
+    int failures = 0, i;
+    uint8_t *buf = malloc(BUFFER_SIZE);
+    xd3_stream stream;
+    if (!buf) {
+        fprintf(stderr, "Out of memory!\n");
+        return 1;
+    }
+    for (i = 0; i < BUFFER_SIZE; ++i) {
+        buf[i] = (uint8_t)next_random();
+    }
+    if (adler32_scalar(1, (const uint8_t*)"Wikipedia", 9) != 0x11E60398U) {
+        fprintf(stderr, "adler32_scalar: wrong checksum of \"Wikipedia\"\n");
+        ++failures;
+    }
+    /* binds adler32 to the variant this CPU uses */
+    if (xd3_config_stream(&stream, NULL) != 0) {
+        fprintf(stderr, "Error create stream!\n");
+        return 1;
+    }
+
+    for (i = 0; i < cases; ++i) {
+        /* mostly short inputs around the vector widths, some long enough to cross the 5552-byte reduction */
+        usize_t len = next_random() % (i % 8 == 0 ? 1024 * 1024 : 300);
+        const uint8_t *p = buf + next_random() % 64;
+        uint32_t adler = ((next_random() % 65521) << 16) | (next_random() % 65521);
+        failures += check_adler32("adler32", adler32, adler, p, len);
+#if XD3_SIMD_AVX2
+        if (CPU_IsSupported_SSSE3()) {
+            failures += check_adler32("adler32_ssse3", adler32_ssse3, adler, p, len);
+        }
+        if (CPU_IsSupported_AVX2()) {
+            failures += check_adler32("adler32_avx2", adler32_avx2, adler, p, len);
+        }
+#endif
+    }
+
+    for (i = 0; i < cases; ++i) {
+        xd3_hash_cfg cfg;
+        usize_t look = 4 + next_random() % 61, step = 1 + next_random() % 64, cksums[XD3_CKSUM_BATCH], k;
+        const uint8_t *base = buf + 3 * 64 + next_random() % (BUFFER_SIZE - 4 * 64 - 64);
+        memset(&cfg, 0, sizeof(cfg));
+        if (xd3_size_hashtable(&stream, 1U << 16, look, &cfg) != 0) {
+            fprintf(stderr, "Out of memory!\n");
+            return 1;
+        }
+        xd3_large_cksum_batch(&cfg, base, look, step, cksums);
+        for (k = 0; k < XD3_CKSUM_BATCH; ++k) {
+            usize_t expected = xd3_large_cksum(&cfg, base - k * step, look);
+            if (cksums[k] != expected) {
+                fprintf(stderr, "xd3_large_cksum_batch: window %u (look %u, step %u) differs from xd3_large_cksum\n",
+                        (unsigned)k, (unsigned)look, (unsigned)step);
+                ++failures;
+            }
+        }
+        xd3_free(&stream, cfg.powers);
+    }
+
+    fprintf(stdout, "%d case(s), adler32 variants:%s%s%s, %d failure(s)\n", cases, " scalar",
+#if XD3_SIMD_AVX2
+            CPU_IsSupported_SSSE3() ? " ssse3" : "", CPU_IsSupported_AVX2() ? " avx2" : "",
+#else
+            "", "",
+#endif
+            failures);
+    xd3_free_stream(&stream);
+    free(buf);
+    return failures ? 1 : 0;
+}